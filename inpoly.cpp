@@ -0,0 +1,55 @@
+/* > inpoly.cpp
+ */
+
+/*
+ * Point in polygon test used by QCT::coordInsideMap, see inpoly.h.
+ */
+
+/*
+ * Includes
+ */
+#include "inpoly.h"
+
+
+/* -------------------------------------------------------------------------
+ * Count the edges crossed by a ray from the point towards +y.  Each edge
+ * is taken from its smaller x to its larger x and crosses when x1 < xt <=
+ * x2 and the point is below it; the products are done in 64 bits so they
+ * cannot overflow.
+ */
+int
+inpoly(unsigned int poly[][2], int npoints, unsigned int xt, unsigned int yt)
+{
+	unsigned int xnew, ynew, xold, yold, x1, y1, x2, y2;
+	int ii, inside = 0;
+
+	if (npoints < 3)
+		return 0;
+
+	xold = poly[npoints-1][0];
+	yold = poly[npoints-1][1];
+	for (ii=0; ii<npoints; ii++)
+	{
+		xnew = poly[ii][0];
+		ynew = poly[ii][1];
+		if (xnew > xold)
+		{
+			x1 = xold; x2 = xnew;
+			y1 = yold; y2 = ynew;
+		}
+		else
+		{
+			x1 = xnew; x2 = xold;
+			y1 = ynew; y2 = yold;
+		}
+		if ((xnew < xt) == (xt <= xold)
+			&& ((long long)yt - (long long)y1) * (long long)(x2 - x1)
+			 < ((long long)y2 - (long long)y1) * (long long)(xt - x1))
+		{
+			inside = !inside;
+		}
+		xold = xnew;
+		yold = ynew;
+	}
+	return inside;
+}
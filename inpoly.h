@@ -0,0 +1,18 @@
+/* > inpoly.h
+ */
+
+
+#ifndef INPOLY_H
+#define INPOLY_H
+
+
+/* -------------------------------------------------------------------------
+ * Even-odd test of whether point (xt,yt) is inside the polygon of npoints
+ * vertices poly[i][0],poly[i][1] (the last joined back to the first).
+ * Unsigned integer coordinates so there is no rounding.
+ * Returns 1 if inside, 0 if outside or if there are fewer than 3 points.
+ */
+int inpoly(unsigned int poly[][2], int npoints, unsigned int xt, unsigned int yt);
+
+
+#endif // !INPOLY_H
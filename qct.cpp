@@ -38,19 +38,63 @@ static const char SCCSid[] = "@(#)qct.c         1.11 (C) 2010 arb mapLib: Extrac
 #include <time.h>    // for ctime
 #include <math.h>    // for log2
 #include <errno.h>   // for errno
-#include "satlib/dundee.h" // for byte order
 #include "inpoly.h"  // check if coord inside polygon (int coords)
 #include "qct.h"
-
-#ifdef USE_GIFLIB
-#include "gif/gif.h"
-#endif
+#include "qcttiles.h"
+#include "qctbytes.h" // for little-endian values in memory
 
 #ifdef USE_PNG
 #include <png.h>
 #endif
 
-#ifdef USE_TIFF
+#ifdef USE_ZLIB
+#include <zlib.h>    // for TIFF Deflate compression
+#endif
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+// SIMD palette expansion, chosen at run time (see expandPixels)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QCT_X86_SIMD
+#include <immintrin.h>
+#endif
+#include <unistd.h>  // for sysconf
+#include <sys/stat.h> // for mkdir
+#ifdef __linux__
+#include <fcntl.h>    // for vmsplice
+#include <sys/uio.h>
+#include <sys/mman.h>
+#endif
+
+/*
+ * Byte order
+ */
+#if defined( SUNOS ) || defined( SOLARIS ) || defined( SUN4 ) || defined( solaris ) || defined( sun4 ) || defined( sun )
+#include <sys/isa_defs.h>
+#elif defined( MSDOS ) || defined( WIN32 )
+#define _LITTLE_ENDIAN
+#elif defined ( linux ) || defined ( __linux__ )
+#include <endian.h>
+# if __BYTE_ORDER == __LITTLE_ENDIAN
+#  ifndef _LITTLE_ENDIAN
+#   define _LITTLE_ENDIAN
+#  endif
+# else
+#  ifndef _BIG_ENDIAN
+#   define _BIG_ENDIAN
+#  endif
+# endif
+#elif defined ( __CYGWIN__ ) || defined ( __APPLE__ )
+#define _LITTLE_ENDIAN
+#else
+#error Unknown byte sex
+#endif
+
+// Nearest integer
+#ifndef NINT
+#define NINT(x) ((int)floor((x)+0.5))
 #endif
 
 /*
@@ -97,6 +141,7 @@ static const char SCCSid[] = "@(#)qct.c         1.11 (C) 2010 arb mapLib: Extrac
 #define QCT_MAGIC 0x1423D5FF
 #define QCT_TILE_SIZE 64
 #define QCT_TILE_PIXELS (QCT_TILE_SIZE*QCT_TILE_SIZE)
+#define QCT_TILE_MAX_BYTES (64*QCT_TILE_PIXELS) // more than any packing needs
 // RGB stored packed in an int, Blue is LSB
 #define PAL_RED(c)   ((c>>16)&255)
 #define PAL_GREEN(c) ((c>>8)&255)
@@ -175,26 +220,28 @@ readString(FILE *fp)
 	char *string;
 	int string_length = 0, buf_length = 1024;
 
-	string = (char*)malloc(buf_length);
 	ii = readInt(fp);
 	if (ii == 0)
 		return(strdup(""));
+	string = (char*)malloc(buf_length);
 	current_offset = FTELLO(fp);
 	string_offset = ii; // yes, offsets are limited to 32-bits :-(
 	FSEEKO(fp, string_offset, SEEK_SET);
 	while (1)
 	{
 		ii = fgetc(fp);
-		string[string_length] = ii;
-		if (ii == 0)
+		// A truncated file ends the string
+		if (ii == 0 || ii == EOF)
 			break;
+		string[string_length] = ii;
 		string_length++;
-		if (string_length > buf_length)
+		if (string_length >= buf_length)
 		{
 			buf_length += 1024;
 			string = (char*)realloc(string, buf_length);
 		}
 	}
+	string[string_length] = '\0';
 	string = (char*)realloc(string, string_length+1);
 	FSEEKO(fp, current_offset, SEEK_SET);
 	return(string);
@@ -220,6 +267,105 @@ bits_per_pixel(int num_colours)
 }
 
 
+/* -------------------------------------------------------------------------
+ * Call fn(arg, ii) for ii = 0 to count-1 using up to nthreads threads
+ * (0 means one per processor).  The calls may happen in any order so
+ * each must only touch its own part of the data.
+ * Without USE_PTHREADS the calls are simply made in order.
+ */
+#ifdef USE_PTHREADS
+struct ParallelFor
+{
+	void (*fn)(void *arg, int ii);
+	void *arg;
+	int count, next;
+	pthread_mutex_t mutex;
+};
+
+static void *
+parallelForThread(void *arg)
+{
+	ParallelFor *pf = (ParallelFor*)arg;
+	int ii;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pf->mutex);
+		ii = pf->next++;
+		pthread_mutex_unlock(&pf->mutex);
+		if (ii >= pf->count)
+			break;
+		pf->fn(pf->arg, ii);
+	}
+	return NULL;
+}
+#endif
+
+
+void
+parallelFor(int count, int nthreads, void (*fn)(void *arg, int ii), void *arg)
+{
+	int ii;
+
+#ifdef USE_PTHREADS
+	if (nthreads < 1)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads > 1)
+	{
+		ParallelFor pf;
+		pthread_t *threads = (pthread_t*)malloc((nthreads-1) * sizeof(pthread_t));
+		int started = 0;
+		pf.fn = fn;
+		pf.arg = arg;
+		pf.count = count;
+		pf.next = 0;
+		pthread_mutex_init(&pf.mutex, NULL);
+		if (threads)
+		{
+			for (started=0; started<nthreads-1; started++)
+				if (pthread_create(&threads[started], NULL, parallelForThread, &pf))
+					break;
+		}
+		// This thread does its share too
+		parallelForThread(&pf);
+		for (ii=0; ii<started; ii++)
+			pthread_join(threads[ii], NULL);
+		if (threads) free(threads);
+		pthread_mutex_destroy(&pf.mutex);
+		return;
+	}
+#endif
+	for (ii=0; ii<count; ii++)
+		fn(arg, ii);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Built-in palette transforms (see addPaletteTransform).
+ */
+static int
+duskColour(int rgb, void *)
+{
+	return ((PAL_RED(rgb) * 5 / 8) << 16) | ((PAL_GREEN(rgb) * 5 / 8) << 8) | (PAL_BLUE(rgb) * 5 / 8);
+}
+
+// Dark and slightly red so it does not spoil night vision
+static int
+nightColour(int rgb, void *)
+{
+	return ((PAL_RED(rgb) * 5 / 16) << 16) | ((PAL_GREEN(rgb) * 3 / 16) << 8) | (PAL_BLUE(rgb) * 3 / 16);
+}
+
+static int
+greyColour(int rgb, void *)
+{
+	int grey = (PAL_RED(rgb) * 299 + PAL_GREEN(rgb) * 587 + PAL_BLUE(rgb) * 114 + 500) / 1000;
+	return (grey << 16) | (grey << 8) | grey;
+}
+
+
 /* -------------------------------------------------------------------------
  * Class to read a QCT map image.
  */
@@ -229,7 +375,17 @@ QCT::QCT()
 	width = height = 0;
 	scalefactor = 1;
 	image_data = NULL;
+	image_masked = false;
 	memset(palette, 0, sizeof(palette));
+	memset(out_palette, 0, sizeof(out_palette));
+
+	// Palette variants
+	num_palettes = 0;
+	current_palette = -1;
+	addPaletteTransform("day", NULL);
+	addPaletteTransform("dusk", duskColour);
+	addPaletteTransform("night", nightColour);
+	addPaletteTransform("grey", greyColour);
 
 	// Metadata
 	metadata.title = metadata.name = metadata.ident = metadata.edition = metadata.revision = NULL;
@@ -237,6 +393,7 @@ QCT::QCT()
 	metadata.depths = metadata.heights = metadata.projection = NULL;
 	metadata.origfilename = NULL;
 	metadata.maptype = metadata.diskname = NULL;
+	metadata.associateddata = metadata.license_description = NULL;
 
 	// Outline
 	metadata.num_outline = 0;
@@ -245,25 +402,94 @@ QCT::QCT()
 	// Offsets to tiles
 	metadata.image_index = NULL;
 
+	// Outline rasterised into spans
+	outline_mask = false;
+	outline_row_start = outline_spans = NULL;
+	outline_tiles = NULL;
+
+	// Whole image written
+	crop_x = crop_y = crop_w = crop_h = 0;
+
+	// Outline point index
+	outline_edges = NULL;
+	outline_bucket_start = NULL;
+	outline_buckets = 0;
+	memset(outline_box, 0, sizeof(outline_box));
+
+	// Vector overlay
+	overlay_segs = NULL;
+	overlay_refs = NULL;
+	overlay_head = overlay_tail = NULL;
+	num_overlay_segs = max_overlay_segs = 0;
+	num_overlay_refs = max_overlay_refs = 0;
+	num_overlay_colours = 0;
+
+	// Coordinate grid
+	grid_latlon = NULL;
+	grid_spacing = grid_nx = grid_ny = grid_scale = 0;
+	grid_error = grid_inv_spacing = 0;
+
+	// Decoded tiles for random access
+	tile_cache = NULL;
+	tile_length = NULL;
+	tile_mutex = NULL;
+	tile_cond = NULL;
+	memset(view_tiles, 0, sizeof(view_tiles));
+	memset(view_used, 0, sizeof(view_used));
+	view_frame = 0;
+	view_bytes = 0;
+	view_limit = QCT_VIEW_CACHE;
+	view_missing = 0;
+#ifdef USE_PTHREADS
+	tile_mutex = malloc(sizeof(pthread_mutex_t));
+	if (tile_mutex)
+		pthread_mutex_init((pthread_mutex_t*)tile_mutex, NULL);
+	tile_cond = malloc(sizeof(pthread_cond_t));
+	if (tile_cond)
+		pthread_cond_init((pthread_cond_t*)tile_cond, NULL);
+#endif
+
 	// Program options
 	verbose = debug = debug_kml_outline = debug_kml_boundary = 0;
+	nthreads = 0;
 	dfp = stdout;
 }
 
 
 QCT::~QCT()
 {
+	int ii;
+
 	closeFilename();
+	for (ii=0; ii<num_palettes; ii++)
+		free(palette_names[ii]);
+#ifdef USE_PTHREADS
+	if (tile_mutex)
+	{
+		pthread_mutex_destroy((pthread_mutex_t*)tile_mutex);
+		free(tile_mutex);
+	}
+	if (tile_cond)
+	{
+		pthread_cond_destroy((pthread_cond_t*)tile_cond);
+		free(tile_cond);
+	}
+#endif
 }
 
 
 #define FREE_POINTER(P) if (P) { free(P); P = NULL; }
 
+// In a tile cache slot while another thread decodes the tile
+static unsigned char tile_loading;
+#define TILE_LOADING (&tile_loading)
+
 void
 QCT::unloadImage()
 {
 	// Image data
 	FREE_POINTER(image_data);
+	image_masked = false;
 }
 
 void
@@ -285,11 +511,52 @@ QCT::unloadMetadata()
 	FREE_POINTER(metadata.origfilename);
 	FREE_POINTER(metadata.maptype);
 	FREE_POINTER(metadata.diskname);
+	FREE_POINTER(metadata.associateddata);
+	FREE_POINTER(metadata.license_description);
 	// Map outline
 	FREE_POINTER(metadata.outline_lat);
 	FREE_POINTER(metadata.outline_lon);
+	FREE_POINTER(outline_row_start);
+	FREE_POINTER(outline_spans);
+	FREE_POINTER(outline_tiles);
+	FREE_POINTER(outline_edges);
+	FREE_POINTER(outline_bucket_start);
+	outline_buckets = 0;
 	// Offsets to tiles
 	FREE_POINTER(metadata.image_index);
+	FREE_POINTER(tile_length);
+}
+
+
+void
+QCT::unloadTiles()
+{
+	int ii;
+
+	if (tile_cache == NULL)
+		return;
+	for (ii=0; ii<width*height; ii++)
+		FREE_POINTER(tile_cache[ii]);
+	FREE_POINTER(tile_cache);
+}
+
+
+void
+QCT::unloadViewCache()
+{
+	int ii, lv;
+
+	for (lv=0; lv<QCT_VIEW_LEVELS; lv++)
+	{
+		if (view_tiles[lv])
+		{
+			for (ii=0; ii<width*height; ii++)
+				FREE_POINTER(view_tiles[lv][ii]);
+		}
+		FREE_POINTER(view_tiles[lv]);
+		FREE_POINTER(view_used[lv]);
+	}
+	view_bytes = 0;
 }
 
 
@@ -297,6 +564,10 @@ void
 QCT::unload()
 {
 	unloadImage();
+	unloadTiles();
+	unloadViewCache();
+	clearOverlay();
+	unloadGeoGrid();
 	unloadMetadata();
 }
 
@@ -355,18 +626,73 @@ QCT::debugmsg(const char *fmt, ...)
 /* -------------------------------------------------------------------------
  * fp is assumed to be open and pointing at the start of the tile data already
  * xx,yy are offsets (from 0,0 topleft) of the *tile* number
- * Pixels are put at the appropriate bytes in the class var image_data.
+ * Pixels are put into dest which points to the top left corner of the
+ * tile within a buffer whose rows are bytes_per_row apart (image_data
+ * or a strip buffer).  tile_length must have been found.
+ */
+void
+QCT::readTile(FILE *fp, unsigned char *dest, int bytes_per_row, int tile_xx, int tile_yy, int scalefactor)
+{
+	int length = tile_length ? tile_length[tile_yy*width+tile_xx] : 0;
+	unsigned char *data = NULL;
+	size_t got = 0;
+
+	if (length > 0 && (data = (unsigned char*)malloc(length)) != NULL)
+		got = fread(data, 1, length, fp);
+	unpackTile(data, (int)got, dest, bytes_per_row, tile_xx, tile_yy, scalefactor);
+	free(data);
+	drawOverlay(dest, bytes_per_row, tile_xx, tile_yy, scalefactor);
+}
+
+
+/*
+ * The bytes of one tile in memory, read as fgetc and readInt would read
+ * them from the file.
+ */
+struct TileBytes
+{
+	const unsigned char *pp, *end;
+};
+
+static inline int
+tileByte(TileBytes *tb)
+{
+	return (tb->pp < tb->end) ? *tb->pp++ : EOF;
+}
+
+static inline int
+tileInt(TileBytes *tb)
+{
+	int vv;
+
+	if (tb->end - tb->pp < 4)
+	{
+		tb->pp = tb->end;
+		return -1;
+	}
+	vv = (int)getLong(tb->pp);
+	tb->pp += 4;
+	return vv;
+}
+
+
+/*
+ * As readTile but from the length bytes of the tile already in memory,
+ * and without the overlay, so it only reads the chart's own tables and
+ * can run without holding tile_mutex.  Nothing is written if the tile
+ * is empty.
  */
 void
-QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
+QCT::unpackTile(const unsigned char *data, int length, unsigned char *dest, int bytes_per_row, int tile_xx, int tile_yy, int scalefactor)
 {
+	TileBytes tb = { data, data + length };
 	unsigned char tile_data[QCT_TILE_PIXELS];
-	unsigned char *row_ptr[QCT_TILE_SIZE];
 	int packing;
-	int row, bytes_per_row;
 	int pixelnum = 0;
 	int ii;
 	// Rows are interleaved in this order (reverse binary)
+	// NB. reversing the bits twice gives the original so this table
+	// maps both from file row to image row and from image row to file row.
 	static int row_seq[] =
 	{
 		0,  32, 16, 48,  8, 40, 24, 56,  4, 36, 20, 52, 12, 44, 28, 60, 2,
@@ -376,40 +702,17 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 	};
 
 
-	debugmsg("Tile %d, %d starts at file offset 0x%x", tile_xx, tile_yy, FTELLO(fp));
+	if (length < 1)
+		return;
+	debugmsg("Tile %d, %d starts at file offset 0x%x", tile_xx, tile_yy, metadata.image_index[tile_yy*width+tile_xx]);
 
 	// Determine which method was used to pack this tile
-	packing = fgetc(fp);
+	packing = tileByte(&tb);
 
 	debugmsg("Reading tile %d, %d; packed using %s", tile_xx, tile_yy, ((packing==0||packing==255)?"huffman":(packing>127?"pixel":"RLE")));
 
 	memset(tile_data, 0, QCT_TILE_PIXELS);
 
-	// Size for one whole row in image_data
-	bytes_per_row = width * QCT_TILE_SIZE / scalefactor;
-
-	// Calculate pointer into image_data for each row in this tile
-	if (scalefactor == 1)
-	{
-		for (row=0; row<QCT_TILE_SIZE; row++)
-		{
-			// Top left corner of tile within image
-			row_ptr[row] = image_data + (tile_yy * QCT_TILE_SIZE * bytes_per_row) + (tile_xx * QCT_TILE_SIZE);
-			// Interleaved rows in the above sequence
-			row_ptr[row] += row_seq[row] * bytes_per_row;
-		}
-	}
-	else
-	{
-		for (row=0; row<QCT_TILE_SIZE; row++)
-		{
-			// Top left corner of tile within image
-			row_ptr[row] = image_data + (tile_yy * QCT_TILE_SIZE / scalefactor * bytes_per_row) + (tile_xx * QCT_TILE_SIZE / scalefactor);
-			// Interleaved rows in the above sequence
-			row_ptr[row] += row_seq[row] * bytes_per_row;
-		}
-	}
-
 	// Uncompress each row
 	if (packing == 0 || packing == 255)
 	{
@@ -423,12 +726,18 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 		int num_branches = 0;
 		while (num_colours <= num_branches)
 		{
-			huff[huff_idx] = getc(fp);
+			// A truncated table would never end
+			if (tb.pp == tb.end)
+			{
+				free(huff);
+				return;
+			}
+			huff[huff_idx] = tileByte(&tb);
 			// Relative jump further than 128 needs two more bytes
 			if (huff[huff_idx] == 128)
 			{
-				huff[++huff_idx] = getc(fp);
-				huff[++huff_idx] = getc(fp);
+				huff[++huff_idx] = tileByte(&tb);
+				huff[++huff_idx] = tileByte(&tb);
 				num_branches++;
 			}
 			// Relative jump nearer is encoded directly
@@ -469,24 +778,33 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 					else if (huff[ii] == 128)
 					{
 						if (ii+2 >= huff_idx)
+						{
+							free(huff);
 							return;
+						}
 						delta = 65537 - (256 * huff[ii+2] + huff[ii+1]) + 2;
 						if (ii+delta >= huff_idx)
+						{
+							free(huff);
 							return;
+						}
 						ii += 2;
 					}
 					else
 					{
 						delta = 257 - huff[ii];
 						if (ii+delta >= huff_idx)
+						{
+							free(huff);
 							return;
+						}
 					}
 				}
 			}
 			// Read tile data one bit at a time following branches in Huffman tree
 			int bits_left = 8;
 			int bit_value;
-			ii = fgetc(fp);
+			ii = tileByte(&tb);
 			while (pixelnum < QCT_TILE_PIXELS)
 			{
 				// If entry is a colour then output it
@@ -504,7 +822,7 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 				bits_left--;
 				if (bits_left == 0)
 				{
-					ii = fgetc(fp);
+					ii = tileByte(&tb);
 					bits_left = 8;
 				}
 				// Now check value to see whether to follow branch or not
@@ -532,6 +850,7 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 				}
 			}
 		}
+		free(huff);
 	}
 
 	else if (packing > 128)
@@ -546,14 +865,14 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 		// Read the sub-palette
 		for (ii=0; ii<num_sub_colours; ii++)
 		{
-			palette_index[ii] = fgetc(fp);
+			palette_index[ii] = tileByte(&tb);
 			debugmsg("PACKED: palette %d = %d", ii, palette_index[ii]);
 		}
 		// Read the pixels in 4-byte words and unpack the bits from each
 		while (pixelnum < QCT_TILE_PIXELS)
 		{
 			int colour, runs;
-			ii = readInt(fp);
+			ii = tileInt(&tb);
 			for (runs = 0; runs < num_pixels_per_word; runs++)
 		 	{
 				colour = ii & mask;
@@ -567,8 +886,8 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 	{
 		// An encrypted type of packing??
 		debugmsg("unknown packing %02x %02x %02x %02x %02x %02x %02x %02x",
-			fgetc(fp), fgetc(fp), fgetc(fp), fgetc(fp),
-			fgetc(fp), fgetc(fp), fgetc(fp), fgetc(fp));
+			tileByte(&tb), tileByte(&tb), tileByte(&tb), tileByte(&tb),
+			tileByte(&tb), tileByte(&tb), tileByte(&tb), tileByte(&tb));
 	}
 
 	else
@@ -581,13 +900,15 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 		//debugmsg("RLE: sub-palette size is %d (uses %d bits) mask 0x%x", num_sub_colours, num_low_bits, pal_mask);
 		for (ii=0; ii<num_sub_colours; ii++)
 		{
-			palette_index[ii] = fgetc(fp);
+			palette_index[ii] = tileByte(&tb);
 			//debugmsg("RLE palette %d = %d", ii, palette_index[ii]);
 		}
 		while (pixelnum < QCT_TILE_PIXELS)
 		{
 			int colour, runs;
-			ii = fgetc(fp);
+			ii = tileByte(&tb);
+			if (ii == EOF)
+				break;
 			colour = ii & pal_mask;
 			runs = ii >> num_low_bits;
 			//debugmsg("RLE value 0x%x is colour %d for %d runs [%d..%d]", ii, colour, runs, pixelnum, pixelnum+runs);
@@ -604,19 +925,19 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 		int yy;
 		for (yy=0; yy<QCT_TILE_SIZE; yy++)
 		{
-			memcpy(row_ptr[yy], tile_data+yy*QCT_TILE_SIZE, QCT_TILE_SIZE);
+			memcpy(dest + row_seq[yy] * bytes_per_row, tile_data+yy*QCT_TILE_SIZE, QCT_TILE_SIZE);
 		}
 	}
 	else
 	{
 		int xx, yy, nn;
-		unsigned char *row;
-		unsigned char *src = tile_data;
+		unsigned char *src;
 		for (yy=0; yy<QCT_TILE_SIZE/scalefactor; yy++)
 		{
-			unsigned char *dest = row_ptr[yy*scalefactor];
+			unsigned char *dst = dest + yy * bytes_per_row;
 			unsigned char pix;
-			src = tile_data + (yy*QCT_TILE_SIZE);
+			// Image row yy*scalefactor is held in file row row_seq[yy*scalefactor]
+			src = tile_data + (row_seq[yy*scalefactor]*QCT_TILE_SIZE);
 			// Interpolate the colours of all pixels to be combined
 			// only does it horizontally in this row
 			// XXX should interpolate all in corresponding rows below too.
@@ -627,7 +948,7 @@ QCT::readTile(FILE *fp, int tile_xx, int tile_yy, int scalefactor)
 				{
 					pix = pal_interp[pix][*src++];
 				}
-				*dest++ = pix;
+				*dst++ = pix;
 			}
 		}
 	}
@@ -802,6 +1123,7 @@ QCT::loadMetadata(FILE *fp)
 	{
 		pal_interp[ii][jj] = (unsigned char)fgetc(fp);
 	}
+	applyPalette();
 
 	// Image index (width * height offsets)
 	metadata.image_index = (int*)calloc(width * height, sizeof(int*));
@@ -809,41 +1131,306 @@ QCT::loadMetadata(FILE *fp)
 		return false;
 	for (ii=0; ii<width * height; ii++)
 		metadata.image_index[ii] = readInt(fp);
+	if (ferror(fp) || feof(fp))
+	{
+		throwError("cannot read header (file truncated)");
+		return false;
+	}
+
+	// Needs both the outline and georeferencing
+	buildOutlineSpans();
+	buildOutlineIndex();
 
 	return true;
 }
 
 
+/* -------------------------------------------------------------------------
+ * Decode one row of tiles (QCT_TILE_SIZE/scalefactor image rows) into strip
+ * which must have room for getStripHeight() rows of getImageWidth() bytes.
+ * This allows the image to be processed without ever holding all of it
+ * in memory, see loadImage and the write methods.
+ * With the outline mask, tiles entirely outside the outline are not read
+ * at all, and only tiles crossing it are masked.
+ */
+bool
+QCT::readStrip(int tile_yy, unsigned char *strip)
+{
+	return readStripTiles(tile_yy, strip, 0, width);
+}
+
+
+/*
+ * As readStrip but only tiles first_tile to last_tile-1 are decoded, the
+ * rest of the strip is left blank.
+ */
+bool
+QCT::readStripTiles(int tile_yy, unsigned char *strip, int first_tile, int last_tile)
+{
+	int xx, cls;
+	int bytes_per_row = getImageWidth();
+	int tile_width = QCT_TILE_SIZE / scalefactor;
+
+	if (qctfp == NULL || metadata.image_index == NULL)
+		return false;
+	if (tile_yy < 0 || tile_yy >= height)
+		return false;
+	if (first_tile < 0) first_tile = 0;
+	if (last_tile > width) last_tile = width;
+
+	if (!findTileLengths())
+		return false;
+
+	// Tiles which fail to unpack are left blank
+	memset(strip, 0, getStripHeight() * bytes_per_row);
+
+	for (xx=first_tile; xx<last_tile; xx++)
+	{
+		OFF_T tile_offset;
+		cls = (outline_mask && outline_tiles) ? outline_tiles[tile_yy*width+xx] : OUTLINE_TILE_INSIDE;
+		if (cls == OUTLINE_TILE_OUTSIDE)
+		{
+			maskSpans(tile_yy * getStripHeight(), getStripHeight(), xx * tile_width, (xx+1) * tile_width,
+				strip + xx * tile_width, NULL, bytes_per_row);
+			continue;
+		}
+		tile_offset = metadata.image_index[tile_yy*width+xx];
+		FSEEKO(qctfp, tile_offset, SEEK_SET);
+		readTile(qctfp, strip + xx * tile_width, bytes_per_row, xx, tile_yy, scalefactor);
+		if (cls == OUTLINE_TILE_CROSSING)
+			maskSpans(tile_yy * getStripHeight(), getStripHeight(), xx * tile_width, (xx+1) * tile_width,
+				strip + xx * tile_width, NULL, bytes_per_row);
+	}
+
+	if (ferror(qctfp))
+	{
+		throwError("cannot read tile row %d (%s)", tile_yy, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+
 bool
 QCT::loadImage(int scale)
 {
-	int xx, yy;
+	int yy;
 
 	if (qctfp == NULL)
 		return false;
 
 	scalefactor = scale;
 
-	image_data = (unsigned char*)calloc(height*QCT_TILE_SIZE, width*QCT_TILE_SIZE);
+	image_data = (unsigned char*)calloc(getImageHeight(), getImageWidth());
 	if (image_data == NULL)
 		return false;
 
 	for (yy=0; yy<height; yy++)
 	{
-		for (xx=0; xx<width; xx++)
+		if (!readStrip(yy, image_data + yy * getStripHeight() * getImageWidth()))
 		{
-			OFF_T tile_offset;
-			tile_offset = metadata.image_index[yy*width+xx];
-			FSEEKO(qctfp, tile_offset, SEEK_SET);
-			//debugmsg("Would read tile %d, %d packing %d at offset %x", xx, yy, fgetc(fp), tile_offset);
-			readTile(qctfp, xx, yy, scalefactor);
+			unloadImage();
+			return false;
 		}
 	}
+	image_masked = outline_mask;
 
 	return true;
 }
 
 
+/* -------------------------------------------------------------------------
+ * Decoding tiles from several threads.
+ * Seeking qctfp and reading from it must be done by one thread at a time,
+ * so instead each tile's bytes are read with pread (which doesn't move
+ * the file position) and unpacked from memory.  Only claiming a slot in a
+ * cache and drawing the overlay need tile_mutex.
+ */
+
+struct TileOffset
+{
+	int offset, tile;
+};
+
+static int
+compareTileOffsets(const void *a, const void *b)
+{
+	int oa = ((const TileOffset*)a)->offset, ob = ((const TileOffset*)b)->offset;
+	return (oa < ob) ? -1 : (oa > ob);
+}
+
+
+/*
+ * Find the number of bytes from each tile's offset to the next tile's (or
+ * the end of the file), at most QCT_TILE_MAX_BYTES, if not found already.
+ * Tiles need not be stored in order so the offsets are sorted.  Safe to
+ * call from several threads.
+ */
+bool
+QCT::findTileLengths()
+{
+	TileOffset *offsets = NULL;
+	struct stat st;
+	int ii, num = width * height, end, len;
+	bool ok = false;
+
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+	if (tile_length)
+	{
+		ok = true;
+		goto done;
+	}
+	if (qctfp == NULL || metadata.image_index == NULL || fstat(fileno(qctfp), &st) != 0)
+		goto done;
+	offsets = (TileOffset*)malloc((num + 1) * sizeof(TileOffset));
+	tile_length = (int*)malloc((num + 1) * sizeof(int));
+	if (offsets == NULL || tile_length == NULL)
+	{
+		FREE_POINTER(tile_length);
+		goto done;
+	}
+	for (ii=0; ii<num; ii++)
+	{
+		offsets[ii].offset = metadata.image_index[ii];
+		offsets[ii].tile = ii;
+	}
+	qsort(offsets, num, sizeof(TileOffset), compareTileOffsets);
+
+	// Offsets in the file are 32 bits
+	end = (st.st_size > 0x7fffffff) ? 0x7fffffff : (int)st.st_size;
+	for (ii=num-1; ii>=0; ii--)
+	{
+		if (ii+1 < num && offsets[ii+1].offset > offsets[ii].offset)
+			end = offsets[ii+1].offset;
+		len = end - offsets[ii].offset;
+		tile_length[offsets[ii].tile] = (len < 0) ? 0 : (len > QCT_TILE_MAX_BYTES) ? QCT_TILE_MAX_BYTES : len;
+	}
+	ok = true;
+
+done:
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+	free(offsets);
+	return ok;
+}
+
+
+/*
+ * Decode one tile at full resolution into dest (QCT_TILE_PIXELS bytes)
+ * without its overlay.  With threads the file position isn't used so any
+ * number of them can decode at once, without holding tile_mutex.  A tile
+ * which can't be read is left blank.
+ */
+void
+QCT::decodeTile(int tile_xx, int tile_yy, unsigned char *dest)
+{
+	int tile_num = tile_yy * width + tile_xx;
+	unsigned char *data;
+	long got = 0;
+
+	memset(dest, 0, QCT_TILE_PIXELS);
+	if (!findTileLengths() || tile_length[tile_num] <= 0)
+		return;
+	data = (unsigned char*)malloc(tile_length[tile_num]);
+	if (data == NULL)
+		return;
+#ifdef USE_PTHREADS
+	got = (long)pread(fileno(qctfp), data, tile_length[tile_num], metadata.image_index[tile_num]);
+#else
+	// Without threads the shared file position will do
+	if (FSEEKO(qctfp, metadata.image_index[tile_num], SEEK_SET) == 0)
+		got = (long)fread(data, 1, tile_length[tile_num], qctfp);
+#endif
+	if (got > 0)
+		unpackTile(data, (int)got, dest, QCT_TILE_SIZE, tile_xx, tile_yy, 1);
+	free(data);
+}
+
+
+/*
+ * Wait (with tile_mutex held) until a cache slot claimed by another
+ * thread is no longer TILE_LOADING.
+ */
+void
+QCT::waitForTile(unsigned char **slot)
+{
+#ifdef USE_PTHREADS
+	while (*slot == TILE_LOADING)
+	{
+		if (tile_cond)
+			pthread_cond_wait((pthread_cond_t*)tile_cond, (pthread_mutex_t*)tile_mutex);
+		else
+		{
+			pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+			pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+		}
+	}
+#endif
+}
+
+
+/*
+ * Return the pixels (QCT_TILE_SIZE x QCT_TILE_SIZE, full resolution) of one
+ * tile, decoding it if it hasn't been used before.  Tiles are kept until
+ * unloadTiles is called so random access (eg. reprojecting or exporting)
+ * only decodes the tiles actually needed, each of them once.
+ * Safe to call from several threads: each claims the tiles it decodes and
+ * decodes them without the lock, so only threads wanting the same tile
+ * wait for each other.  Returns NULL if out of range.
+ */
+const unsigned char *
+QCT::getTile(int tile_xx, int tile_yy)
+{
+	unsigned char *tile;
+	int tile_num = tile_yy * width + tile_xx;
+
+	if (tile_xx < 0 || tile_xx >= width || tile_yy < 0 || tile_yy >= height)
+		return NULL;
+	if (qctfp == NULL || metadata.image_index == NULL)
+		return NULL;
+
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+	if (tile_cache == NULL)
+		tile_cache = (unsigned char**)calloc(width * height, sizeof(unsigned char*));
+	if (tile_cache == NULL)
+		tile = NULL;
+	else
+	{
+		waitForTile(&tile_cache[tile_num]);
+		tile = tile_cache[tile_num];
+	}
+	if (tile == NULL && tile_cache)
+	{
+		tile_cache[tile_num] = TILE_LOADING;
+#ifdef USE_PTHREADS
+		if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+		tile = (unsigned char*)malloc(QCT_TILE_PIXELS);
+		if (tile)
+			decodeTile(tile_xx, tile_yy, tile);
+#ifdef USE_PTHREADS
+		if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+		// The overlay may have changed meanwhile so is drawn now
+		if (tile)
+			drawOverlay(tile, QCT_TILE_SIZE, tile_xx, tile_yy, 1);
+		tile_cache[tile_num] = tile;
+#ifdef USE_PTHREADS
+		if (tile_cond) pthread_cond_broadcast((pthread_cond_t*)tile_cond);
+#endif
+	}
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+	return tile;
+}
+
+
 bool
 QCT::readFile(FILE *fp, bool headeronly, int scale)
 {
@@ -981,408 +1568,5044 @@ QCT::printMetadata(FILE *fp)
 
 
 /* -------------------------------------------------------------------------
+ * Outline point index.
+ * coordInsideMap is the even-odd test of inpoly on the outline converted to
+ * positive integers (thousandths of a degree).  The conversion is done once
+ * in loadMetadata and the non-vertical edges are sorted into buckets by
+ * longitude, each edge going into every bucket its longitude range covers,
+ * so a query only tests the few edges that can cross its longitude.  The
+ * crossing test is the same integer arithmetic as inpoly so the answers
+ * are identical.
  */
-bool
-QCT::coordInsideMap(double lat, double lon)
-{
-	unsigned int intpoly[metadata.num_outline][2];
-	unsigned int intlat, intlon;
-	int ii, rc;
-
-	// Need at least 3 points to make a polygon!
-	if (metadata.num_outline < 3)
-		return false;
 
-	// Convert all real numbers to positive integers
+// Convert all real numbers to positive integers
 #define LAT_TO_INT(L) (unsigned int)((L+90.0) * 1e3)
 #define LON_TO_INT(L) (unsigned int)((L+180.0) * 1e3)
-	intlat = LAT_TO_INT(lat);
-	intlon = LON_TO_INT(lon);
 
-	for (ii=0; ii<metadata.num_outline; ii++)
-	{
-		intpoly[ii][0] = LON_TO_INT(metadata.outline_lon[ii]);
-		intpoly[ii][1] = LAT_TO_INT(metadata.outline_lat[ii]);
-	}
+#define OUTLINE_BATCH 16384 // points per job in coordsInsideMap
 
-	// Fast check if point within polygon
-	rc = inpoly(intpoly, metadata.num_outline, intlon, intlat);
+struct OutlineEdge
+{
+	unsigned int x1, y1, x2, y2; // x1 < x2
+};
 
-	return (rc ? true : false);
-}
+struct OutlineBatch
+{
+	const QCT *qct;
+	const double *lat, *lon;
+	bool *inside;
+	int count, *num_inside;
+};
 
 
-/* -------------------------------------------------------------------------
- */
-bool
-QCT::writePPMFile(FILE *fp)
+// Bucket holding x, for x_min < x <= x_min + x_span
+static inline int
+outlineBucket(unsigned int x, unsigned int x_min, unsigned int x_span, int buckets)
 {
-	int xx, yy, colour;
-	unsigned char *image_ptr = image_data;
+	return (int)((unsigned long long)(x - x_min - 1) * buckets / x_span);
+}
 
-	// PPM file header (for raw data not ASCII)
-	fprintf(fp, "P6 %d %d 255\n",
-		width*QCT_TILE_SIZE,
-		height*QCT_TILE_SIZE);
 
-	// Expand palette to R,G,B for each pixel
-	for (yy=0; yy<height*QCT_TILE_SIZE; yy++)
+void
+QCT::buildOutlineIndex()
+{
+	unsigned int xold, yold, xnew, ynew, x_span;
+	int ii, bb, num_edges, total = 0, *fill = NULL;
+
+	FREE_POINTER(outline_edges);
+	FREE_POINTER(outline_bucket_start);
+	outline_buckets = 0;
+
+	if (metadata.num_outline < 3)
+		return;
+
+	// Bounding box, nothing outside it can be inside the outline
+	outline_box[0] = outline_box[2] = LON_TO_INT(metadata.outline_lon[0]);
+	outline_box[1] = outline_box[3] = LAT_TO_INT(metadata.outline_lat[0]);
+	for (ii=1; ii<metadata.num_outline; ii++)
+	{
+		xnew = LON_TO_INT(metadata.outline_lon[ii]);
+		ynew = LAT_TO_INT(metadata.outline_lat[ii]);
+		if (xnew < outline_box[0]) outline_box[0] = xnew;
+		if (ynew < outline_box[1]) outline_box[1] = ynew;
+		if (xnew > outline_box[2]) outline_box[2] = xnew;
+		if (ynew > outline_box[3]) outline_box[3] = ynew;
+	}
+	x_span = outline_box[2] - outline_box[0];
+	if (x_span == 0)
+		return; // no edge can be crossed
+
+	// About one bucket per edge, but no narrower than one unit
+	num_edges = metadata.num_outline;
+	outline_buckets = (x_span < (unsigned int)num_edges) ? (int)x_span : num_edges;
+	outline_bucket_start = (int*)calloc(outline_buckets + 1, sizeof(int));
+	fill = (int*)calloc(outline_buckets, sizeof(int));
+	if (outline_bucket_start == NULL || fill == NULL)
+		goto fail;
+
+	// Count the edges in each bucket then fill them in; an edge crosses
+	// longitude xt when x1 < xt <= x2, exactly as in inpoly
+	for (int pass=0; pass<2; pass++)
 	{
-		for (xx=0; xx<width*QCT_TILE_SIZE; xx++)
+		xold = LON_TO_INT(metadata.outline_lon[num_edges-1]);
+		yold = LAT_TO_INT(metadata.outline_lat[num_edges-1]);
+		for (ii=0; ii<num_edges; ii++)
+		{
+			OutlineEdge edge;
+			xnew = LON_TO_INT(metadata.outline_lon[ii]);
+			ynew = LAT_TO_INT(metadata.outline_lat[ii]);
+			if (xnew > xold) { edge.x1 = xold; edge.y1 = yold; edge.x2 = xnew; edge.y2 = ynew; }
+			else             { edge.x1 = xnew; edge.y1 = ynew; edge.x2 = xold; edge.y2 = yold; }
+			xold = xnew; yold = ynew;
+			if (edge.x1 == edge.x2)
+				continue;
+			int b0 = outlineBucket(edge.x1 + 1, outline_box[0], x_span, outline_buckets);
+			int b1 = outlineBucket(edge.x2, outline_box[0], x_span, outline_buckets);
+			for (bb=b0; bb<=b1; bb++)
+			{
+				if (pass == 0)
+					outline_bucket_start[bb+1]++;
+				else
+					outline_edges[fill[bb]++] = edge;
+			}
+		}
+		if (pass == 0)
 		{
-			colour = palette[*image_ptr++];
-			fputc(PAL_RED(colour), fp);
-			fputc(PAL_GREEN(colour), fp);
-			fputc(PAL_BLUE(colour), fp);
+			for (bb=0; bb<outline_buckets; bb++)
+				outline_bucket_start[bb+1] += outline_bucket_start[bb];
+			total = outline_bucket_start[outline_buckets];
+			outline_edges = (OutlineEdge*)malloc((total + 1) * sizeof(OutlineEdge));
+			if (outline_edges == NULL)
+				goto fail;
+			memcpy(fill, outline_bucket_start, outline_buckets * sizeof(int));
 		}
 	}
-
-	if (ferror(fp))
-		return false;
-
-	return(true);
+	free(fill);
+	debugmsg("Outline index %d edges in %d buckets", total, outline_buckets);
+	return;
+
+fail:
+	// coordInsideMap falls back to inpoly
+	FREE_POINTER(fill);
+	FREE_POINTER(outline_edges);
+	FREE_POINTER(outline_bucket_start);
+	outline_buckets = 0;
 }
 
 
+/*
+ * Even-odd test of the integer point against the indexed outline.
+ */
 bool
-QCT::writePPMFilename(const char *filename)
+QCT::outlineContains(unsigned int xt, unsigned int yt) const
 {
-	FILE *fp;
-	bool truth;
+	const OutlineEdge *edge, *end;
+	bool inside = false;
+	int bb;
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL)
-	{
-		throwError("cannot open %s (%s)", filename, strerror(errno));
+	// Outside the bounding box every longitude is crossed an even number
+	// of times, or none at all
+	if (xt <= outline_box[0] || xt > outline_box[2] || yt < outline_box[1] || yt > outline_box[3])
 		return false;
-	}
-	truth = writePPMFile(fp);
-	if (fclose(fp))
+
+	bb = outlineBucket(xt, outline_box[0], outline_box[2] - outline_box[0], outline_buckets);
+	end = outline_edges + outline_bucket_start[bb+1];
+	for (edge = outline_edges + outline_bucket_start[bb]; edge < end; edge++)
 	{
-		throwError("cannot write %s (%s)", filename, strerror(errno));
-		truth = false;
+		if (edge->x1 < xt && xt <= edge->x2
+		 && ((long long)yt - (long long)edge->y1) * (long long)(edge->x2 - edge->x1)
+		  < ((long long)edge->y2 - (long long)edge->y1) * (long long)(xt - edge->x1))
+			inside = !inside;
 	}
-	return(truth);
+	return inside;
 }
 
 
 /* -------------------------------------------------------------------------
  */
 bool
-QCT::writeGIFFile(FILE *fp)
+QCT::coordInsideMap(double lat, double lon)
 {
-#ifdef USE_GIFLIB
-	unsigned char cmap[3][256];
-	unsigned char *image_data_ptr = image_data;
-	int background = 0;
-	int transparent = -1;
-	int xx, yy;
+	unsigned int intlat, intlon;
+	int ii, rc;
+
+	// Need at least 3 points to make a polygon!
+	if (metadata.num_outline < 3)
+		return false;
+
+	intlat = LAT_TO_INT(lat);
+	intlon = LON_TO_INT(lon);
 
-	for (xx=0; xx<256; xx++)
+	if (outline_edges)
+		return outlineContains(intlon, intlat);
+
+	// No index (out of memory or no extent), convert the outline every time
+	unsigned int intpoly[metadata.num_outline][2];
+	for (ii=0; ii<metadata.num_outline; ii++)
 	{
-		cmap[0][xx] = PAL_RED(palette[xx]);
-		cmap[1][xx] = PAL_GREEN(palette[xx]);
-		cmap[2][xx] = PAL_BLUE(palette[xx]);
+		intpoly[ii][0] = LON_TO_INT(metadata.outline_lon[ii]);
+		intpoly[ii][1] = LAT_TO_INT(metadata.outline_lat[ii]);
 	}
 
-	gifout_open_file(fp, width*QCT_TILE_SIZE, height*QCT_TILE_SIZE, 256, cmap, background, transparent);
-	gifout_open_image(0, 0, width*QCT_TILE_SIZE, height*QCT_TILE_SIZE);
+	// Fast check if point within polygon
+	rc = inpoly(intpoly, metadata.num_outline, intlon, intlat);
+
+	return (rc ? true : false);
+}
+
+
+void
+QCT::outlineBatchJob(void *arg, int chunk)
+{
+	OutlineBatch *ob = (OutlineBatch*)arg;
+	int first = chunk * OUTLINE_BATCH;
+	int last = (first + OUTLINE_BATCH < ob->count) ? first + OUTLINE_BATCH : ob->count;
+	int ii, num = 0;
 
-	for (yy=0; yy<height*QCT_TILE_SIZE; yy++)
+	for (ii=first; ii<last; ii++)
 	{
-		for (xx=0; xx<width*QCT_TILE_SIZE; xx++)
-			gifout_put_pixel(*image_data_ptr++);
+		ob->inside[ii] = ob->qct->outlineContains(LON_TO_INT(ob->lon[ii]), LAT_TO_INT(ob->lat[ii]));
+		num += ob->inside[ii];
 	}
+	ob->num_inside[chunk] = num;
+}
 
-	gifout_close_image();
-	gifout_close_file();
-	return true;
-#else
-	throwError("cannot write file (GIF not supported)");
-	return false;
-#endif
+
+/*
+ * Set inside[i] to coordInsideMap(lat[i], lon[i]) for count points.
+ * Returns the number inside the map.
+ */
+int
+QCT::coordsInsideMap(int count, const double *lat, const double *lon, bool *inside)
+{
+	OutlineBatch ob;
+	int chunks = (count + OUTLINE_BATCH - 1) / OUTLINE_BATCH;
+	int ii, num = 0;
+
+	if (outline_edges == NULL)
+	{
+		for (ii=0; ii<count; ii++)
+			num += (inside[ii] = coordInsideMap(lat[ii], lon[ii]));
+		return num;
+	}
+
+	ob.qct = this;
+	ob.lat = lat;
+	ob.lon = lon;
+	ob.inside = inside;
+	ob.count = count;
+	ob.num_inside = (int*)calloc(chunks + 1, sizeof(int));
+	if (ob.num_inside == NULL)
+	{
+		for (ii=0; ii<count; ii++)
+			num += (inside[ii] = outlineContains(LON_TO_INT(lon[ii]), LAT_TO_INT(lat[ii])));
+		return num;
+	}
+	parallelFor(chunks, nthreads, outlineBatchJob, &ob);
+	for (ii=0; ii<chunks; ii++)
+		num += ob.num_inside[ii];
+	free(ob.num_inside);
+	return num;
 }
 
 
+/* -------------------------------------------------------------------------
+ * Palette variants.
+ * The image is indexed so a different colour scheme (day, dusk, night,
+ * grey for printing, ...) is just a transform of the palette, applied
+ * when the output is written: setPalette fills out_palette, which is what
+ * the write methods and getColour use, and never touches the pixels.
+ * The interpolation matrix used when reducing output (TIFF overviews,
+ * warping) is remapped to match: the blend of two colours becomes the
+ * transformed colour nearest the average of the two transformed colours.
+ * Reducing while decoding (loadImage with a scale) still uses the chart's
+ * own matrix.
+ */
 bool
-QCT::writeGIFFilename(const char *filename)
+QCT::addPaletteTransform(const char *name, QCTColourTransform fn, void *arg)
 {
-	FILE *fp;
-	bool truth;
+	int ii;
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL)
+	for (ii=0; ii<num_palettes; ii++)
 	{
-		throwError("cannot open %s (%s)", filename, strerror(errno));
-		return false;
+		if (strcmp(palette_names[ii], name) == 0)
+			break;
 	}
-	truth = writeGIFFile(fp);
-	if (fclose(fp))
+	if (ii == num_palettes)
 	{
-		throwError("cannot write %s (%s)", filename, strerror(errno));
-		truth = false;
+		if (num_palettes >= QCT_MAX_PALETTES)
+		{
+			throwError("too many palettes (cannot add %s)", name);
+			return false;
+		}
+		palette_names[ii] = strdup(name);
+		if (palette_names[ii] == NULL)
+			return false;
+		num_palettes++;
 	}
-	return(truth);
+	palette_fns[ii] = fn;
+	palette_args[ii] = arg;
+	if (ii == current_palette)
+		applyPalette();
+	return true;
 }
 
 
-/* -------------------------------------------------------------------------
+/*
+ * Select the named palette for output, NULL for the chart's own palette.
  */
 bool
-QCT::writePNGFile(FILE *fp)
+QCT::setPalette(const char *name)
 {
-#ifdef USE_PNG
 	int ii;
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-	if (!png_ptr)
-		return(false);
+	if (name == NULL)
+	{
+		current_palette = -1;
+		applyPalette();
+		return true;
+	}
+	for (ii=0; ii<num_palettes; ii++)
+	{
+		if (strcmp(palette_names[ii], name) == 0)
+		{
+			current_palette = ii;
+			applyPalette();
+			return true;
+		}
+	}
+	throwError("unknown palette %s", name);
+	return false;
+}
 
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
+
+const char *
+QCT::getPaletteName(int index) const
+{
+	return (index >= 0 && index < num_palettes) ? palette_names[index] : NULL;
+}
+
+
+void
+QCT::applyPalette()
+{
+	QCTColourTransform fn = NULL;
+	void *arg = NULL;
+	int ii, jj, kk, best, dist, best_dist, rr, gg, bb;
+
+	// The view tiles were reduced with the old out_interp
+	unloadViewCache();
+	if (current_palette >= 0)
 	{
-		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-		return (false);
+		fn = palette_fns[current_palette];
+		arg = palette_args[current_palette];
+	}
+	if (fn == NULL)
+	{
+		memcpy(out_palette, palette, sizeof(out_palette));
+		memcpy(out_interp, pal_interp, sizeof(out_interp));
+		applyOverlayColours();
+		return;
 	}
 
-	// Any errors inside png_ functions will return here
-	if (setjmp(png_jmpbuf(png_ptr)))
+	for (ii=0; ii<256; ii++)
+		out_palette[ii] = fn(palette[ii], arg) & 0xffffff;
+
+#define COLOUR_DIST(C) \
+	((PAL_RED(C)-rr)*(PAL_RED(C)-rr) + (PAL_GREEN(C)-gg)*(PAL_GREEN(C)-gg) + (PAL_BLUE(C)-bb)*(PAL_BLUE(C)-bb))
+	for (ii=0; ii<128; ii++)
 	{
-		throwError("PNG file write error\n");
-		return false;
+		for (jj=0; jj<=ii; jj++)
+		{
+			// The average of the two, rounded to nearest
+			rr = PAL_RED(out_palette[ii]) + PAL_RED(out_palette[jj]);
+			gg = PAL_GREEN(out_palette[ii]) + PAL_GREEN(out_palette[jj]);
+			bb = PAL_BLUE(out_palette[ii]) + PAL_BLUE(out_palette[jj]);
+			rr = (rr + 1) / 2;
+			gg = (gg + 1) / 2;
+			bb = (bb + 1) / 2;
+			// Keep the chart's choice unless another colour is nearer
+			best = pal_interp[ii][jj];
+			if (best >= 128)
+				best = ii;
+			best_dist = COLOUR_DIST(out_palette[best]);
+			for (kk=0; kk<128 && best_dist>0; kk++)
+			{
+				dist = COLOUR_DIST(out_palette[kk]);
+				if (dist < best_dist)
+				{
+					best = kk;
+					best_dist = dist;
+				}
+			}
+			out_interp[ii][jj] = out_interp[jj][ii] = best;
+		}
 	}
+#undef COLOUR_DIST
+	applyOverlayColours();
+}
 
-	png_init_io(png_ptr, fp);
 
-	int bit_depth = 8;
-	png_set_IHDR(png_ptr, info_ptr, width*QCT_TILE_SIZE, height*QCT_TILE_SIZE,
-		bit_depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+/* -------------------------------------------------------------------------
+ * Outline mask.
+ * The outline is projected into full resolution pixel coordinates once
+ * and scan-converted into a list of inside spans for each pixel row, so
+ * masking is a single pass over the image rather than a point in polygon
+ * test per pixel.  A pixel is inside if its centre is inside the polygon
+ * (even-odd rule).  Row r has spans outline_spans[2*i], [2*i+1] (start
+ * inclusive, end exclusive) for i from outline_row_start[r] to
+ * outline_row_start[r+1]-1.  No spans are built if there is no outline,
+ * in which case nothing is masked.
+ */
+static void
+sortCrossings(double *xx, int nn)
+{
+	int ii, jj;
+	double tt;
 
-	int num_palette = 256;
-	png_color pal[num_palette];
-	for (ii=0; ii<256; ii++)
+	// There are usually only two so insertion sort is best
+	for (ii=1; ii<nn; ii++)
 	{
-		pal[ii].red   = PAL_RED(palette[ii]);
-		pal[ii].green = PAL_GREEN(palette[ii]);
-		pal[ii].blue  = PAL_BLUE(palette[ii]);
+		tt = xx[ii];
+		for (jj=ii; jj>0 && xx[jj-1] > tt; jj--)
+			xx[jj] = xx[jj-1];
+		xx[jj] = tt;
 	}
-	png_set_PLTE(png_ptr, info_ptr, pal, num_palette);
+}
 
-	png_byte *row_pointers[height*QCT_TILE_SIZE];
-	for (ii=0; ii<height*QCT_TILE_SIZE; ii++)
-		row_pointers[ii]=image_data + width*QCT_TILE_SIZE*ii;
-	png_set_rows(png_ptr, info_ptr, row_pointers);
 
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+void
+QCT::buildOutlineSpans()
+{
+	int num_rows = height * QCT_TILE_SIZE, max_x = width * QCT_TILE_SIZE;
+	int nn = metadata.num_outline;
+	double *px, *py, *crossings = NULL, x0, y0, x1, y1;
+	int *count = NULL, *full = NULL;
+	int tiles[3] = { 0, 0, 0 };
+	int ii, rr, r0, r1, total;
+
+	FREE_POINTER(outline_row_start);
+	FREE_POINTER(outline_spans);
+	FREE_POINTER(outline_tiles);
+	if (nn < 3 || num_rows < 1)
+		return;
+
+	px = (double*)malloc(nn * sizeof(double));
+	py = (double*)malloc(nn * sizeof(double));
+	outline_row_start = (int*)calloc(num_rows + 1, sizeof(int));
+	count = (int*)calloc(num_rows, sizeof(int));
+	if (px == NULL || py == NULL || outline_row_start == NULL || count == NULL)
+		goto fail;
+	for (ii=0; ii<nn; ii++)
+		latlonToPixel(metadata.outline_lat[ii], metadata.outline_lon[ii], &px[ii], &py[ii]);
+
+	// Rows whose centre (r+0.5) lies in [min(y0,y1), max(y0,y1)) cross the edge
+#define EDGE_ROWS(Y0, Y1) \
+	r0 = (int)ceil((Y0 < Y1 ? Y0 : Y1) - 0.5); if (r0 < 0) r0 = 0; \
+	r1 = (int)ceil((Y0 < Y1 ? Y1 : Y0) - 0.5); if (r1 > num_rows) r1 = num_rows;
+	for (ii=0; ii<nn; ii++)
+	{
+		y0 = py[ii];
+		y1 = py[(ii+1) % nn];
+		EDGE_ROWS(y0, y1)
+		for (rr=r0; rr<r1; rr++)
+			outline_row_start[rr+1]++;
+	}
+	for (rr=0; rr<num_rows; rr++)
+		outline_row_start[rr+1] += outline_row_start[rr];
+	total = outline_row_start[num_rows];
+	crossings = (double*)malloc((total + 1) * sizeof(double));
+	outline_spans = (int*)malloc((total + 1) * sizeof(int));
+	if (crossings == NULL || outline_spans == NULL)
+		goto fail;
+
+	for (ii=0; ii<nn; ii++)
+	{
+		x0 = px[ii];             y0 = py[ii];
+		x1 = px[(ii+1) % nn];    y1 = py[(ii+1) % nn];
+		EDGE_ROWS(y0, y1)
+		for (rr=r0; rr<r1; rr++)
+			crossings[outline_row_start[rr] + count[rr]++] = x0 + (rr + 0.5 - y0) * (x1 - x0) / (y1 - y0);
+	}
+#undef EDGE_ROWS
 
-	png_write_end(png_ptr, info_ptr);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
+	// Pixel x is inside a span [xa,xb) if xa <= x+0.5 < xb
+	for (rr=0; rr<num_rows; rr++)
+	{
+		double *xx = crossings + outline_row_start[rr];
+		int *span = outline_spans + outline_row_start[rr];
+		sortCrossings(xx, count[rr]);
+		for (ii=0; ii<count[rr]; ii++)
+		{
+			double cx = ceil(xx[ii] - 0.5);
+			span[ii] = (cx < 0) ? 0 : (cx > max_x) ? max_x : (int)cx;
+		}
+	}
 
-	return true;
-#else
-	throwError("cannot write file (PNG not supported)");
-	return false;
-#endif
+	// Classify each tile: no spans touch it on any row, or one span
+	// covers the whole width of it on every row (counted in full), or
+	// crossing.
+	outline_tiles = (unsigned char*)calloc(width * height, 1);
+	full = (int*)calloc(width * height, sizeof(int));
+	if (outline_tiles == NULL || full == NULL)
+		goto fail;
+	for (rr=0; rr<num_rows; rr++)
+	{
+		int *tile_row = full + (rr / QCT_TILE_SIZE) * width;
+		unsigned char *cls = outline_tiles + (rr / QCT_TILE_SIZE) * width;
+		for (ii=outline_row_start[rr]; ii<outline_row_start[rr+1]; ii+=2)
+		{
+			int start = outline_spans[ii], end = outline_spans[ii+1], tx;
+			if (end <= start)
+				continue;
+			for (tx=start/QCT_TILE_SIZE; tx<=(end-1)/QCT_TILE_SIZE; tx++)
+			{
+				cls[tx] = OUTLINE_TILE_CROSSING;
+				if (start <= tx*QCT_TILE_SIZE && end >= (tx+1)*QCT_TILE_SIZE)
+					tile_row[tx]++;
+			}
+		}
+	}
+	for (ii=0; ii<width*height; ii++)
+	{
+		if (full[ii] == QCT_TILE_SIZE)
+			outline_tiles[ii] = OUTLINE_TILE_INSIDE;
+		tiles[outline_tiles[ii]]++;
+	}
+	debugmsg("outline: %d tiles outside, %d inside, %d crossing",
+		tiles[OUTLINE_TILE_OUTSIDE], tiles[OUTLINE_TILE_INSIDE], tiles[OUTLINE_TILE_CROSSING]);
+
+	free(px);
+	free(py);
+	free(count);
+	free(full);
+	free(crossings);
+	return;
+
+fail:
+	FREE_POINTER(px);
+	FREE_POINTER(py);
+	FREE_POINTER(count);
+	FREE_POINTER(full);
+	FREE_POINTER(crossings);
+	FREE_POINTER(outline_row_start);
+	FREE_POINTER(outline_spans);
+	FREE_POINTER(outline_tiles);
 }
 
 
+/*
+ * True if full resolution pixel (px,py) is inside the outline.
+ */
 bool
-QCT::writePNGFilename(const char *filename)
+QCT::insideOutline(int px, int py) const
 {
-	FILE *fp;
-	bool truth;
+	int ii;
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL)
-	{
-		throwError("cannot open %s (%s)", filename, strerror(errno));
+	if (outline_row_start == NULL)
+		return true;
+	if (py < 0 || py >= height * QCT_TILE_SIZE)
 		return false;
+	for (ii=outline_row_start[py]; ii<outline_row_start[py+1]; ii+=2)
+	{
+		if (px < outline_spans[ii])
+			return false;
+		if (px < outline_spans[ii+1])
+			return true;
 	}
-	truth = writePNGFile(fp);
-	if (fclose(fp))
+	return false;
+}
+
+
+/*
+ * Mask rows first_row to first_row+rows-1 of the image (at the current
+ * scale, getImageWidth pixels per row) outside the outline.  If alpha is
+ * NULL pixels outside are set to QCT_TRANSPARENT_INDEX, otherwise pixels
+ * is not used and alpha is set to 255 inside and 0 outside.
+ */
+void
+QCT::maskOutline(int first_row, int rows, unsigned char *pixels, unsigned char *alpha)
+{
+	int image_width = getImageWidth();
+
+	maskSpans(first_row, rows, 0, image_width, pixels, alpha, image_width);
+}
+
+
+/*
+ * Mask columns col0 to col1-1 of the given rows, where pixels (or alpha)
+ * points to column col0 of the first row and rows are stride bytes apart.
+ */
+void
+QCT::maskSpans(int first_row, int rows, int col0, int col1, unsigned char *pixels, unsigned char *alpha, int stride)
+{
+	unsigned char *out = alpha ? alpha : pixels;
+	int fill = alpha ? 0 : QCT_TRANSPARENT_INDEX;
+	int yy, ii, xx, start, end, row;
+
+	if (outline_row_start == NULL)
 	{
-		throwError("cannot write %s (%s)", filename, strerror(errno));
-		truth = false;
+		if (alpha)
+			for (yy=0; yy<rows; yy++)
+				memset(alpha + yy * stride, 255, col1 - col0);
+		return;
+	}
+	for (yy=0; yy<rows; yy++, out+=stride)
+	{
+		// Scaled pixel x is full resolution x*scalefactor
+		row = (first_row + yy) * scalefactor;
+		xx = col0;
+		for (ii=outline_row_start[row]; ii<outline_row_start[row+1] && xx<col1; ii+=2)
+		{
+			start = (outline_spans[ii] + scalefactor - 1) / scalefactor;
+			end = (outline_spans[ii+1] + scalefactor - 1) / scalefactor;
+			if (start > col1) start = col1;
+			if (end > col1) end = col1;
+			if (end <= xx)
+				continue;
+			if (start > xx)
+				memset(out + xx - col0, fill, start - xx);
+			else
+				start = xx;
+			if (alpha && end > start)
+				memset(out + start - col0, 255, end - start);
+			xx = end;
+		}
+		if (xx < col1)
+			memset(out + xx - col0, fill, col1 - xx);
 	}
-	return(truth);
 }
 
 
 /* -------------------------------------------------------------------------
+ * Crop rectangle.
+ * Held in full resolution pixels so it stays the same area of the chart
+ * whatever scale the image is loaded at; at a reduced scale it is rounded
+ * out to whole output pixels.
  */
 bool
-QCT::writeTIFFFile(FILE *fp)
+QCT::setCrop(int x, int y, int w, int h)
 {
-#ifdef USE_TIFF
-	throwError("cannot write file (TIFF not implemented)");
-	return false;
-#else
-	throwError("cannot write file (TIFF not supported)");
-	return false;
-#endif
+	int full_width = width * QCT_TILE_SIZE, full_height = height * QCT_TILE_SIZE;
+	int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > full_width) x1 = full_width;
+	if (y1 > full_height) y1 = full_height;
+	if (w <= 0 || h <= 0 || x0 >= x1 || y0 >= y1)
+	{
+		throwError("crop rectangle %d,%d %dx%d outside image", x, y, w, h);
+		return false;
+	}
+	crop_x = x0;
+	crop_y = y0;
+	crop_w = x1 - x0;
+	crop_h = y1 - y0;
+	message("Crop %d,%d %dx%d", crop_x, crop_y, crop_w, crop_h);
+	return true;
 }
 
 
+/*
+ * Crop to the pixels covering a latitude and longitude box in degrees
+ * WGS84.  The edges of the box need not be straight lines in the image so
+ * all four are followed, not just the corners.
+ */
 bool
-QCT::writeTIFFFilename(const char *filename)
+QCT::setCropLatLon(double lat_min, double lon_min, double lat_max, double lon_max)
 {
-	FILE *fp;
-	bool truth;
+	int ii, side, steps = 256;
+	double la, lo, xx, yy, x_min = 1e9, y_min = 1e9, x_max = -1e9, y_max = -1e9;
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL)
+	if (!(lat_min < lat_max && lon_min < lon_max))
 	{
-		throwError("cannot open %s (%s)", filename, strerror(errno));
+		throwError("crop box %f,%f to %f,%f is empty", lat_min, lon_min, lat_max, lon_max);
 		return false;
 	}
-	truth = writeTIFFFile(fp);
-	if (fclose(fp))
+	for (side=0; side<4; side++)
 	{
-		throwError("cannot write %s (%s)", filename, strerror(errno));
-		truth = false;
+		for (ii=0; ii<=steps; ii++)
+		{
+			double ff = (double)ii / steps;
+			switch (side)
+			{
+				case 0: la = lat_min; lo = lon_min + ff * (lon_max - lon_min); break;
+				case 1: la = lat_max; lo = lon_min + ff * (lon_max - lon_min); break;
+				case 2: lo = lon_min; la = lat_min + ff * (lat_max - lat_min); break;
+				default: lo = lon_max; la = lat_min + ff * (lat_max - lat_min); break;
+			}
+			latlonToPixel(la, lo, &xx, &yy);
+			if (xx < x_min) x_min = xx;
+			if (xx > x_max) x_max = xx;
+			if (yy < y_min) y_min = yy;
+			if (yy > y_max) y_max = yy;
+		}
 	}
-	return(truth);
+	// Far outside the image the polynomials mean nothing, keep it in range
+	if (x_min < 0) x_min = 0;
+	if (y_min < 0) y_min = 0;
+	if (x_max > width * QCT_TILE_SIZE) x_max = width * QCT_TILE_SIZE;
+	if (y_max > height * QCT_TILE_SIZE) y_max = height * QCT_TILE_SIZE;
+	if (x_min >= x_max || y_min >= y_max)
+	{
+		throwError("crop box %f,%f to %f,%f is outside the chart", lat_min, lon_min, lat_max, lon_max);
+		return false;
+	}
+	ii = (int)floor(x_min);
+	side = (int)floor(y_min);
+	return setCrop(ii, side, (int)ceil(x_max) - ii, (int)ceil(y_max) - side);
 }
 
 
-/* -------------------------------------------------------------------------
- * Convert pixel (x,y) in image into (longitude,latitude)
- * x,y from top left
- * latitude,longitude in degrees WGS84.
- * clips out of range x,y rather than blindly converting.
+/*
+ * The crop rectangle in pixels at the current scale, or the whole image
+ * (and false) if there isn't one.
  */
-int
-QCT::xy_to_latlon(int x, int y, double *latitude, double *longitude) const
+bool
+QCT::getCrop(int *x, int *y, int *w, int *h) const
 {
-	int x2, y2, x3, y3, xy;
+	int image_width = getImageWidth(), image_height = getImageHeight();
+	int x1, y1;
 
-	x *= scalefactor;
-	y *= scalefactor;
+	if (crop_w <= 0 || crop_h <= 0)
+	{
+		*x = *y = 0;
+		*w = image_width;
+		*h = image_height;
+		return false;
+	}
+	*x = crop_x / scalefactor;
+	*y = crop_y / scalefactor;
+	x1 = (crop_x + crop_w + scalefactor - 1) / scalefactor;
+	y1 = (crop_y + crop_h + scalefactor - 1) / scalefactor;
+	*w = ((x1 < image_width) ? x1 : image_width) - *x;
+	*h = ((y1 < image_height) ? y1 : image_height) - *y;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Vector overlay.
+ * Lines are converted to full resolution pixels once, with the batch
+ * georeferencing, and each segment is listed against the tiles it passes
+ * through.  readTile then draws the segments listed for a tile straight
+ * into its pixels, so the cost depends on the length of the lines and
+ * not on the size of the image.  Pixels are chosen from the whole line,
+ * not the part in the tile, so lines are continuous across tile edges.
+ */
+
+struct OverlaySegment
+{
+	double x1, y1, x2, y2;
+	unsigned char colour;      // palette index
+	unsigned char width;       // pixels, also the size of the square ends
+};
+
+struct OverlayRef
+{
+	int seg;                   // index into overlay_segs
+	int next;                  // next ref for the same tile or -1
+};
+
+
+/*
+ * Draw one segment, scaled down by scale, into the size x size pixels of
+ * dest whose top left pixel is (x0,y0) in the scaled image.  The line is
+ * stepped along its major axis one pixel at a time and given its width
+ * across the minor axis.
+ */
+static void
+drawOverlaySegment(const OverlaySegment *seg, unsigned char *dest, int bytes_per_row, int x0, int y0, int size, int scale)
+{
+	double a1 = seg->x1 / scale, b1 = seg->y1 / scale;
+	double a2 = seg->x2 / scale, b2 = seg->y2 / scale;
+	double tt, slope;
+	int origin_a = x0, origin_b = y0, step_a = 1, step_b = bytes_per_row;
+	int lo = -(seg->width - 1) / 2, hi = seg->width / 2;
+	int aa, bb, kk, a_first, a_last, b_first, b_last;
+
+	if (fabs(b2 - b1) > fabs(a2 - a1))
+	{
+		tt = a1; a1 = b1; b1 = tt;
+		tt = a2; a2 = b2; b2 = tt;
+		origin_a = y0; origin_b = x0;
+		step_a = bytes_per_row; step_b = 1;
+	}
+	if (a1 > a2)
+	{
+		tt = a1; a1 = a2; a2 = tt;
+		tt = b1; b1 = b2; b2 = tt;
+	}
+	slope = (a2 > a1) ? (b2 - b1) / (a2 - a1) : 0;
+
+	a_first = (int)floor(a1) + lo;
+	a_last = (int)floor(a2) + hi;
+	if (a_first < origin_a) a_first = origin_a;
+	if (a_last > origin_a + size - 1) a_last = origin_a + size - 1;
+	for (aa=a_first; aa<=a_last; aa++)
+	{
+		// Centre of the pixel, held at the ends so they get square caps
+		tt = aa + 0.5;
+		if (tt < a1) tt = a1;
+		if (tt > a2) tt = a2;
+		bb = (int)floor(b1 + (tt - a1) * slope);
+		b_first = (bb + lo < origin_b) ? origin_b : bb + lo;
+		b_last = (bb + hi > origin_b + size - 1) ? origin_b + size - 1 : bb + hi;
+		for (kk=b_first; kk<=b_last; kk++)
+			dest[(aa - origin_a) * step_a + (kk - origin_b) * step_b] = seg->colour;
+	}
+}
+
+
+/*
+ * Draw the overlay for one tile decoded at the given scale into dest,
+ * laid out as in readTile.
+ */
+void
+QCT::drawOverlay(unsigned char *dest, int bytes_per_row, int tile_xx, int tile_yy, int scale) const
+{
+	int ref, size = QCT_TILE_SIZE / scale;
+
+	if (overlay_head == NULL)
+		return;
+	for (ref=overlay_head[tile_yy*width+tile_xx]; ref>=0; ref=overlay_refs[ref].next)
+		drawOverlaySegment(&overlay_segs[overlay_refs[ref].seg], dest, bytes_per_row,
+			tile_xx * size, tile_yy * size, size, scale);
+}
+
+
+void
+QCT::applyOverlayColours()
+{
+	int ii;
+
+	for (ii=0; ii<num_overlay_colours; ii++)
+		out_palette[QCT_OVERLAY_INDEX + ii] = overlay_colours[ii];
+}
+
+
+/*
+ * Add a segment in full resolution pixels to the tiles it passes through,
+ * dropping any copies of those tiles already decoded and drawing it into
+ * the loaded image.
+ */
+bool
+QCT::addOverlaySegment(double x1, double y1, double x2, double y2, int colour, int line_width)
+{
+	OverlaySegment *seg;
+	double a1, b1, a2, b2, tt, lo, hi, slope;
+	double pad = (line_width / 2 + 1) * scalefactor;
+	bool major_x = (fabs(x2 - x1) >= fabs(y2 - y1));
+	int num_major = major_x ? width : height, num_minor = major_x ? height : width;
+	int lv, tile_num, aa, bb, a_first, a_last, b_first, b_last;
+
+	// Nowhere near the chart, or not a number
+	if (!(fabs(x1) < 1e8 && fabs(y1) < 1e8 && fabs(x2) < 1e8 && fabs(y2) < 1e8))
+		return true;
+
+	if (num_overlay_segs == max_overlay_segs)
+	{
+		int max = max_overlay_segs ? max_overlay_segs * 2 : 256;
+		seg = (OverlaySegment*)realloc(overlay_segs, max * sizeof(OverlaySegment));
+		if (seg == NULL)
+			return false;
+		overlay_segs = seg;
+		max_overlay_segs = max;
+	}
+	seg = &overlay_segs[num_overlay_segs];
+	seg->x1 = x1; seg->y1 = y1;
+	seg->x2 = x2; seg->y2 = y2;
+	seg->colour = colour;
+	seg->width = line_width;
+
+	a1 = major_x ? x1 : y1; b1 = major_x ? y1 : x1;
+	a2 = major_x ? x2 : y2; b2 = major_x ? y2 : x2;
+	if (a1 > a2)
+	{
+		tt = a1; a1 = a2; a2 = tt;
+		tt = b1; b1 = b2; b2 = tt;
+	}
+	slope = (a2 > a1) ? (b2 - b1) / (a2 - a1) : 0;
+
+	// Each column (or row) of tiles along the line, and the tiles across
+	// it covered by the part of the line in that column
+	a_first = (int)floor((a1 - pad) / QCT_TILE_SIZE);
+	a_last = (int)floor((a2 + pad) / QCT_TILE_SIZE);
+	if (a_first < 0) a_first = 0;
+	if (a_last > num_major - 1) a_last = num_major - 1;
+	for (aa=a_first; aa<=a_last; aa++)
+	{
+		lo = aa * QCT_TILE_SIZE;
+		hi = lo + QCT_TILE_SIZE;
+		lo = (lo < a1) ? a1 : (lo > a2) ? a2 : lo;
+		hi = (hi < a1) ? a1 : (hi > a2) ? a2 : hi;
+		lo = b1 + (lo - a1) * slope;
+		hi = b1 + (hi - a1) * slope;
+		if (lo > hi)
+		{
+			tt = lo; lo = hi; hi = tt;
+		}
+		b_first = (int)floor((lo - pad) / QCT_TILE_SIZE);
+		b_last = (int)floor((hi + pad) / QCT_TILE_SIZE);
+		if (b_first < 0) b_first = 0;
+		if (b_last > num_minor - 1) b_last = num_minor - 1;
+		for (bb=b_first; bb<=b_last; bb++)
+		{
+			int tile_xx = major_x ? aa : bb, tile_yy = major_x ? bb : aa;
+			tile_num = tile_yy * width + tile_xx;
+
+			if (num_overlay_refs == max_overlay_refs)
+			{
+				int max = max_overlay_refs ? max_overlay_refs * 2 : 1024;
+				OverlayRef *refs = (OverlayRef*)realloc(overlay_refs, max * sizeof(OverlayRef));
+				if (refs == NULL)
+					return false;
+				overlay_refs = refs;
+				max_overlay_refs = max;
+			}
+			overlay_refs[num_overlay_refs].seg = num_overlay_segs;
+			overlay_refs[num_overlay_refs].next = -1;
+			if (overlay_head[tile_num] < 0)
+				overlay_head[tile_num] = num_overlay_refs;
+			else
+				overlay_refs[overlay_tail[tile_num]].next = num_overlay_refs;
+			overlay_tail[tile_num] = num_overlay_refs++;
+
+			// Decoded again with the line when next wanted
+			if (tile_cache && tile_cache[tile_num] != TILE_LOADING)
+				FREE_POINTER(tile_cache[tile_num]);
+			for (lv=0; lv<QCT_VIEW_LEVELS; lv++)
+			{
+				if (view_tiles[lv] && view_tiles[lv][tile_num] && view_tiles[lv][tile_num] != TILE_LOADING)
+				{
+					FREE_POINTER(view_tiles[lv][tile_num]);
+					view_bytes -= QCT_TILE_PIXELS >> (2 * lv);
+				}
+			}
+
+			// Tiles outside the outline are never drawn when masked
+			if (image_data)
+			{
+				int cls = (image_masked && outline_tiles) ? outline_tiles[tile_num] : OUTLINE_TILE_INSIDE;
+				int size = getStripHeight();
+				if (cls == OUTLINE_TILE_OUTSIDE)
+					continue;
+				drawOverlaySegment(seg, image_data + (tile_yy * size) * getImageWidth() + tile_xx * size,
+					getImageWidth(), tile_xx * size, tile_yy * size, size, scalefactor);
+				if (cls == OUTLINE_TILE_CROSSING)
+					maskSpans(tile_yy * size, size, tile_xx * size, (tile_xx+1) * size,
+						image_data + (tile_yy * size) * getImageWidth() + tile_xx * size, NULL, getImageWidth());
+			}
+		}
+	}
+	num_overlay_segs++;
+	return true;
+}
+
+
+/*
+ * Add a polyline of count points.  A single point is drawn as a square
+ * line_width pixels across.  Returns false if there is no chart, no
+ * overlay colour left or no memory.
+ */
+bool
+QCT::addOverlayLine(int count, const double *latitude, const double *longitude, int rgb, int line_width)
+{
+	double *xx, *yy;
+	int ii, colour;
+	bool ok = true;
+
+	if (metadata.image_index == NULL || count < 1)
+		return false;
+	if (line_width < 1) line_width = 1;
+	if (line_width > 255) line_width = 255;
+
+	// Same colour, same palette entry
+	rgb &= 0xffffff;
+	for (colour=0; colour<num_overlay_colours; colour++)
+		if (overlay_colours[colour] == rgb)
+			break;
+	if (colour == QCT_MAX_OVERLAY_COLOURS)
+	{
+		throwError("too many overlay colours (%d allowed)", QCT_MAX_OVERLAY_COLOURS);
+		return false;
+	}
+	if (colour == num_overlay_colours)
+	{
+		overlay_colours[num_overlay_colours++] = rgb;
+		applyOverlayColours();
+	}
+
+	if (overlay_head == NULL)
+	{
+		overlay_head = (int*)malloc(width * height * sizeof(int));
+		overlay_tail = (int*)malloc(width * height * sizeof(int));
+		if (overlay_head == NULL || overlay_tail == NULL)
+		{
+			FREE_POINTER(overlay_head);
+			FREE_POINTER(overlay_tail);
+			return false;
+		}
+		for (ii=0; ii<width*height; ii++)
+			overlay_head[ii] = overlay_tail[ii] = -1;
+	}
+
+	xx = (double*)malloc(count * 2 * sizeof(double));
+	if (xx == NULL)
+		return false;
+	yy = xx + count;
+	latLonToPixels(count, latitude, longitude, xx, yy);
+
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+	if (count == 1)
+		ok = addOverlaySegment(xx[0] * scalefactor, yy[0] * scalefactor,
+			xx[0] * scalefactor, yy[0] * scalefactor, QCT_OVERLAY_INDEX + colour, line_width);
+	for (ii=0; ii+1<count && ok; ii++)
+		ok = addOverlaySegment(xx[ii] * scalefactor, yy[ii] * scalefactor,
+			xx[ii+1] * scalefactor, yy[ii+1] * scalefactor, QCT_OVERLAY_INDEX + colour, line_width);
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+	free(xx);
+	return ok;
+}
+
+
+bool
+QCT::addOverlayMarker(double latitude, double longitude, int rgb, int size)
+{
+	return addOverlayLine(1, &latitude, &longitude, rgb, size);
+}
+
+
+void
+QCT::clearOverlay()
+{
+	if (overlay_head)
+	{
+		unloadTiles();
+		unloadViewCache();
+	}
+	FREE_POINTER(overlay_segs);
+	FREE_POINTER(overlay_refs);
+	FREE_POINTER(overlay_head);
+	FREE_POINTER(overlay_tail);
+	num_overlay_segs = max_overlay_segs = 0;
+	num_overlay_refs = max_overlay_refs = 0;
+	num_overlay_colours = 0;
+	applyPalette();
+}
+
+
+/* -------------------------------------------------------------------------
+ * Deliver the image to the write methods one strip (row of tiles) at a time.
+ * If the image has been loaded the strips point straight into image_data,
+ * otherwise they are decoded from the file into one of two strip buffers
+ * so memory use depends only on the width of the image.  With USE_PTHREADS
+ * the next strip is decoded in a background thread while the caller is
+ * busy writing out the current one.  With the outline mask enabled the
+ * strips are masked by readStrip, or if the image was loaded without the
+ * mask each strip is copied into a buffer and masked there.
+ * With a crop rectangle only the strips, and the tiles in them, which
+ * overlap it are decoded and the part inside it is copied out so the
+ * caller gets rows of getOutputWidth() pixels.
+ * With gift set, on Linux for an image which has not been loaded and is
+ * not cropped, each strip is instead decoded into its own newly mapped
+ * buffer which then belongs to the caller, who must hand it to release().
+ * Up to QCT_GIFT_STRIPS strips are decoded ahead, so the caller can give
+ * the pages of a strip away (e.g. vmsplice with SPLICE_F_GIFT) knowing
+ * they are never written again.
+ * Call next() until it returns NULL, then check failed().
+ */
+#define QCT_GIFT_STRIPS 4
+
+class QCTStripReader
+{
+public:
+	QCTStripReader(QCT *qct, bool gift = false);
+	~QCTStripReader();
+	unsigned char *next(int *rows);
+	void release(unsigned char *ptr);
+	bool failed() const { return error; }
+
+private:
+	unsigned char *nextStrip();
+	unsigned char *newBuffer();
+	QCT *qct;
+	int strip, num_strips, strip_height, strip_bytes;
+	int crop_x, crop_y, crop_w, crop_h; // at the current scale
+	int first_tile, last_tile;
+	bool gift;
+	int num_buffers;
+	unsigned char *buffer[QCT_GIFT_STRIPS];
+	unsigned char *window;     // crop of the current strip (or NULL)
+	bool error;
+#ifdef USE_PTHREADS
+	static void *decodeThread(void *arg);
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	int decoded;   // strips which have been decoded into a buffer
+	int consumed;  // strips which the caller has finished with
+#endif
+};
+
+
+QCTStripReader::QCTStripReader(QCT *q, bool giftstrips)
+{
+	int tile_width, ii;
+
+	qct = q;
+	strip_height = qct->getStripHeight();
+	strip_bytes = strip_height * qct->getImageWidth();
+	tile_width = QCT_TILE_SIZE / qct->scalefactor;
+	qct->getCrop(&crop_x, &crop_y, &crop_w, &crop_h);
+	strip = crop_y / strip_height;
+	num_strips = (crop_h > 0) ? (crop_y + crop_h - 1) / strip_height + 1 : strip;
+	first_tile = crop_x / tile_width;
+	last_tile = (crop_w > 0) ? (crop_x + crop_w - 1) / tile_width + 1 : first_tile;
+	for (ii=0; ii<QCT_GIFT_STRIPS; ii++)
+		buffer[ii] = NULL;
+	window = NULL;
+	error = false;
+#ifdef __linux__
+	gift = giftstrips && !qct->getImage() && crop_w == qct->getImageWidth() && crop_h == qct->getImageHeight();
+#else
+	gift = false;
+#endif
+	num_buffers = gift ? QCT_GIFT_STRIPS : 2;
+#ifdef USE_PTHREADS
+	running = false;
+	decoded = consumed = strip;
+#endif
+
+	if (crop_w != qct->getImageWidth() || crop_h != qct->getImageHeight())
+	{
+		window = (unsigned char*)malloc(strip_height * crop_w + 1);
+		if (window == NULL)
+		{
+			error = true;
+			return;
+		}
+	}
+
+	// Nothing to decode if the whole image is already in memory
+	if (qct->getImage())
+	{
+		if (qct->getOutlineMask() && !qct->imageMasked())
+		{
+			buffer[0] = (unsigned char*)malloc(strip_bytes);
+			error = (buffer[0] == NULL);
+		}
+		return;
+	}
+
+	// Gifted strips are mapped as they are decoded
+	if (!gift)
+	{
+		buffer[0] = (unsigned char*)malloc(strip_bytes);
+		buffer[1] = (unsigned char*)malloc(strip_bytes);
+		if (buffer[0] == NULL || buffer[1] == NULL)
+		{
+			error = true;
+			return;
+		}
+	}
+
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	running = (pthread_create(&thread, NULL, decodeThread, this) == 0);
+	if (!running)
+	{
+		pthread_mutex_destroy(&mutex);
+		pthread_cond_destroy(&cond);
+	}
+#endif
+}
+
+
+QCTStripReader::~QCTStripReader()
+{
+	int ii;
+
+#ifdef USE_PTHREADS
+	if (running)
+	{
+		// Tell the decoder every strip has been consumed so it finishes
+		pthread_mutex_lock(&mutex);
+		consumed = num_strips;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(thread, NULL);
+		pthread_mutex_destroy(&mutex);
+		pthread_cond_destroy(&cond);
+	}
+#endif
+	for (ii=0; ii<QCT_GIFT_STRIPS; ii++)
+		release(buffer[ii]);
+	if (window) free(window);
+}
+
+
+// Allocate a strip buffer, mapped if it is to be gifted
+unsigned char *
+QCTStripReader::newBuffer()
+{
+#ifdef __linux__
+	void *ptr;
+
+	if (gift)
+	{
+		ptr = mmap(NULL, strip_bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		return (ptr == MAP_FAILED) ? NULL : (unsigned char*)ptr;
+	}
+#endif
+	return (unsigned char*)malloc(strip_bytes);
+}
+
+
+// Free a strip buffer, or a gifted strip the caller has finished with
+void
+QCTStripReader::release(unsigned char *ptr)
+{
+	if (ptr == NULL)
+		return;
+#ifdef __linux__
+	if (gift)
+	{
+		munmap(ptr, strip_bytes);
+		return;
+	}
+#endif
+	free(ptr);
+}
+
+
+#ifdef USE_PTHREADS
+void *
+QCTStripReader::decodeThread(void *arg)
+{
+	QCTStripReader *sr = (QCTStripReader*)arg;
+	unsigned char *ptr;
+	int ss;
+	bool ok;
+
+	for (ss=sr->strip; ss<sr->num_strips; ss++)
+	{
+		// Wait until the buffer for this strip is no longer in use
+		pthread_mutex_lock(&sr->mutex);
+		while (ss >= sr->consumed + sr->num_buffers)
+			pthread_cond_wait(&sr->cond, &sr->mutex);
+		if (sr->consumed >= sr->num_strips)
+		{
+			pthread_mutex_unlock(&sr->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&sr->mutex);
+
+		// A gifted strip always gets a new buffer, the caller has the last one
+		if (sr->gift)
+			sr->buffer[ss % sr->num_buffers] = sr->newBuffer();
+		ptr = sr->buffer[ss % sr->num_buffers];
+		ok = (ptr != NULL) && sr->qct->readStripTiles(ss, ptr, sr->first_tile, sr->last_tile);
+
+		pthread_mutex_lock(&sr->mutex);
+		if (!ok)
+			sr->error = true;
+		sr->decoded = ss+1;
+		pthread_cond_broadcast(&sr->cond);
+		pthread_mutex_unlock(&sr->mutex);
+		if (!ok)
+			break;
+	}
+	return NULL;
+}
+#endif
+
+
+unsigned char *
+QCTStripReader::next(int *rows)
+{
+	unsigned char *ptr;
+	int image_width = qct->getImageWidth();
+	int top, first_row, last_row, rr;
+
+	if (error || strip >= num_strips)
+		return NULL;
+
+	top = strip * strip_height;
+	ptr = nextStrip();
+	if (ptr == NULL || window == NULL)
+	{
+		*rows = strip_height;
+		return ptr;
+	}
+
+	// Copy out the part in the crop rectangle
+	first_row = (crop_y > top) ? crop_y - top : 0;
+	last_row = (crop_y + crop_h < top + strip_height) ? crop_y + crop_h - top : strip_height;
+	for (rr=first_row; rr<last_row; rr++)
+		memcpy(window + (rr - first_row) * crop_w, ptr + rr * image_width + crop_x, crop_w);
+	*rows = last_row - first_row;
+	return window;
+}
+
+
+unsigned char *
+QCTStripReader::nextStrip()
+{
+	unsigned char *ptr;
+
+	// Loaded image is used directly
+	if (qct->getImage())
+	{
+		ptr = qct->getImage() + (strip++) * strip_bytes;
+		if (!qct->getOutlineMask() || qct->imageMasked())
+			return ptr;
+		memcpy(buffer[0], ptr, strip_bytes);
+		qct->maskOutline((strip-1) * strip_height, strip_height, buffer[0]);
+		return buffer[0];
+	}
+
+#ifdef USE_PTHREADS
+	if (running)
+	{
+		pthread_mutex_lock(&mutex);
+		// Caller has finished with the previous strip so its buffer is free
+		consumed = strip;
+		pthread_cond_broadcast(&cond);
+		while (decoded <= strip && !error)
+			pthread_cond_wait(&cond, &mutex);
+		ptr = error ? NULL : buffer[strip % num_buffers];
+		if (gift && ptr)
+			buffer[strip % num_buffers] = NULL;
+		pthread_mutex_unlock(&mutex);
+		strip++;
+		return ptr;
+	}
+#endif
+
+	ptr = gift ? newBuffer() : buffer[strip % num_buffers];
+	if (ptr == NULL || !qct->readStripTiles(strip, ptr, first_tile, last_tile))
+	{
+		if (gift)
+			release(ptr);
+		error = true;
+		return NULL;
+	}
+	strip++;
+	return ptr;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Expansion of palette indexes to true colour.
+ * Each palette entry is held as the 4 bytes to be stored for it (R,G,B,A
+ * or B,G,R,A, with alpha 0 for QCT_TRANSPARENT_INDEX) so a pixel is one
+ * table lookup.  There are AVX2 (gather), SSE4 and plain versions of the
+ * row expansion and the best the processor supports is used.  For RGB24
+ * the 4-byte entries are packed down to 3 bytes.
+ */
+struct PixelLUT
+{
+	unsigned int entry[256];
+	int bytes;   // per output pixel, 3 or 4
+};
+
+typedef void (*ExpandRowFn)(const PixelLUT *lut, const unsigned char *src, int nn, unsigned char *dst);
+
+
+static void
+initPixelLUT(PixelLUT *lut, const int *palette, int format)
+{
+	unsigned char bb[4];
+	int ii;
+
+	for (ii=0; ii<256; ii++)
+	{
+		bb[0] = (format == QCT_PIXEL_BGRA32) ? PAL_BLUE(palette[ii]) : PAL_RED(palette[ii]);
+		bb[1] = PAL_GREEN(palette[ii]);
+		bb[2] = (format == QCT_PIXEL_BGRA32) ? PAL_RED(palette[ii]) : PAL_BLUE(palette[ii]);
+		bb[3] = (ii == QCT_TRANSPARENT_INDEX) ? 0 : 255;
+		memcpy(&lut->entry[ii], bb, 4);
+	}
+	lut->bytes = (format == QCT_PIXEL_RGB24) ? 3 : 4;
+}
+
+
+static void
+expandRowScalar(const PixelLUT *lut, const unsigned char *src, int nn, unsigned char *dst)
+{
+	int ii;
+
+	if (lut->bytes == 4)
+	{
+		for (ii=0; ii<nn; ii++)
+			memcpy(dst + ii*4, &lut->entry[src[ii]], 4);
+		return;
+	}
+	// Store 4 bytes at a time, the 4th is overwritten by the next pixel
+	for (ii=0; ii<nn-1; ii++)
+		memcpy(dst + ii*3, &lut->entry[src[ii]], 4);
+	if (nn > 0)
+		memcpy(dst + ii*3, &lut->entry[src[ii]], 3);
+}
+
+
+#ifdef QCT_X86_SIMD
+/*
+ * Pack four vectors each of four 4-byte pixels into 48 bytes of RGB.
+ */
+__attribute__((target("sse4.1")))
+static inline void
+packRGB48(__m128i aa, __m128i bb, __m128i cc, __m128i dd, unsigned char *dst)
+{
+	const __m128i drop = _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+	aa = _mm_shuffle_epi8(aa, drop);
+	bb = _mm_shuffle_epi8(bb, drop);
+	cc = _mm_shuffle_epi8(cc, drop);
+	dd = _mm_shuffle_epi8(dd, drop);
+	_mm_storeu_si128((__m128i*)dst,      _mm_or_si128(aa, _mm_slli_si128(bb, 12)));
+	_mm_storeu_si128((__m128i*)(dst+16), _mm_or_si128(_mm_srli_si128(bb, 4), _mm_slli_si128(cc, 8)));
+	_mm_storeu_si128((__m128i*)(dst+32), _mm_or_si128(_mm_srli_si128(cc, 8), _mm_slli_si128(dd, 4)));
+}
+
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+lookup4(const PixelLUT *lut, const unsigned char *src)
+{
+	const unsigned int *ee = lut->entry;
+	return _mm_setr_epi32(ee[src[0]], ee[src[1]], ee[src[2]], ee[src[3]]);
+}
+
+
+__attribute__((target("sse4.1")))
+static void
+expandRowSSE4(const PixelLUT *lut, const unsigned char *src, int nn, unsigned char *dst)
+{
+	int ii = 0;
+
+	if (lut->bytes == 4)
+	{
+		for (; ii+4<=nn; ii+=4)
+			_mm_storeu_si128((__m128i*)(dst + ii*4), lookup4(lut, src + ii));
+	}
+	else
+	{
+		for (; ii+16<=nn; ii+=16)
+			packRGB48(lookup4(lut, src+ii), lookup4(lut, src+ii+4),
+				lookup4(lut, src+ii+8), lookup4(lut, src+ii+12), dst + ii*3);
+	}
+	expandRowScalar(lut, src + ii, nn - ii, dst + ii * lut->bytes);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i
+gather8(const PixelLUT *lut, const unsigned char *src)
+{
+	__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+	return _mm256_i32gather_epi32((const int*)lut->entry, idx, 4);
+}
+
+
+__attribute__((target("avx2")))
+static void
+expandRowAVX2(const PixelLUT *lut, const unsigned char *src, int nn, unsigned char *dst)
+{
+	int ii = 0;
+
+	if (lut->bytes == 4)
+	{
+		for (; ii+8<=nn; ii+=8)
+			_mm256_storeu_si256((__m256i*)(dst + ii*4), gather8(lut, src + ii));
+	}
+	else
+	{
+		for (; ii+16<=nn; ii+=16)
+		{
+			__m256i lo = gather8(lut, src + ii);
+			__m256i hi = gather8(lut, src + ii + 8);
+			packRGB48(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1),
+				_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1), dst + ii*3);
+		}
+	}
+	expandRowScalar(lut, src + ii, nn - ii, dst + ii * lut->bytes);
+}
+#endif // QCT_X86_SIMD
+
+
+static ExpandRowFn
+selectExpandRow()
+{
+#ifdef QCT_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return expandRowAVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return expandRowSSE4;
+#endif
+	return expandRowScalar;
+}
+
+
+// A band of rows for one thread
+struct ExpandJob
+{
+	const PixelLUT *lut;
+	ExpandRowFn fn;
+	const unsigned char *src;
+	int src_stride;
+	int width, height;
+	unsigned char *out;
+	int stride;
+};
+
+#define EXPAND_BAND 64
+
+static void
+expandBand(void *arg, int band)
+{
+	ExpandJob *job = (ExpandJob*)arg;
+	int yy, last = (band + 1) * EXPAND_BAND;
+
+	if (last > job->height)
+		last = job->height;
+	for (yy=band*EXPAND_BAND; yy<last; yy++)
+		job->fn(job->lut, job->src + (size_t)yy * job->src_stride, job->width, job->out + (size_t)yy * job->stride);
+}
+
+
+/*
+ * Expand the rectangle of the loaded image at (x,y) size w x h into out,
+ * in format QCT_PIXEL_RGB24, QCT_PIXEL_RGBA32 or QCT_PIXEL_BGRA32, with
+ * stride bytes between the start of each output row.  Colours are from
+ * the output palette (see setPalette).  If parallel is true, bands of
+ * rows are expanded by separate threads.
+ */
+bool
+QCT::expandPixels(int x, int y, int w, int h, int format, unsigned char *out, int stride, bool parallel)
+{
+	PixelLUT lut;
+	ExpandJob job;
+
+	if (image_data == NULL)
+	{
+		throwError("image not loaded");
+		return false;
+	}
+	if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > getImageWidth() || y + h > getImageHeight())
+	{
+		throwError("rectangle %d,%d %dx%d outside image", x, y, w, h);
+		return false;
+	}
+	if (format != QCT_PIXEL_RGB24 && format != QCT_PIXEL_RGBA32 && format != QCT_PIXEL_BGRA32)
+		return false;
+
+	initPixelLUT(&lut, out_palette, format);
+	job.lut = &lut;
+	job.fn = selectExpandRow();
+	job.src_stride = getImageWidth();
+	job.src = image_data + (size_t)y * job.src_stride + x;
+	job.width = w;
+	job.height = h;
+	job.out = out;
+	job.stride = stride;
+
+	parallelFor((h + EXPAND_BAND - 1) / EXPAND_BAND, parallel ? nthreads : 1, expandBand, &job);
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Expand the palette indexes to R,G,B one strip at a time (see
+ * expandPixels) so each strip goes out in a single fwrite.
+ */
+bool
+QCT::writePPMFile(FILE *fp)
+{
+	PixelLUT lut;
+	ExpandRowFn expand = selectExpandRow();
+	int image_width = getOutputWidth();
+	QCTStripReader strips(this);
+	unsigned char *strip, *rgb;
+	int rows;
+
+	initPixelLUT(&lut, out_palette, QCT_PIXEL_RGB24);
+
+	rgb = (unsigned char*)malloc(getStripHeight() * image_width * 3);
+	if (rgb == NULL)
+		return false;
+
+	// PPM file header (for raw data not ASCII)
+	fprintf(fp, "P6 %d %d 255\n",
+		image_width,
+		getOutputHeight());
+
+	// Expand palette to R,G,B for each pixel
+	while ((strip = strips.next(&rows)) != NULL)
+	{
+		expand(&lut, strip, rows*image_width, rgb);
+		if (fwrite(rgb, 3, rows*image_width, fp) != (size_t)(rows*image_width))
+			break;
+	}
+	free(rgb);
+
+	if (strips.failed() || ferror(fp))
+		return false;
+
+	return(true);
+}
+
+
+bool
+QCT::writePPMFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writePPMFile(fp);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Write the palette indexes unchanged as a PGM (P5) or, if pam is true,
+ * a PAM (P7) file.  The palette is given in header comment lines
+ *   # PALETTE index red green blue
+ * for programs which can use indexed data directly.
+ * With the outline mask a PAM file also has an alpha plane.
+ */
+bool
+QCT::writePGMFile(FILE *fp, bool pam)
+{
+	int image_width = getOutputWidth();
+	QCTStripReader strips(this);
+	unsigned char *strip, *pairs = NULL;
+	bool alpha = (pam && outline_mask);
+	int ii, rows;
+
+	if (alpha)
+	{
+		pairs = (unsigned char*)malloc(getStripHeight() * image_width * 2);
+		if (pairs == NULL)
+			return false;
+	}
+
+	if (pam)
+		fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\n",
+			image_width, getOutputHeight(), alpha ? 2 : 1, alpha ? "GRAYSCALE_ALPHA" : "GRAYSCALE");
+	else
+		fprintf(fp, "P5\n");
+	for (ii=0; ii<256; ii++)
+	{
+		fprintf(fp, "# PALETTE %d %d %d %d\n", ii,
+			PAL_RED(out_palette[ii]), PAL_GREEN(out_palette[ii]), PAL_BLUE(out_palette[ii]));
+	}
+	if (pam)
+		fprintf(fp, "ENDHDR\n");
+	else
+		fprintf(fp, "%d %d 255\n", image_width, getOutputHeight());
+
+	while ((strip = strips.next(&rows)) != NULL)
+	{
+		if (alpha)
+		{
+			// Masked pixels have the transparent index
+			for (ii=0; ii<rows*image_width; ii++)
+			{
+				pairs[ii*2] = strip[ii];
+				pairs[ii*2+1] = (strip[ii] == QCT_TRANSPARENT_INDEX) ? 0 : 255;
+			}
+			if (fwrite(pairs, image_width*2, rows, fp) != (size_t)rows)
+				break;
+		}
+		else if (fwrite(strip, image_width, rows, fp) != (size_t)rows)
+			break;
+	}
+	if (pairs)
+		free(pairs);
+
+	if (strips.failed() || ferror(fp))
+		return false;
+
+	return(true);
+}
+
+
+bool
+QCT::writePGMFilename(const char *filename, bool pam)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writePGMFile(fp, pam);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Built-in GIF encoder.
+ * Takes whole rows of pixels, compresses them with LZW using a hash table
+ * to find strings already in the dictionary, and buffers the codes into
+ * 255-byte sub-blocks which are written out in large chunks.
+ * The code size follows the usual compress/GIF rules so any decoder can
+ * read the result.  QCT colour indexes are all below 128 so 7-bit
+ * codes (a 128 colour table) are enough.
+ */
+#define GIF_MAX_BITS   12
+#define GIF_MAX_CODE   (1 << GIF_MAX_BITS)
+#define GIF_HASH_SIZE  8192   // power of two, at least twice GIF_MAX_CODE
+#define GIF_OUT_SIZE   65536
+
+class GIFEncoder
+{
+public:
+	GIFEncoder(FILE *fp);
+	bool begin(int width, int height, const int *palette, int bits, int transparent = -1);
+	void addRow(const unsigned char *row, int width);
+	bool finish();
+
+private:
+	void output(int code);
+	void putByte(int cc);
+	void flushBlock();
+	void flushOutput();
+	void clearTable();
+
+	FILE *fp;
+	int min_bits, n_bits, max_code;
+	int clear_code, eoi_code, next_code;
+	bool clear_flag;
+	int prefix;                         // current string, -1 if none
+	int hash_key[GIF_HASH_SIZE];        // (prefix << 8 | pixel), -1 if empty
+	short hash_code[GIF_HASH_SIZE];
+	unsigned long accum;                // bits waiting to be output
+	int accum_bits;
+	unsigned char block[256];           // count byte then up to 255 bytes
+	unsigned char out[GIF_OUT_SIZE];
+	int out_len;
+	bool error;
+};
+
+
+GIFEncoder::GIFEncoder(FILE *f)
+{
+	fp = f;
+	prefix = -1;
+	accum = 0;
+	accum_bits = 0;
+	block[0] = 0;
+	out_len = 0;
+	error = false;
+}
+
+
+void
+GIFEncoder::flushOutput()
+{
+	if (out_len && fwrite(out, 1, out_len, fp) != (size_t)out_len)
+		error = true;
+	out_len = 0;
+}
+
+
+void
+GIFEncoder::flushBlock()
+{
+	int len = block[0] + 1;
+	if (block[0] == 0)
+		return;
+	if (out_len + len > GIF_OUT_SIZE)
+		flushOutput();
+	memcpy(out + out_len, block, len);
+	out_len += len;
+	block[0] = 0;
+}
+
+
+void
+GIFEncoder::putByte(int cc)
+{
+	block[++block[0]] = (unsigned char)cc;
+	if (block[0] == 255)
+		flushBlock();
+}
+
+
+void
+GIFEncoder::clearTable()
+{
+	memset(hash_key, 0xff, sizeof(hash_key));
+	next_code = clear_code + 2;
+}
+
+
+void
+GIFEncoder::output(int code)
+{
+	accum |= ((unsigned long)code << accum_bits);
+	accum_bits += n_bits;
+	while (accum_bits >= 8)
+	{
+		putByte(accum & 255);
+		accum >>= 8;
+		accum_bits -= 8;
+	}
+
+	// Change the code size after outputting, the same way the decoder will
+	if (clear_flag)
+	{
+		n_bits = min_bits + 1;
+		max_code = (1 << n_bits) - 1;
+		clear_flag = false;
+	}
+	else if (next_code > max_code && n_bits < GIF_MAX_BITS)
+	{
+		n_bits++;
+		max_code = (1 << n_bits) - 1;
+	}
+}
+
+
+/*
+ * Write the header, colour table and image descriptor.
+ * bits is the number of bits per pixel, the colour table has 2^bits entries.
+ * If transparent is not negative a graphic control extension makes that
+ * colour transparent.
+ */
+bool
+GIFEncoder::begin(int width, int height, const int *palette, int bits, int transparent)
+{
+	unsigned char header[13+3*256+8+10+1];
+	unsigned char *pp = header;
+	int ii;
+
+	if (width > 65535 || height > 65535)
+		return false;
+
+	memcpy(pp, "GIF89a", 6);
+	pp += 6;
+	// Logical screen descriptor with global colour table
+	*pp++ = width & 255;  *pp++ = width >> 8;
+	*pp++ = height & 255; *pp++ = height >> 8;
+	*pp++ = 0x80 | ((bits-1) << 4) | (bits-1);
+	*pp++ = 0;   // background colour
+	*pp++ = 0;   // aspect ratio
+	for (ii=0; ii<(1<<bits); ii++)
+	{
+		*pp++ = PAL_RED(palette[ii]);
+		*pp++ = PAL_GREEN(palette[ii]);
+		*pp++ = PAL_BLUE(palette[ii]);
+	}
+	if (transparent >= 0)
+	{
+		*pp++ = '!';  *pp++ = 0xF9;  *pp++ = 4;
+		*pp++ = 1;    // transparent colour given
+		*pp++ = 0;  *pp++ = 0;       // delay
+		*pp++ = transparent;
+		*pp++ = 0;
+	}
+	// Image descriptor for the whole screen, not interlaced
+	*pp++ = ',';
+	*pp++ = 0; *pp++ = 0; *pp++ = 0; *pp++ = 0;
+	*pp++ = width & 255;  *pp++ = width >> 8;
+	*pp++ = height & 255; *pp++ = height >> 8;
+	*pp++ = 0;
+	// LZW minimum code size (at least 2)
+	min_bits = (bits < 2) ? 2 : bits;
+	*pp++ = min_bits;
+
+	memcpy(out, header, pp - header);
+	out_len = pp - header;
+
+	clear_code = 1 << min_bits;
+	eoi_code = clear_code + 1;
+	clearTable();
+	n_bits = min_bits + 1;
+	max_code = (1 << n_bits) - 1;
+	clear_flag = false;
+	prefix = -1;
+	output(clear_code);
+	return true;
+}
+
+
+void
+GIFEncoder::addRow(const unsigned char *row, int width)
+{
+	int ii, pixel, key, hh;
+
+	ii = 0;
+	if (prefix < 0 && width > 0)
+		prefix = row[ii++];
+
+	for (; ii<width; ii++)
+	{
+		pixel = row[ii];
+		key = (prefix << 8) | pixel;
+		hh = (int)(((unsigned int)key * 2654435761U) >> (32 - 13)) & (GIF_HASH_SIZE-1);
+		// Look for prefix+pixel in the dictionary
+		while (hash_key[hh] != -1 && hash_key[hh] != key)
+			hh = (hh + 1) & (GIF_HASH_SIZE-1);
+		if (hash_key[hh] == key)
+		{
+			prefix = hash_code[hh];
+			continue;
+		}
+		// Not found so output the prefix and add the new string
+		output(prefix);
+		if (next_code < GIF_MAX_CODE)
+		{
+			hash_key[hh] = key;
+			hash_code[hh] = next_code++;
+		}
+		else
+		{
+			// Dictionary full, start again
+			clearTable();
+			clear_flag = true;
+			output(clear_code);
+		}
+		prefix = pixel;
+	}
+}
+
+
+bool
+GIFEncoder::finish()
+{
+	if (prefix >= 0)
+		output(prefix);
+	output(eoi_code);
+	if (accum_bits > 0)
+		putByte(accum & 255);
+	flushBlock();
+	// Block terminator and GIF trailer
+	if (out_len + 2 > GIF_OUT_SIZE)
+		flushOutput();
+	out[out_len++] = 0;
+	out[out_len++] = ';';
+	flushOutput();
+	return !error;
+}
+
+
+bool
+QCT::writeGIFFile(FILE *fp)
+{
+	GIFEncoder *gif;
+	QCTStripReader strips(this);
+	unsigned char *strip;
+	int image_width = getOutputWidth();
+	int ii, rows;
+	bool truth;
+
+	// Encoder is too big for the stack
+	// QCT colours fit in 7 bits unless the transparent or overlay indexes are needed
+	gif = new GIFEncoder(fp);
+	if (!gif->begin(image_width, getOutputHeight(), out_palette, (outline_mask || num_overlay_colours) ? 8 : 7,
+		outline_mask ? QCT_TRANSPARENT_INDEX : -1))
+	{
+		throwError("cannot write file (too big for GIF)");
+		delete gif;
+		return false;
+	}
+
+	while ((strip = strips.next(&rows)) != NULL)
+	{
+		for (ii=0; ii<rows; ii++)
+			gif->addRow(strip + ii * image_width, image_width);
+	}
+
+	truth = gif->finish();
+	delete gif;
+
+	if (strips.failed() || ferror(fp))
+		return false;
+	return truth;
+}
+
+
+bool
+QCT::writeGIFFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writeGIFFile(fp);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ */
+bool
+QCT::writePNGFile(FILE *fp)
+{
+#ifdef USE_PNG
+	int ii;
+	int image_width = getOutputWidth();
+	QCTStripReader strips(this);
+	unsigned char *strip;
+	int rows;
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+	if (!png_ptr)
+		return(false);
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+	{
+		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+		return (false);
+	}
+
+	// Any errors inside png_ functions will return here
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		throwError("PNG file write error\n");
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return false;
+	}
+
+	png_init_io(png_ptr, fp);
+
+	int bit_depth = 8;
+	png_set_IHDR(png_ptr, info_ptr, image_width, getOutputHeight(),
+		bit_depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	int num_palette = 256;
+	png_color pal[num_palette];
+	for (ii=0; ii<256; ii++)
+	{
+		pal[ii].red   = PAL_RED(out_palette[ii]);
+		pal[ii].green = PAL_GREEN(out_palette[ii]);
+		pal[ii].blue  = PAL_BLUE(out_palette[ii]);
+	}
+	png_set_PLTE(png_ptr, info_ptr, pal, num_palette);
+
+	// Outside the outline is transparent
+	png_byte trans[256];
+	if (outline_mask)
+	{
+		memset(trans, 255, sizeof(trans));
+		trans[QCT_TRANSPARENT_INDEX] = 0;
+		png_set_tRNS(png_ptr, info_ptr, trans, 256, NULL);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	// Write the image one strip at a time (decoding as we go if not loaded)
+	while ((strip = strips.next(&rows)) != NULL)
+	{
+		for (ii=0; ii<rows; ii++)
+			png_write_row(png_ptr, strip + ii * image_width);
+	}
+	if (strips.failed())
+	{
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return false;
+	}
+
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	return true;
+#else
+	throwError("cannot write file (PNG not supported)");
+	return false;
+#endif
+}
+
+
+bool
+QCT::writePNGFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writePNGFile(fp);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Tiled TIFF output, written directly without libtiff.
+ * The image is written as 8-bit paletted 256x256 tiles each compressed
+ * separately (in parallel) with Deflate (needs USE_ZLIB) or PackBits.
+ * Each row of TIFF tiles is compressed and written out as soon as the
+ * QCT tile rows covering it have been decoded, then the IFD is written
+ * at the end and its offset patched into the header, so the output
+ * file must be seekable.
+ * Layout:  header, tile data..., IFD, ColorMap, TileOffsets, TileByteCounts
+ */
+#define TIFF_TILE_SIZE     256
+#define TIFF_TILE_PIXELS   (TIFF_TILE_SIZE*TIFF_TILE_SIZE)
+#define TIFF_SHORT         3
+#define TIFF_LONG          4
+#define TIFF_DEFLATE       8
+#define TIFF_PACKBITS      32773
+#define TIFF_IFD_ENTRIES   13
+
+static unsigned char *
+putEntry(unsigned char *pp, int tag, int type, unsigned int count, unsigned int value)
+{
+	putShort(pp, tag);
+	putShort(pp+2, type);
+	putLong(pp+4, count);
+	// Single SHORT values are left-justified in the 4-byte value field
+	if (type == TIFF_SHORT && count == 1)
+	{
+		putShort(pp+8, value);
+		putShort(pp+10, 0);
+	}
+	else
+		putLong(pp+8, value);
+	return pp + 12;
+}
+
+
+/*
+ * PackBits run-length encoding of n bytes from src into dst, which must
+ * have room for n + (n+127)/128 bytes.  Returns number of bytes in dst.
+ */
+static int
+packBits(const unsigned char *src, int n, unsigned char *dst)
+{
+	unsigned char *out = dst;
+	int ii = 0, run, lit;
+
+	while (ii < n)
+	{
+		// Length of run of identical bytes starting here
+		for (run=1; ii+run<n && run<128 && src[ii+run]==src[ii]; run++)
+			;
+		if (run >= 3)
+		{
+			*out++ = (unsigned char)(257 - run);
+			*out++ = src[ii];
+			ii += run;
+			continue;
+		}
+		// Literal bytes up to the start of the next run of 3 or more
+		for (lit=1; ii+lit<n && lit<128; lit++)
+		{
+			if (ii+lit+2 < n && src[ii+lit]==src[ii+lit+1] && src[ii+lit]==src[ii+lit+2])
+				break;
+		}
+		*out++ = (unsigned char)(lit - 1);
+		memcpy(out, src+ii, lit);
+		out += lit;
+		ii += lit;
+	}
+	return (int)(out - dst);
+}
+
+
+/*
+ * One image (IFD) being written, collecting rows into a band of
+ * TIFF_TILE_SIZE rows which is compressed and written when full.
+ */
+struct TIFFPage
+{
+	int width, height;            // in pixels
+	int tiles_across, tiles_down;
+	unsigned int *tile_offset;    // file offset of each tile
+	unsigned int *tile_bytes;     // compressed size of each tile
+	unsigned char *band;          // TIFF_TILE_SIZE rows of width pixels
+	int band_rows;                // rows currently in band
+	int band_num;                 // which row of tiles is in band
+};
+
+// Buffers for compressing one band, one per tile across the image
+struct TIFFBandJob
+{
+	TIFFPage *page;
+	int compression;
+	unsigned char **raw;
+	unsigned char **packed;
+	int *packed_bytes;
+	int packed_size;
+};
+
+static void
+compressTIFFTile(void *arg, int tile_xx)
+{
+	TIFFBandJob *job = (TIFFBandJob*)arg;
+	TIFFPage *page = job->page;
+	unsigned char *raw = job->raw[tile_xx];
+	int xx = tile_xx * TIFF_TILE_SIZE;
+	int cols = page->width - xx;
+	int yy;
+
+	if (cols > TIFF_TILE_SIZE)
+		cols = TIFF_TILE_SIZE;
+
+	// Tiles at the right and bottom edges are padded with zero
+	memset(raw, 0, TIFF_TILE_PIXELS);
+	for (yy=0; yy<page->band_rows; yy++)
+		memcpy(raw + yy*TIFF_TILE_SIZE, page->band + yy*page->width + xx, cols);
+
+#ifdef USE_ZLIB
+	if (job->compression == TIFF_DEFLATE)
+	{
+		uLongf len = job->packed_size;
+		if (compress2(job->packed[tile_xx], &len, raw, TIFF_TILE_PIXELS, Z_DEFAULT_COMPRESSION) != Z_OK)
+			len = 0;
+		job->packed_bytes[tile_xx] = (int)len;
+		return;
+	}
+#endif
+	job->packed_bytes[tile_xx] = packBits(raw, TIFF_TILE_PIXELS, job->packed[tile_xx]);
+}
+
+
+static bool
+initTIFFPage(TIFFPage *page, int width, int height)
+{
+	int num_tiles;
+
+	page->width = width;
+	page->height = height;
+	page->tiles_across = (width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+	page->tiles_down = (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+	num_tiles = page->tiles_across * page->tiles_down;
+	page->tile_offset = (unsigned int*)calloc(num_tiles, sizeof(unsigned int));
+	page->tile_bytes = (unsigned int*)calloc(num_tiles, sizeof(unsigned int));
+	page->band = (unsigned char*)malloc(TIFF_TILE_SIZE * width);
+	page->band_rows = 0;
+	page->band_num = 0;
+	return (page->tile_offset && page->tile_bytes && page->band);
+}
+
+
+static void
+freeTIFFPage(TIFFPage *page)
+{
+	FREE_POINTER(page->tile_offset);
+	FREE_POINTER(page->tile_bytes);
+	FREE_POINTER(page->band);
+}
+
+
+/*
+ * Compress all the tiles in the band in parallel then write them out
+ * in order, updating the file position.
+ */
+static bool
+flushTIFFBand(FILE *fp, OFF_T *pos, TIFFPage *page, TIFFBandJob *job, int nthreads)
+{
+	int xx, tile;
+
+	if (page->band_rows == 0)
+		return true;
+
+	job->page = page;
+	parallelFor(page->tiles_across, nthreads, compressTIFFTile, job);
+
+	for (xx=0; xx<page->tiles_across; xx++)
+	{
+		if (job->packed_bytes[xx] == 0)
+			return false;
+		// Offsets in a classic TIFF are only 32 bits
+		if (*pos + job->packed_bytes[xx] > (OFF_T)0xffffffffUL)
+			return false;
+		tile = page->band_num * page->tiles_across + xx;
+		page->tile_offset[tile] = (unsigned int)*pos;
+		page->tile_bytes[tile] = job->packed_bytes[xx];
+		if (fwrite(job->packed[xx], 1, job->packed_bytes[xx], fp) != (size_t)job->packed_bytes[xx])
+			return false;
+		*pos += job->packed_bytes[xx];
+	}
+	page->band_rows = 0;
+	page->band_num++;
+	return true;
+}
+
+
+static bool
+addTIFFRow(FILE *fp, OFF_T *pos, TIFFPage *page, TIFFBandJob *job, int nthreads, const unsigned char *row)
+{
+	memcpy(page->band + page->band_rows * page->width, row, page->width);
+	if (++page->band_rows < TIFF_TILE_SIZE)
+		return true;
+	return flushTIFFBand(fp, pos, page, job, nthreads);
+}
+
+
+/*
+ * Size of the IFD and the arrays which follow it
+ */
+static int
+sizeTIFFDirectory(TIFFPage *page)
+{
+	int num_tiles = page->tiles_across * page->tiles_down;
+	return 2 + TIFF_IFD_ENTRIES*12 + 4 + 3*256*2 + 2*num_tiles*4;
+}
+
+
+/*
+ * Write the IFD for page at file offset pos, followed by its ColorMap and
+ * tile offset/size arrays.  next is the offset of the following IFD or 0.
+ */
+static bool
+writeTIFFDirectory(FILE *fp, OFF_T pos, TIFFPage *page, const int *palette, int compression, int subfiletype, unsigned int next)
+{
+	int num_tiles = page->tiles_across * page->tiles_down;
+	int size = sizeTIFFDirectory(page);
+	unsigned char *ifd = (unsigned char*)malloc(size);
+	unsigned char *pp;
+	unsigned int colormap_pos = (unsigned int)pos + 2 + TIFF_IFD_ENTRIES*12 + 4;
+	unsigned int offsets_pos = colormap_pos + 3*256*2;
+	unsigned int counts_pos = offsets_pos + num_tiles*4;
+	int ii;
+	bool truth;
+
+	if (ifd == NULL)
+		return false;
+
+	// Entries must be in ascending order of tag
+	putShort(ifd, TIFF_IFD_ENTRIES);
+	pp = ifd + 2;
+	pp = putEntry(pp, 254, TIFF_LONG,  1, subfiletype);   // NewSubfileType
+	pp = putEntry(pp, 256, TIFF_LONG,  1, page->width);   // ImageWidth
+	pp = putEntry(pp, 257, TIFF_LONG,  1, page->height);  // ImageLength
+	pp = putEntry(pp, 258, TIFF_SHORT, 1, 8);             // BitsPerSample
+	pp = putEntry(pp, 259, TIFF_SHORT, 1, compression);   // Compression
+	pp = putEntry(pp, 262, TIFF_SHORT, 1, 3);             // Photometric = Palette
+	pp = putEntry(pp, 277, TIFF_SHORT, 1, 1);             // SamplesPerPixel
+	pp = putEntry(pp, 284, TIFF_SHORT, 1, 1);             // PlanarConfiguration
+	pp = putEntry(pp, 320, TIFF_SHORT, 3*256, colormap_pos); // ColorMap
+	pp = putEntry(pp, 322, TIFF_LONG,  1, TIFF_TILE_SIZE);   // TileWidth
+	pp = putEntry(pp, 323, TIFF_LONG,  1, TIFF_TILE_SIZE);   // TileLength
+	// Arrays of one value are held in the entry itself
+	pp = putEntry(pp, 324, TIFF_LONG,  num_tiles, num_tiles==1 ? page->tile_offset[0] : offsets_pos); // TileOffsets
+	pp = putEntry(pp, 325, TIFF_LONG,  num_tiles, num_tiles==1 ? page->tile_bytes[0] : counts_pos);   // TileByteCounts
+	putLong(pp, next);
+	pp += 4;
+
+	// ColorMap is all reds, then all greens, then all blues, 16 bits each
+	for (ii=0; ii<256; ii++)
+	{
+		putShort(pp + ii*2,         PAL_RED(palette[ii]) * 257);
+		putShort(pp + 512 + ii*2,   PAL_GREEN(palette[ii]) * 257);
+		putShort(pp + 1024 + ii*2,  PAL_BLUE(palette[ii]) * 257);
+	}
+	pp += 3*256*2;
+
+	for (ii=0; ii<num_tiles; ii++)
+		putLong(pp + ii*4, page->tile_offset[ii]);
+	pp += num_tiles*4;
+	for (ii=0; ii<num_tiles; ii++)
+		putLong(pp + ii*4, page->tile_bytes[ii]);
+
+	truth = (fwrite(ifd, 1, size, fp) == (size_t)size);
+	free(ifd);
+	return truth;
+}
+
+
+/*
+ * Combine two rows of pixels into one row of half the width by
+ * interpolating the colours of each 2x2 block.  An odd pixel at the end
+ * of the row is combined with itself.  Indexes outside the interpolation
+ * matrix are not blended.
+ */
+static void
+reduceRows(const unsigned char interp[128][128], const unsigned char *row0, const unsigned char *row1, int width, unsigned char *out)
+{
+	int xx, x1;
+	unsigned char top, bottom;
+
+	for (xx=0; xx<width; xx+=2)
+	{
+		x1 = (xx+1 < width) ? xx+1 : xx;
+		top = (row0[xx] < 128 && row0[x1] < 128) ? interp[row0[xx]][row0[x1]] : row0[xx];
+		bottom = (row1[xx] < 128 && row1[x1] < 128) ? interp[row1[xx]][row1[x1]] : row1[xx];
+		*out++ = (top < 128 && bottom < 128) ? interp[top][bottom] : top;
+	}
+}
+
+
+/*
+ * A page being written plus the buffers to compress it, and for making
+ * the next overview level the previous row waiting for its partner.
+ */
+struct TIFFLevel
+{
+	TIFFPage page;
+	TIFFBandJob job;
+	unsigned char *pending;
+	bool have_pending;
+	unsigned char *reduced;
+};
+
+static bool
+initTIFFLevel(TIFFLevel *level, int width, int height, int compression, int packed_size)
+{
+	TIFFBandJob *job = &level->job;
+	int ii;
+	bool truth;
+
+	truth = initTIFFPage(&level->page, width, height);
+	job->page = &level->page;
+	job->compression = compression;
+	job->packed_size = packed_size;
+	job->raw = (unsigned char**)calloc(level->page.tiles_across, sizeof(unsigned char*));
+	job->packed = (unsigned char**)calloc(level->page.tiles_across, sizeof(unsigned char*));
+	job->packed_bytes = (int*)calloc(level->page.tiles_across, sizeof(int));
+	if (job->raw == NULL || job->packed == NULL || job->packed_bytes == NULL)
+		truth = false;
+	for (ii=0; truth && ii<level->page.tiles_across; ii++)
+	{
+		job->raw[ii] = (unsigned char*)malloc(TIFF_TILE_PIXELS);
+		job->packed[ii] = (unsigned char*)malloc(packed_size);
+		if (job->raw[ii] == NULL || job->packed[ii] == NULL)
+			truth = false;
+	}
+	level->pending = (unsigned char*)malloc(width);
+	level->reduced = (unsigned char*)malloc((width+1)/2);
+	level->have_pending = false;
+	return (truth && level->pending && level->reduced);
+}
+
+
+static void
+freeTIFFLevel(TIFFLevel *level)
+{
+	TIFFBandJob *job = &level->job;
+	int ii;
+
+	for (ii=0; ii<level->page.tiles_across; ii++)
+	{
+		if (job->raw && job->raw[ii]) free(job->raw[ii]);
+		if (job->packed && job->packed[ii]) free(job->packed[ii]);
+	}
+	FREE_POINTER(job->raw);
+	FREE_POINTER(job->packed);
+	FREE_POINTER(job->packed_bytes);
+	FREE_POINTER(level->pending);
+	FREE_POINTER(level->reduced);
+	freeTIFFPage(&level->page);
+}
+
+
+/*
+ * Add a row to the given level and pass every pair of rows on to the
+ * next level down.
+ */
+static bool
+addTIFFLevelRow(FILE *fp, OFF_T *pos, TIFFLevel *levels, int num_levels, int lv, const unsigned char interp[128][128], int nthreads, const unsigned char *row)
+{
+	TIFFLevel *level = &levels[lv];
+
+	if (!addTIFFRow(fp, pos, &level->page, &level->job, nthreads, row))
+		return false;
+	if (lv+1 >= num_levels)
+		return true;
+	if (!level->have_pending)
+	{
+		memcpy(level->pending, row, level->page.width);
+		level->have_pending = true;
+		return true;
+	}
+	level->have_pending = false;
+	reduceRows(interp, level->pending, row, level->page.width, level->reduced);
+	return addTIFFLevelRow(fp, pos, levels, num_levels, lv+1, interp, nthreads, level->reduced);
+}
+
+
+bool
+QCT::writeTIFFFile(FILE *fp, bool deflate, int overviews)
+{
+	QCTStripReader strips(this);
+	unsigned char *strip;
+	unsigned char header[8];
+	TIFFLevel *levels;
+	int num_levels;
+	int compression, packed_size;
+	OFF_T pos, ifd_pos;
+	int ii, lv, rows, ww, hh;
+	bool truth = true;
+
+	compression = TIFF_PACKBITS;
+	packed_size = TIFF_TILE_PIXELS + (TIFF_TILE_PIXELS+127)/128;
+#ifdef USE_ZLIB
+	if (deflate)
+	{
+		compression = TIFF_DEFLATE;
+		packed_size = compressBound(TIFF_TILE_PIXELS);
+	}
+#else
+	if (deflate)
+		message("TIFF Deflate not supported, using PackBits");
+#endif
+
+	// Count the overview levels, negative means until it fits in one tile
+	ww = getOutputWidth();
+	hh = getOutputHeight();
+	num_levels = 1;
+	while ((overviews < 0 || num_levels <= overviews) && ww > 1 && hh > 1 &&
+		(overviews >= 0 || ww > TIFF_TILE_SIZE || hh > TIFF_TILE_SIZE))
+	{
+		ww = (ww+1)/2;
+		hh = (hh+1)/2;
+		num_levels++;
+	}
+
+	levels = (TIFFLevel*)calloc(num_levels, sizeof(TIFFLevel));
+	if (levels == NULL)
+		return false;
+	ww = getOutputWidth();
+	hh = getOutputHeight();
+	for (lv=0; lv<num_levels; lv++)
+	{
+		if (!initTIFFLevel(&levels[lv], ww, hh, compression, packed_size))
+			truth = false;
+		ww = (ww+1)/2;
+		hh = (hh+1)/2;
+	}
+
+	// Header, the IFD offset is filled in at the end
+	header[0] = header[1] = 'I';
+	putShort(header+2, 42);
+	putLong(header+4, 0);
+	if (truth && fwrite(header, 1, 8, fp) != 8)
+		truth = false;
+	pos = 8;
+
+	// Tile data, written a band at a time as the image is decoded
+	while (truth && (strip = strips.next(&rows)) != NULL)
+	{
+		for (ii=0; truth && ii<rows; ii++)
+			truth = addTIFFLevelRow(fp, &pos, levels, num_levels, 0, out_interp, nthreads, strip + ii * levels[0].page.width);
+	}
+	if (strips.failed())
+		truth = false;
+
+	// Pass on any odd last row (combined with itself) and finish each level
+	for (lv=0; truth && lv<num_levels; lv++)
+	{
+		if (levels[lv].have_pending)
+		{
+			reduceRows(out_interp, levels[lv].pending, levels[lv].pending, levels[lv].page.width, levels[lv].reduced);
+			truth = addTIFFLevelRow(fp, &pos, levels, num_levels, lv+1, out_interp, nthreads, levels[lv].reduced);
+		}
+		if (truth)
+			truth = flushTIFFBand(fp, &pos, &levels[lv].page, &levels[lv].job, nthreads);
+	}
+
+	// IFDs must start on a word boundary
+	if (truth && (pos & 1))
+	{
+		fputc(0, fp);
+		pos++;
+	}
+	ifd_pos = pos;
+	for (lv=0; truth && lv<num_levels; lv++)
+	{
+		OFF_T next = pos + sizeTIFFDirectory(&levels[lv].page);
+		truth = writeTIFFDirectory(fp, pos, &levels[lv].page, out_palette, compression,
+			lv ? 1 : 0, (lv+1 < num_levels) ? (unsigned int)next : 0);
+		pos = next;
+	}
+
+	// Now the IFD offset is known put it in the header
+	if (truth)
+	{
+		putLong(header+4, (unsigned int)ifd_pos);
+		if (FSEEKO(fp, 4, SEEK_SET) != 0 || fwrite(header+4, 1, 4, fp) != 4)
+		{
+			throwError("cannot write TIFF header (output must be seekable)");
+			truth = false;
+		}
+		FSEEKO(fp, 0, SEEK_END);
+	}
+	else
+		throwError("TIFF file write error");
+
+	for (lv=0; lv<num_levels; lv++)
+		freeTIFFLevel(&levels[lv]);
+	free(levels);
+
+	if (ferror(fp))
+		return false;
+	return truth;
+}
+
+
+bool
+QCT::writeTIFFFilename(const char *filename, bool deflate, int overviews)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writeTIFFFile(fp, deflate, overviews);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Change the coefficients of a cubic in x and y (c, X, Y, XX, XY, YY, XXX,
+ * XXY, XYY, YYY as in the lat and lon ones) so that it gives the same
+ * values with the origin moved to (dx,dy).
+ */
+static void
+shiftCubic(double *cc, double dx, double dy)
+{
+	static const int powers[10][2] = { {0,0}, {1,0}, {0,1}, {2,0}, {1,1}, {0,2}, {3,0}, {2,1}, {1,2}, {0,3} };
+	static const int binomial[4][4] = { {1,0,0,0}, {1,1,0,0}, {1,2,1,0}, {1,3,3,1} };
+	double shifted[10];
+	int kk, tt, ii, jj;
+
+	for (kk=0; kk<10; kk++)
+	{
+		shifted[kk] = 0;
+		for (tt=0; tt<10; tt++)
+		{
+			ii = powers[tt][0];
+			jj = powers[tt][1];
+			if (ii < powers[kk][0] || jj < powers[kk][1])
+				continue;
+			shifted[kk] += cc[tt] * binomial[ii][powers[kk][0]] * binomial[jj][powers[kk][1]] *
+				pow(dx, ii - powers[kk][0]) * pow(dy, jj - powers[kk][1]);
+		}
+	}
+	memcpy(cc, shifted, sizeof(shifted));
+}
+
+
+// Write all of data to fd, returns false on error
+static bool
+writeAll(int fd, const unsigned char *data, size_t len)
+{
+	ssize_t nn;
+
+	while (len > 0)
+	{
+		nn = write(fd, data, len);
+		if (nn < 0 && errno == EINTR)
+			continue;
+		if (nn <= 0)
+			return false;
+		data += nn;
+		len -= nn;
+	}
+	return true;
+}
+
+
+// Gift as much of data as possible to pipe fd, write the rest.  The
+// pages of data must not be used again.
+static bool
+spliceAll(int fd, const unsigned char *data, size_t len)
+{
+#ifdef __linux__
+	struct iovec iov;
+	ssize_t nn;
+
+	while (len > 0)
+	{
+		iov.iov_base = (void*)data;
+		iov.iov_len = len;
+		nn = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+		if (nn < 0 && errno == EINTR)
+			continue;
+		if (nn <= 0)
+			break;
+		data += nn;
+		len -= nn;
+	}
+#endif
+	return writeAll(fd, data, len);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Raw indexed image (see QCT_RAW_MAGIC in qct.h for the layout).
+ * When streaming an image which has not been loaded to a pipe on Linux,
+ * the strip reader decodes each strip in the background into its own
+ * newly mapped buffer which is handed to the pipe with vmsplice and
+ * SPLICE_F_GIFT, so the pages are moved into the pipe rather than copied
+ * and are never touched again, and decoding overlaps the writing.
+ * A loaded image is always copied into the file or pipe with ordinary
+ * writes: its pages would still be referenced by the pipe after
+ * returning, when the caller may change or free them.  A crop, or a
+ * kernel without vmsplice, is written normally too.
+ */
+bool
+QCT::writeRawFile(FILE *fp)
+{
+	unsigned char header[QCT_RAW_HEADER_SIZE];
+	double coeffs[QCT_RAW_COEFFS] =
+	{
+		eas, easY, easX, easYY, easXY, easXX, easYYY, easXYY, easXXY, easXXX,
+		nor, norY, norX, norYY, norXY, norXX, norYYY, norXYY, norXXY, norXXX,
+		lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY,
+		lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY,
+		datum_shift_north, datum_shift_east
+	};
+	int image_width = getImageWidth(), image_height = getImageHeight();
+	size_t strip_bytes = (size_t)getStripHeight() * image_width;
+	unsigned char *pp, *strip;
+	bool use_splice = false, cropped, truth;
+	struct stat st;
+	int ii, rows, fd, crop_x0, crop_y0;
+
+	// A crop has its own size and the coefficients move to its origin
+	cropped = getCrop(&crop_x0, &crop_y0, &image_width, &image_height);
+	if (cropped)
+	{
+		coeffs[0]  -= crop_x0 * scalefactor;
+		coeffs[10] -= crop_y0 * scalefactor;
+		shiftCubic(coeffs + 20, crop_x0 * scalefactor, crop_y0 * scalefactor);
+		shiftCubic(coeffs + 30, crop_x0 * scalefactor, crop_y0 * scalefactor);
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, QCT_RAW_MAGIC, 8);
+	putLong(header+8,  QCT_RAW_VERSION);
+	putLong(header+12, QCT_RAW_HEADER_SIZE);
+	putLong(header+16, image_width);
+	putLong(header+20, image_height);
+	putLong(header+24, scalefactor);
+	pp = header + 32;
+	for (ii=0; ii<QCT_RAW_COEFFS; ii++, pp+=8)
+		putDouble(pp, coeffs[ii]);
+	for (ii=0; ii<256; ii++, pp+=4)
+	{
+		pp[0] = PAL_RED(out_palette[ii]);
+		pp[1] = PAL_GREEN(out_palette[ii]);
+		pp[2] = PAL_BLUE(out_palette[ii]);
+	}
+	if (fwrite(header, sizeof(header), 1, fp) != 1 || fflush(fp))
+		return false;
+
+	fd = fileno(fp);
+#ifdef __linux__
+	use_splice = (!cropped && !image_data && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode));
+#endif
+
+	if (use_splice)
+	{
+		QCTStripReader gifts(this, true);
+		while ((strip = gifts.next(&rows)) != NULL)
+		{
+			truth = spliceAll(fd, strip, strip_bytes);
+			gifts.release(strip);
+			if (!truth)
+				return false;
+		}
+		return !gifts.failed();
+	}
+
+	QCTStripReader strips(this);
+	while ((strip = strips.next(&rows)) != NULL)
+	{
+		if (fwrite(strip, image_width, rows, fp) != (size_t)rows)
+			break;
+	}
+
+	if (strips.failed() || ferror(fp))
+		return false;
+
+	return(true);
+}
+
+
+bool
+QCT::writeRawFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writeRawFile(fp);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Convert pixel (x,y) in image into (longitude,latitude)
+ * x,y from top left
+ * latitude,longitude in degrees WGS84.
+ * clips out of range x,y rather than blindly converting.
+ */
+int
+QCT::xy_to_latlon(int x, int y, double *latitude, double *longitude) const
+{
+	// Powers in double, x^3 overflows an int above 1290
+	double x2, y2, x3, y3;
+
+	x *= scalefactor;
+	y *= scalefactor;
+
+	// Range check - clip to image limits, or allow extrapolation?
+	if (x<0) x=0;
+	if (y<0) y=0;
+	if (x>=width*QCT_TILE_SIZE) x=width*QCT_TILE_SIZE-1;
+	if (y>=height*QCT_TILE_SIZE) y=height*QCT_TILE_SIZE;
+
+	x2 = (double)x * x;
+	x3 = x2 * x;
+	y2 = (double)y * y;
+	y3 = y2 * y;
+
+	// Python:
+	// coeffs in order are: c, cy, cx, cy2, cxy, cx2, cy3, cy2x, cyx2, cx3
+	// There are coefficients for x and for y
+	// each coordinate is calculated as
+	// c + cy*y + cx*x + cy2*y^2 + cxy*x*y + cx2*x^2 + cy3*y^3 + cy2x*(y^2)*x + cyx2*y*x^2 + cx3*x^3
+	// c0 + c1*y + c2*x + c3*y^2 + c4*x*y + c5*x^2 + c6*y^3 + c7*(y^2)*x + c8*y*x^2 + c9*x^3
+
+	// Touratech:
+	// Substitute into a and b as follows:
+	// 	x and y to latitude or longitude: x and y
+	// 	lat and lon to x or y: lat and lon
+
+	// x = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
+	// y = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
+	// lat = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
+	// lon = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
+
+	// New equations (1.01) :
+	// eas, easY, easX, easYY, easXY, easXX, easYYY, easYYX, easYXX, easXXX;
+	// nor, norY, norX, norYY, norXY, norXX, norYYY, norYYX, norYXX, norXXX;
+	// lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY;
+	// lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY;
+	*longitude = lon + lonX * x + lonY * y + lonXX * x2 + lonXY * x * y +
+		lonYY * y2 + lonXXX * x3 + lonXXY * x2 * y + lonXYY * x * y2 + lonYYY * y3;
+	*latitude = lat + latX * x + latY * y + latXX * x2 + latXY * x * y +
+		latYY * y2 + latXXX * x3 + latXXY * x2 * y + latXYY * x * y2 + latYYY * y3;
+	// Mistyped in doc:
+#if 0
+	*longitude = lonXXX * x3 + lonXX * x2 + lonX * x +
+		lonYYY * y3 + lonYY * y2 + lonY * y +
+		lonXXY * x2 * y + lonYYX * y2 * x + lonXY * xy +
+		lon;
+	*latitude = latXXX * x3 + latXX * x2 + latX * x +
+		latYYY * y3 + latYY * y2 + latY * y +
+		latXXY * x2 * y + latYYX * y2 * x + latXY * xy +
+		lat;
+#endif
+
+	// Old equations (1.00) :
+#if 0
+	x2 = x * x;
+	y2 = y * y;
+	R = lonX2 * x2 + lonY2 * y2 + lonX * x + lonY * y + lonXY * x * y + lon;
+	S = latX2 * x2 + latY2 * y2 + latX * x + latY * y + latXY * x * y + lat;
+	R2 = R * R;
+	S2 = S * S;
+	T = easX2 * R2 + easY2 * S2 + easX * R + easY * S + easXY * R * S + eas + 2 * x;
+	U = norX2 * R2 + norY2 * S2 + norX * R + norY * S + norXY * R * S + nor + 2 * y;
+	T2 = T * T;
+	U2 = U * U;
+	*longitude = lonX2 * T2 + lonY2 * U2 + lonX * T + lonY * U + lonXY * T * U + lon;
+	*latitude  = latX2 * T2 + latY2 * U2 + latX * T + latY * U + latXY * T * U + lat;
+#endif
+
+	// Add the datum shift
+	*longitude += datum_shift_east;
+	*latitude  += datum_shift_north;
+
+	return(0);
+}
+
+
+int
+QCT::latlon_to_xy(double latitude, double longitude, int *pixel_x, int *pixel_y) const
+{
+	double longitude2, latitude2, longitude3, latitude3;
+
+	// Range check - clip to image limits, or allow extrapolation?
+	if (latitude<-90)   latitude=-90;
+	if (latitude>90)    latitude=90;
+	if (longitude<-360) longitude=0;
+	if (longitude>360)  longitude=0;
+
+	// Remove the datum shift, before the powers are taken
+	longitude -= datum_shift_east;
+	latitude  -= datum_shift_north;
+
+	longitude2 = longitude * longitude;
+	longitude3 = longitude2 * longitude;
+	latitude2 = latitude * latitude;
+	latitude3 = latitude2 * latitude;
+
+	*pixel_x = NINT(eas + easX * longitude + easY * latitude + easXX * longitude2 + easXY * longitude * latitude +
+		easYY * latitude2 + easXXX * longitude3 + easXXY * longitude2 * latitude + easXYY * longitude * latitude2 + easYYY * latitude3);
+	*pixel_y = NINT(nor + norX * longitude + norY * latitude + norXX * longitude2 + norXY * longitude * latitude +
+		norYY * latitude2 + norXXX * longitude3 + norXXY * longitude2 * latitude + norXYY * longitude * latitude2 + norYYY * latitude3);
+
+	*pixel_x /= scalefactor;
+	*pixel_y /= scalefactor;
+
+	return(-1);
+}
+
+
+/* -------------------------------------------------------------------------
+ * As xy_to_latlon and latlon_to_xy but in full resolution pixels (whatever
+ * the scalefactor) as doubles, without clipping or rounding.
+ * The datum shift is removed before the powers of latitude and longitude
+ * are calculated.
+ */
+void
+QCT::pixelToLatLon(double x, double y, double *latitude, double *longitude) const
+{
+	double x2 = x * x, y2 = y * y;
+
+	*longitude = lon + lonX * x + lonY * y + lonXX * x2 + lonXY * x * y +
+		lonYY * y2 + lonXXX * x2 * x + lonXXY * x2 * y + lonXYY * x * y2 + lonYYY * y2 * y;
+	*latitude = lat + latX * x + latY * y + latXX * x2 + latXY * x * y +
+		latYY * y2 + latXXX * x2 * x + latXXY * x2 * y + latXYY * x * y2 + latYYY * y2 * y;
+
+	*longitude += datum_shift_east;
+	*latitude  += datum_shift_north;
+}
+
+
+void
+QCT::latlonToPixel(double latitude, double longitude, double *x, double *y) const
+{
+	double lon1, lat1, lon2, lat2;
+
+	lon1 = longitude - datum_shift_east;
+	lat1 = latitude  - datum_shift_north;
+	lon2 = lon1 * lon1;
+	lat2 = lat1 * lat1;
+
+	*x = eas + easX * lon1 + easY * lat1 + easXX * lon2 + easXY * lon1 * lat1 +
+		easYY * lat2 + easXXX * lon2 * lon1 + easXXY * lon2 * lat1 + easXYY * lon1 * lat2 + easYYY * lat2 * lat1;
+	*y = nor + norX * lon1 + norY * lat1 + norXX * lon2 + norXY * lon1 * lat1 +
+		norYY * lat2 + norXXX * lon2 * lon1 + norXXY * lon2 * lat1 + norXYY * lon1 * lat2 + norYYY * lat2 * lat1;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Batch conversions of arrays of points.
+ * Each cubic is evaluated in nested (Horner) form
+ *   c + Y(cY + Y(cYY + Y cYYY)) + X(cX + Y(cXY + Y cXYY) + X(cXX + Y cXXY + X cXXX))
+ * in double precision, four points at a time with AVX2/FMA where the
+ * processor has it, and large arrays are split between threads.
+ */
+#define GEO_BATCH 16384
+
+// A pair of cubics and the scaling of their inputs and outputs:
+//   X = in_x*in_mul + in_add_x, Y likewise, out = cubic(X,Y)*out_mul + out_add
+struct GeoBatch
+{
+	double c1[10], c2[10];     // c, X, Y, XX, XY, YY, XXX, XXY, XYY, YYY
+	double in_mul, in_add_x, in_add_y;
+	double out_mul, out_add1, out_add2;
+	const double *in_x, *in_y;
+	double *out1, *out2;
+	int count;
+};
+
+#define HORNER(c, X, Y) \
+	((c)[0] + (Y)*((c)[2] + (Y)*((c)[5] + (Y)*(c)[9])) + \
+	(X)*((c)[1] + (Y)*((c)[4] + (Y)*(c)[8]) + (X)*((c)[3] + (Y)*(c)[7] + (X)*(c)[6])))
+
+static void
+setCubic(double *cc, double c, double cX, double cY, double cXX, double cXY, double cYY,
+	double cXXX, double cXXY, double cXYY, double cYYY)
+{
+	cc[0] = c;   cc[1] = cX;   cc[2] = cY;
+	cc[3] = cXX; cc[4] = cXY;  cc[5] = cYY;
+	cc[6] = cXXX; cc[7] = cXXY; cc[8] = cXYY; cc[9] = cYYY;
+}
+
+
+static void
+geoBatchScalar(const GeoBatch *gb, int first, int last)
+{
+	int ii;
+	double xx, yy;
+
+	for (ii=first; ii<last; ii++)
+	{
+		xx = gb->in_x[ii] * gb->in_mul + gb->in_add_x;
+		yy = gb->in_y[ii] * gb->in_mul + gb->in_add_y;
+		gb->out1[ii] = HORNER(gb->c1, xx, yy) * gb->out_mul + gb->out_add1;
+		gb->out2[ii] = HORNER(gb->c2, xx, yy) * gb->out_mul + gb->out_add2;
+	}
+}
+
+
+#ifdef QCT_X86_SIMD
+__attribute__((target("avx2,fma")))
+static inline __m256d
+horner4(const double *cc, __m256d xx, __m256d yy)
+{
+	// Innermost terms first, as in HORNER
+	__m256d ty = _mm256_fmadd_pd(yy, _mm256_set1_pd(cc[9]), _mm256_set1_pd(cc[5]));
+	ty = _mm256_fmadd_pd(yy, ty, _mm256_set1_pd(cc[2]));
+	ty = _mm256_fmadd_pd(yy, ty, _mm256_set1_pd(cc[0]));
+	__m256d tx = _mm256_fmadd_pd(xx, _mm256_set1_pd(cc[6]),
+		_mm256_fmadd_pd(yy, _mm256_set1_pd(cc[7]), _mm256_set1_pd(cc[3])));
+	__m256d txy = _mm256_fmadd_pd(yy, _mm256_set1_pd(cc[8]), _mm256_set1_pd(cc[4]));
+	tx = _mm256_fmadd_pd(xx, tx, _mm256_fmadd_pd(yy, txy, _mm256_set1_pd(cc[1])));
+	return _mm256_fmadd_pd(xx, tx, ty);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void
+geoBatchAVX2(const GeoBatch *gb, int first, int last)
+{
+	__m256d in_mul = _mm256_set1_pd(gb->in_mul);
+	__m256d add_x = _mm256_set1_pd(gb->in_add_x), add_y = _mm256_set1_pd(gb->in_add_y);
+	__m256d out_mul = _mm256_set1_pd(gb->out_mul);
+	__m256d add1 = _mm256_set1_pd(gb->out_add1), add2 = _mm256_set1_pd(gb->out_add2);
+	__m256d xx, yy;
+	int ii;
+
+	for (ii=first; ii+4<=last; ii+=4)
+	{
+		xx = _mm256_fmadd_pd(_mm256_loadu_pd(gb->in_x + ii), in_mul, add_x);
+		yy = _mm256_fmadd_pd(_mm256_loadu_pd(gb->in_y + ii), in_mul, add_y);
+		_mm256_storeu_pd(gb->out1 + ii, _mm256_fmadd_pd(horner4(gb->c1, xx, yy), out_mul, add1));
+		_mm256_storeu_pd(gb->out2 + ii, _mm256_fmadd_pd(horner4(gb->c2, xx, yy), out_mul, add2));
+	}
+	geoBatchScalar(gb, ii, last);
+}
+#endif // QCT_X86_SIMD
+
+
+static void
+geoBatchJob(void *arg, int chunk)
+{
+	const GeoBatch *gb = (const GeoBatch*)arg;
+	int first = chunk * GEO_BATCH;
+	int last = (first + GEO_BATCH < gb->count) ? first + GEO_BATCH : gb->count;
+
+#ifdef QCT_X86_SIMD
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		geoBatchAVX2(gb, first, last);
+		return;
+	}
+#endif
+	geoBatchScalar(gb, first, last);
+}
+
+
+/*
+ * Convert count points (x[i],y[i]) in image pixels (at the current scale,
+ * not rounded or clipped) to latitude and longitude in degrees WGS84.
+ */
+void
+QCT::pixelsToLatLon(int count, const double *x, const double *y, double *latitude, double *longitude) const
+{
+	GeoBatch gb;
+
+	setCubic(gb.c1, lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY);
+	setCubic(gb.c2, lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY);
+	gb.in_mul = scalefactor;
+	gb.in_add_x = gb.in_add_y = 0;
+	gb.out_mul = 1;
+	gb.out_add1 = datum_shift_north;
+	gb.out_add2 = datum_shift_east;
+	gb.in_x = x;
+	gb.in_y = y;
+	gb.out1 = latitude;
+	gb.out2 = longitude;
+	gb.count = count;
+	parallelFor((count + GEO_BATCH - 1) / GEO_BATCH, nthreads, geoBatchJob, &gb);
+}
+
+
+/*
+ * Convert count points from latitude and longitude in degrees WGS84 to
+ * image pixels (at the current scale, not rounded or clipped).
+ */
+void
+QCT::latLonToPixels(int count, const double *latitude, const double *longitude, double *x, double *y) const
+{
+	GeoBatch gb;
+
+	setCubic(gb.c1, eas, easX, easY, easXX, easXY, easYY, easXXX, easXXY, easXYY, easYYY);
+	setCubic(gb.c2, nor, norX, norY, norXX, norXY, norYY, norXXX, norXXY, norXYY, norYYY);
+	gb.in_mul = 1;
+	gb.in_add_x = -datum_shift_east;
+	gb.in_add_y = -datum_shift_north;
+	gb.out_mul = 1.0 / scalefactor;
+	gb.out_add1 = gb.out_add2 = 0;
+	gb.in_x = longitude;
+	gb.in_y = latitude;
+	gb.out1 = x;
+	gb.out2 = y;
+	gb.count = count;
+	parallelFor((count + GEO_BATCH - 1) / GEO_BATCH, nthreads, geoBatchJob, &gb);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Refined conversion from latitude and longitude to pixels.
+ * The eas/nor cubics are only an approximate inverse of the lat/lon ones,
+ * so their answer is used as the starting point for Newton's method on
+ * the forward transform: each step solves the 2x2 system given by the
+ * derivatives of the lat and lon cubics at the current point.  Points stop
+ * when a step is no bigger than the tolerance; four points are done at a
+ * time with AVX2/FMA where the processor has it.
+ */
+
+struct GeoNewton
+{
+	double fwd1[10], fwd2[10]; // lat and lon cubics of full size pixels
+	double inv1[10], inv2[10]; // x and y cubics of lon,lat (first guess)
+	double shift_north, shift_east;
+	double tolerance, inv_scale;
+	int max_iterations;
+	const double *lat, *lon;
+	double *x, *y;
+	bool *converged;
+	int count, *num_converged;
+};
+
+
+// Cubic as in HORNER and its partial derivatives in X and Y
+static inline void
+cubicGradient(const double *c, double X, double Y, double *v, double *dX, double *dY)
+{
+	*v = HORNER(c, X, Y);
+	*dX = c[1] + Y*(c[4] + Y*c[8]) + X*(2*c[3] + 2*c[7]*Y + 3*c[6]*X);
+	*dY = c[2] + Y*(2*c[5] + 3*c[9]*Y) + X*(c[4] + 2*c[8]*Y + c[7]*X);
+}
+
+
+static int
+geoNewtonScalar(const GeoNewton *gn, int first, int last)
+{
+	double lon1, lat1, xx, yy, la, lo, la_x, la_y, lo_x, lo_y, det, dx, dy;
+	int ii, it, num = 0;
+	bool done;
+
+	for (ii=first; ii<last; ii++)
+	{
+		lon1 = gn->lon[ii] - gn->shift_east;
+		lat1 = gn->lat[ii] - gn->shift_north;
+		xx = HORNER(gn->inv1, lon1, lat1);
+		yy = HORNER(gn->inv2, lon1, lat1);
+		done = false;
+		for (it=0; it<gn->max_iterations && !done; it++)
+		{
+			cubicGradient(gn->fwd1, xx, yy, &la, &la_x, &la_y);
+			cubicGradient(gn->fwd2, xx, yy, &lo, &lo_x, &lo_y);
+			la -= lat1;
+			lo -= lon1;
+			det = la_x * lo_y - la_y * lo_x;
+			dx = (la * lo_y - la_y * lo) / det;
+			dy = (la_x * lo - la * lo_x) / det;
+			if (!(fabs(dx) < HUGE_VAL && fabs(dy) < HUGE_VAL))
+				break; // singular, keep the last good point
+			xx -= dx;
+			yy -= dy;
+			done = (fabs(dx) <= gn->tolerance && fabs(dy) <= gn->tolerance);
+		}
+		gn->x[ii] = xx * gn->inv_scale;
+		gn->y[ii] = yy * gn->inv_scale;
+		if (gn->converged)
+			gn->converged[ii] = done;
+		num += done;
+	}
+	return num;
+}
+
+
+#ifdef QCT_X86_SIMD
+__attribute__((target("avx2,fma")))
+static inline void
+cubicGradient4(const double *c, __m256d xx, __m256d yy, __m256d *v, __m256d *dX, __m256d *dY)
+{
+	__m256d two = _mm256_set1_pd(2), three = _mm256_set1_pd(3);
+	__m256d c4 = _mm256_set1_pd(c[4]), c7 = _mm256_set1_pd(c[7]), c8 = _mm256_set1_pd(c[8]);
+
+	*v = horner4(c, xx, yy);
+	// c1 + Y(c4 + Y c8) + X(2c3 + 2c7 Y + 3c6 X)
+	__m256d tx = _mm256_fmadd_pd(_mm256_mul_pd(three, _mm256_set1_pd(c[6])), xx,
+		_mm256_fmadd_pd(_mm256_mul_pd(two, c7), yy, _mm256_mul_pd(two, _mm256_set1_pd(c[3]))));
+	*dX = _mm256_fmadd_pd(xx, tx,
+		_mm256_fmadd_pd(yy, _mm256_fmadd_pd(yy, c8, c4), _mm256_set1_pd(c[1])));
+	// c2 + Y(2c5 + 3c9 Y) + X(c4 + 2c8 Y + c7 X)
+	__m256d ty = _mm256_fmadd_pd(_mm256_mul_pd(three, _mm256_set1_pd(c[9])), yy,
+		_mm256_mul_pd(two, _mm256_set1_pd(c[5])));
+	*dY = _mm256_fmadd_pd(xx, _mm256_fmadd_pd(c7, xx, _mm256_fmadd_pd(_mm256_mul_pd(two, c8), yy, c4)),
+		_mm256_fmadd_pd(yy, ty, _mm256_set1_pd(c[2])));
+}
+
+
+__attribute__((target("avx2,fma")))
+static int
+geoNewtonAVX2(const GeoNewton *gn, int first, int last)
+{
+	__m256d shift_e = _mm256_set1_pd(gn->shift_east), shift_n = _mm256_set1_pd(gn->shift_north);
+	__m256d tol = _mm256_set1_pd(gn->tolerance), inv_scale = _mm256_set1_pd(gn->inv_scale);
+	__m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+	__m256d lon1, lat1, xx, yy, la, lo, la_x, la_y, lo_x, lo_y, rdet, dx, dy, done, ok;
+	int ii, it, num = 0, bits;
+
+	for (ii=first; ii+4<=last; ii+=4)
+	{
+		lon1 = _mm256_sub_pd(_mm256_loadu_pd(gn->lon + ii), shift_e);
+		lat1 = _mm256_sub_pd(_mm256_loadu_pd(gn->lat + ii), shift_n);
+		xx = horner4(gn->inv1, lon1, lat1);
+		yy = horner4(gn->inv2, lon1, lat1);
+		done = _mm256_setzero_pd();
+		for (it=0; it<gn->max_iterations; it++)
+		{
+			cubicGradient4(gn->fwd1, xx, yy, &la, &la_x, &la_y);
+			cubicGradient4(gn->fwd2, xx, yy, &lo, &lo_x, &lo_y);
+			la = _mm256_sub_pd(la, lat1);
+			lo = _mm256_sub_pd(lo, lon1);
+			rdet = _mm256_div_pd(_mm256_set1_pd(1), _mm256_fmsub_pd(la_x, lo_y, _mm256_mul_pd(la_y, lo_x)));
+			dx = _mm256_mul_pd(_mm256_fmsub_pd(la, lo_y, _mm256_mul_pd(la_y, lo)), rdet);
+			dy = _mm256_mul_pd(_mm256_fmsub_pd(la_x, lo, _mm256_mul_pd(la, lo_x)), rdet);
+			// Only lanes still going with a finite step move
+			ok = _mm256_andnot_pd(done, _mm256_and_pd(
+				_mm256_cmp_pd(_mm256_and_pd(dx, abs_mask), _mm256_set1_pd(HUGE_VAL), _CMP_LT_OQ),
+				_mm256_cmp_pd(_mm256_and_pd(dy, abs_mask), _mm256_set1_pd(HUGE_VAL), _CMP_LT_OQ)));
+			xx = _mm256_sub_pd(xx, _mm256_and_pd(ok, dx));
+			yy = _mm256_sub_pd(yy, _mm256_and_pd(ok, dy));
+			done = _mm256_or_pd(done, _mm256_and_pd(ok, _mm256_and_pd(
+				_mm256_cmp_pd(_mm256_and_pd(dx, abs_mask), tol, _CMP_LE_OQ),
+				_mm256_cmp_pd(_mm256_and_pd(dy, abs_mask), tol, _CMP_LE_OQ))));
+			// Singular lanes stop too, but not as converged
+			if (_mm256_movemask_pd(_mm256_andnot_pd(done, ok)) == 0)
+				break;
+		}
+		_mm256_storeu_pd(gn->x + ii, _mm256_mul_pd(xx, inv_scale));
+		_mm256_storeu_pd(gn->y + ii, _mm256_mul_pd(yy, inv_scale));
+		bits = _mm256_movemask_pd(done);
+		if (gn->converged)
+		{
+			gn->converged[ii]   = (bits & 1) != 0;
+			gn->converged[ii+1] = (bits & 2) != 0;
+			gn->converged[ii+2] = (bits & 4) != 0;
+			gn->converged[ii+3] = (bits & 8) != 0;
+		}
+		num += __builtin_popcount(bits);
+	}
+	return num + geoNewtonScalar(gn, ii, last);
+}
+#endif // QCT_X86_SIMD
+
+
+static void
+geoNewtonJob(void *arg, int chunk)
+{
+	const GeoNewton *gn = (const GeoNewton*)arg;
+	int first = chunk * GEO_BATCH;
+	int last = (first + GEO_BATCH < gn->count) ? first + GEO_BATCH : gn->count;
+
+#ifdef QCT_X86_SIMD
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		gn->num_converged[chunk] = geoNewtonAVX2(gn, first, last);
+		return;
+	}
+#endif
+	gn->num_converged[chunk] = geoNewtonScalar(gn, first, last);
+}
+
+
+/*
+ * Convert count points from latitude and longitude in degrees WGS84 to
+ * image pixels (at the current scale, not rounded or clipped) such that
+ * pixelsToLatLon gives the same latitude and longitude back.
+ * Refinement stops when a step is within tolerance pixels (at the current
+ * scale) or after max_iterations steps.  converged[i], if not NULL, is set
+ * when point i met the tolerance.  Returns the number of points that did.
+ */
+int
+QCT::latLonToPixelsRefined(int count, const double *latitude, const double *longitude,
+	double *x, double *y, bool *converged, double tolerance, int max_iterations) const
+{
+	GeoNewton gn;
+	int chunks = (count + GEO_BATCH - 1) / GEO_BATCH;
+	int ii, num = 0;
+
+	setCubic(gn.fwd1, lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY);
+	setCubic(gn.fwd2, lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY);
+	setCubic(gn.inv1, eas, easX, easY, easXX, easXY, easYY, easXXX, easXXY, easXYY, easYYY);
+	setCubic(gn.inv2, nor, norX, norY, norXX, norXY, norYY, norXXX, norXXY, norXYY, norYYY);
+	gn.shift_north = datum_shift_north;
+	gn.shift_east = datum_shift_east;
+	gn.tolerance = tolerance * scalefactor;
+	gn.inv_scale = 1.0 / scalefactor;
+	gn.max_iterations = max_iterations;
+	gn.lat = latitude;
+	gn.lon = longitude;
+	gn.x = x;
+	gn.y = y;
+	gn.converged = converged;
+	gn.count = count;
+	gn.num_converged = (int*)calloc(chunks + 1, sizeof(int));
+	if (gn.num_converged == NULL)
+		return geoNewtonScalar(&gn, 0, count);
+	parallelFor(chunks, nthreads, geoNewtonJob, &gn);
+	for (ii=0; ii<chunks; ii++)
+		num += gn.num_converged[ii];
+	free(gn.num_converged);
+	return num;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Coordinate grid.
+ * For many conversions over the same chart (cursor readout, labelling
+ * tiles) the latitude and longitude can be calculated once at the nodes
+ * of a grid, every spacing pixels at the current scale, and bilinearly
+ * interpolated in between (gridToLatLon).  When the grid is built the
+ * interpolation is checked against the exact polynomial at the middle of
+ * every cell and of its edges and the worst error (in degrees) reported.
+ * The grid can be saved and loaded again (see QCT_GRID_MAGIC in qct.h);
+ * a saved grid is only accepted for the same georeferencing and scale.
+ */
+void
+QCT::unloadGeoGrid()
+{
+	FREE_POINTER(grid_latlon);
+	grid_spacing = grid_nx = grid_ny = grid_scale = 0;
+	grid_error = grid_inv_spacing = 0;
+}
+
+
+bool
+QCT::buildGeoGrid(int spacing, double *max_error)
+{
+	double *xx = NULL, *yy = NULL, *la = NULL, *lo = NULL;
+	double err = 0, ilat, ilon;
+	int ii, jj, kk, nx, ny;
+
+	unloadGeoGrid();
+	if (spacing < 1 || qctfp == NULL)
+		return false;
+
+	nx = (getImageWidth() + spacing - 1) / spacing + 1;
+	ny = (getImageHeight() + spacing - 1) / spacing + 1;
+	grid_latlon = (double*)malloc((size_t)nx * ny * 2 * sizeof(double));
+	xx = (double*)malloc(nx * 2 * sizeof(double));
+	yy = (double*)malloc(nx * 2 * sizeof(double));
+	la = (double*)malloc(nx * 2 * sizeof(double));
+	lo = (double*)malloc(nx * 2 * sizeof(double));
+	if (grid_latlon == NULL || xx == NULL || yy == NULL || la == NULL || lo == NULL)
+	{
+		FREE_POINTER(xx); FREE_POINTER(yy); FREE_POINTER(la); FREE_POINTER(lo);
+		unloadGeoGrid();
+		return false;
+	}
+	grid_spacing = spacing;
+	grid_inv_spacing = 1.0 / spacing;
+	grid_nx = nx;
+	grid_ny = ny;
+	grid_scale = scalefactor;
+
+	// Nodes, a row at a time
+	for (jj=0; jj<ny; jj++)
+	{
+		for (ii=0; ii<nx; ii++)
+		{
+			xx[ii] = ii * spacing;
+			yy[ii] = jj * spacing;
+		}
+		pixelsToLatLon(nx, xx, yy, la, lo);
+		for (ii=0; ii<nx; ii++)
+		{
+			grid_latlon[((size_t)jj * nx + ii) * 2] = la[ii];
+			grid_latlon[((size_t)jj * nx + ii) * 2 + 1] = lo[ii];
+		}
+	}
+
+	// Check the middle of each cell and of its top and left edges, which
+	// covers every edge once counting the bottom row's top edges and the
+	// right column's left edges (those along the far sides of the grid)
+	static const double check[3][2] = { {0.5,0.5}, {0.5,0}, {0,0.5} };
+	for (jj=0; jj<ny; jj++)
+	{
+		for (kk=0; kk<3; kk++)
+		{
+			if (jj == ny-1 && check[kk][1] != 0)
+				continue;
+			for (ii=0; ii<nx; ii++)
+			{
+				xx[ii] = (ii + check[kk][0]) * spacing;
+				yy[ii] = (jj + check[kk][1]) * spacing;
+			}
+			pixelsToLatLon(nx, xx, yy, la, lo);
+			for (ii=0; ii<nx; ii++)
+			{
+				if (ii == nx-1 && check[kk][0] != 0)
+					continue;
+				gridToLatLon(xx[ii], yy[ii], &ilat, &ilon);
+				if (fabs(ilat - la[ii]) > err) err = fabs(ilat - la[ii]);
+				if (fabs(ilon - lo[ii]) > err) err = fabs(ilon - lo[ii]);
+			}
+		}
+	}
+	grid_error = err;
+	debugmsg("coordinate grid %dx%d spacing %d, worst error %g degrees", nx, ny, spacing, err);
+	if (max_error)
+		*max_error = err;
+
+	free(xx);
+	free(yy);
+	free(la);
+	free(lo);
+	return true;
+}
+
+
+/*
+ * Latitude and longitude of image pixel (x,y) at the current scale from
+ * the grid, or exactly if there is no grid for this scale.
+ */
+void
+QCT::gridToLatLon(double x, double y, double *latitude, double *longitude) const
+{
+	const double *n00, *n01, *n10, *n11;
+	double fx, fy;
+	int cx, cy;
+
+	if (grid_latlon == NULL || grid_scale != scalefactor)
+	{
+		pixelToLatLon(x * scalefactor, y * scalefactor, latitude, longitude);
+		return;
+	}
+	// Clamp to the outer cells, extrapolating beyond them
+	fx = x * grid_inv_spacing;
+	fy = y * grid_inv_spacing;
+	cx = (fx <= 0) ? 0 : (fx >= grid_nx - 2) ? grid_nx - 2 : (int)fx;
+	cy = (fy <= 0) ? 0 : (fy >= grid_ny - 2) ? grid_ny - 2 : (int)fy;
+	fx -= cx;
+	fy -= cy;
+	n00 = grid_latlon + ((size_t)cy * grid_nx + cx) * 2;
+	n01 = n00 + 2;
+	n10 = n00 + grid_nx * 2;
+	n11 = n10 + 2;
+	double top_lat = n00[0] + fx * (n01[0] - n00[0]), top_lon = n00[1] + fx * (n01[1] - n00[1]);
+	double bot_lat = n10[0] + fx * (n11[0] - n10[0]), bot_lon = n10[1] + fx * (n11[1] - n10[1]);
+	*latitude = top_lat + fy * (bot_lat - top_lat);
+	*longitude = top_lon + fy * (bot_lon - top_lon);
+}
+
+
+// The georeferencing which a saved grid must match
+void
+QCT::gridHeader(unsigned char *header) const
+{
+	const double coeffs[QCT_RAW_COEFFS] =
+	{
+		eas, easY, easX, easYY, easXY, easXX, easYYY, easXYY, easXXY, easXXX,
+		nor, norY, norX, norYY, norXY, norXX, norYYY, norXYY, norXXY, norXXX,
+		lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY,
+		lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY,
+		datum_shift_north, datum_shift_east
+	};
+	unsigned char *pp;
+	int ii;
+
+	memset(header, 0, QCT_GRID_HEADER_SIZE);
+	memcpy(header, QCT_GRID_MAGIC, 8);
+	putLong(header+8,  QCT_GRID_VERSION);
+	putLong(header+12, grid_scale);
+	putLong(header+16, grid_spacing);
+	putLong(header+20, grid_nx);
+	putLong(header+24, grid_ny);
+	putDouble(header+32, grid_error);
+	pp = header + 40;
+	for (ii=0; ii<QCT_RAW_COEFFS; ii++, pp+=8)
+		putDouble(pp, coeffs[ii]);
+}
+
+
+bool
+QCT::writeGeoGridFile(FILE *fp)
+{
+	unsigned char header[QCT_GRID_HEADER_SIZE];
+	unsigned char *row;
+	int ii, jj;
+
+	if (grid_latlon == NULL)
+		return false;
+	row = (unsigned char*)malloc(grid_nx * 16);
+	if (row == NULL)
+		return false;
+
+	gridHeader(header);
+	fwrite(header, sizeof(header), 1, fp);
+	for (jj=0; jj<grid_ny; jj++)
+	{
+		for (ii=0; ii<grid_nx*2; ii++)
+			putDouble(row + ii*8, grid_latlon[(size_t)jj * grid_nx * 2 + ii]);
+		if (fwrite(row, grid_nx * 16, 1, fp) != 1)
+			break;
+	}
+	free(row);
+	return !ferror(fp);
+}
+
+
+bool
+QCT::writeGeoGridFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = writeGeoGridFile(fp);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+/*
+ * Load a grid saved by writeGeoGridFile.  Fails (leaving no grid) if it
+ * was made for a different chart or scale.
+ */
+bool
+QCT::readGeoGridFile(FILE *fp)
+{
+	unsigned char header[QCT_GRID_HEADER_SIZE], expect[QCT_GRID_HEADER_SIZE];
+	int version, scale, spacing, nx, ny;
+	size_t ii, count;
+
+	unloadGeoGrid();
+	if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, QCT_GRID_MAGIC, 8))
+	{
+		throwError("not a coordinate grid file");
+		return false;
+	}
+	version = getLong(header+8);
+	scale   = getLong(header+12);
+	spacing = getLong(header+16);
+	nx      = getLong(header+20);
+	ny      = getLong(header+24);
+	if (version != QCT_GRID_VERSION || spacing < 1)
+	{
+		throwError("unsupported coordinate grid version %d", version);
+		return false;
+	}
+
+	// Same georeferencing, scale and size as a grid built now
+	grid_scale = scale;
+	grid_spacing = spacing;
+	grid_inv_spacing = 1.0 / spacing;
+	grid_nx = nx;
+	grid_ny = ny;
+	grid_error = getDouble(header+32);
+	gridHeader(expect);
+	if (scale != scalefactor || memcmp(header+40, expect+40, QCT_RAW_COEFFS*8) ||
+		nx != (getImageWidth() + spacing - 1) / spacing + 1 ||
+		ny != (getImageHeight() + spacing - 1) / spacing + 1)
+	{
+		unloadGeoGrid();
+		throwError("coordinate grid does not match this chart");
+		return false;
+	}
+
+	count = (size_t)nx * ny * 2;
+	grid_latlon = (double*)malloc(count * sizeof(double));
+	if (grid_latlon == NULL)
+	{
+		unloadGeoGrid();
+		return false;
+	}
+	if (fread(grid_latlon, sizeof(double), count, fp) != count)
+	{
+		unloadGeoGrid();
+		throwError("coordinate grid file is truncated");
+		return false;
+	}
+	// Stored little-endian, convert in place
+	for (ii=0; ii<count; ii++)
+		grid_latlon[ii] = getDouble((unsigned char*)(grid_latlon + ii));
+	return true;
+}
+
+
+bool
+QCT::readGeoGridFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = readGeoGridFile(fp);
+	fclose(fp);
+	return(truth);
+}
+
+
+
+/* -------------------------------------------------------------------------
+ * Point sampling.
+ * The colour at many positions (eg. along a route) without decoding the
+ * whole chart: the positions are converted in one batch, sorted by the
+ * tile they fall in, and each tile touched is decoded once, so the cost
+ * depends on the number of points and tiles, not on the size of the chart.
+ * Tiles come from the tile cache if it is in use (see getTile) otherwise
+ * they are decoded into a scratch buffer and not kept.  If the image is
+ * loaded at full resolution the pixels are taken from it instead.
+ */
+
+static int
+compareSampleKeys(const void *a, const void *b)
+{
+	unsigned long long ka = *(const unsigned long long*)a, kb = *(const unsigned long long*)b;
+	return (ka < kb) ? -1 : (ka > kb);
+}
+
+
+/*
+ * Look up count positions in degrees WGS84.  index[i] is the palette index
+ * of the pixel at point i and rgb[i] (if rgb isn't NULL) its output colour.
+ * Points off the image, or outside the outline when the outline mask is
+ * set, get QCT_TRANSPARENT_INDEX, an rgb of -1 and inside[i] (if inside
+ * isn't NULL) false.  Returns the number of points on the chart.
+ */
+int
+QCT::samplePoints(int count, const double *latitude, const double *longitude,
+	unsigned char *index, int *rgb, bool *inside)
+{
+	int full_width = width * QCT_TILE_SIZE, full_height = height * QCT_TILE_SIZE;
+	unsigned long long *keys = NULL;
+	double *px = NULL, *py = NULL;
+	unsigned char *scratch = NULL;
+	const unsigned char *tile = NULL;
+	int ii, jj, num_keys = 0, num = 0, tile_num = -1, tile_xx, tile_yy, xx, yy;
+	GeoBatch gb;
+
+	for (ii=0; ii<count; ii++)
+	{
+		index[ii] = QCT_TRANSPARENT_INDEX;
+		if (rgb) rgb[ii] = -1;
+		if (inside) inside[ii] = false;
+	}
+	if (count <= 0 || ((qctfp == NULL || metadata.image_index == NULL) && (image_data == NULL || scalefactor != 1)))
+		return 0;
+
+	px = (double*)malloc(count * sizeof(double));
+	py = (double*)malloc(count * sizeof(double));
+	keys = (unsigned long long*)malloc(count * sizeof(unsigned long long));
+	if (px == NULL || py == NULL || keys == NULL)
+		goto done;
+
+	// Full resolution pixels (latLonToPixels is at the current scale)
+	setCubic(gb.c1, eas, easX, easY, easXX, easXY, easYY, easXXX, easXXY, easXYY, easYYY);
+	setCubic(gb.c2, nor, norX, norY, norXX, norXY, norYY, norXXX, norXXY, norXYY, norYYY);
+	gb.in_mul = 1;
+	gb.in_add_x = -datum_shift_east;
+	gb.in_add_y = -datum_shift_north;
+	gb.out_mul = 1;
+	gb.out_add1 = gb.out_add2 = 0;
+	gb.in_x = longitude;
+	gb.in_y = latitude;
+	gb.out1 = px;
+	gb.out2 = py;
+	gb.count = count;
+	parallelFor((count + GEO_BATCH - 1) / GEO_BATCH, nthreads, geoBatchJob, &gb);
+
+	// Sort the points on the chart by tile, then by their order
+	for (ii=0; ii<count; ii++)
+	{
+		if (!(px[ii] >= 0 && px[ii] < full_width && py[ii] >= 0 && py[ii] < full_height))
+			continue;
+		xx = (int)px[ii];
+		yy = (int)py[ii];
+		if (outline_mask && outline_tiles)
+		{
+			int cls = outline_tiles[(yy / QCT_TILE_SIZE) * width + xx / QCT_TILE_SIZE];
+			if (cls == OUTLINE_TILE_OUTSIDE || (cls == OUTLINE_TILE_CROSSING && !insideOutline(xx, yy)))
+				continue;
+		}
+		keys[num_keys++] = ((unsigned long long)((yy / QCT_TILE_SIZE) * width + xx / QCT_TILE_SIZE) << 32) | ii;
+	}
+	qsort(keys, num_keys, sizeof(unsigned long long), compareSampleKeys);
+
+	for (jj=0; jj<num_keys; jj++)
+	{
+		ii = (int)(keys[jj] & 0xffffffff);
+		xx = (int)px[ii];
+		yy = (int)py[ii];
+		if (image_data && scalefactor == 1)
+		{
+			index[ii] = image_data[yy * full_width + xx];
+		}
+		else
+		{
+			if ((int)(keys[jj] >> 32) != tile_num)
+			{
+				tile_num = (int)(keys[jj] >> 32);
+				tile_xx = tile_num % width;
+				tile_yy = tile_num / width;
+				if (tile_cache)
+				{
+					tile = getTile(tile_xx, tile_yy);
+				}
+				else
+				{
+					if (scratch == NULL && (scratch = (unsigned char*)malloc(QCT_TILE_PIXELS)) == NULL)
+						goto done;
+					decodeTile(tile_xx, tile_yy, scratch);
+#ifdef USE_PTHREADS
+					if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+					drawOverlay(scratch, QCT_TILE_SIZE, tile_xx, tile_yy, 1);
+#ifdef USE_PTHREADS
+					if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+					tile = scratch;
+				}
+			}
+			if (tile == NULL)
+				continue;
+			index[ii] = tile[(yy % QCT_TILE_SIZE) * QCT_TILE_SIZE + xx % QCT_TILE_SIZE];
+		}
+		if (rgb) rgb[ii] = out_palette[index[ii]];
+		if (inside) inside[ii] = true;
+		num++;
+	}
+
+done:
+	FREE_POINTER(px);
+	FREE_POINTER(py);
+	FREE_POINTER(keys);
+	FREE_POINTER(scratch);
+	return num;
+}
+
+/*
+ * Find the range of latitude and longitude covered by the image by
+ * following all four edges (which need not be straight lines).
+ */
+void
+QCT::getLatLonExtent(double *lat_min, double *lon_min, double *lat_max, double *lon_max) const
+{
+	int full_width = width * QCT_TILE_SIZE, full_height = height * QCT_TILE_SIZE;
+	int ii, side, steps = 64;
+	double xx, yy, la, lo;
+
+	*lat_min = *lon_min = 1e9;
+	*lat_max = *lon_max = -1e9;
+	for (side=0; side<4; side++)
+	{
+		for (ii=0; ii<=steps; ii++)
+		{
+			double ff = (double)ii / steps;
+			switch (side)
+			{
+				case 0: xx = ff * full_width; yy = 0; break;
+				case 1: xx = ff * full_width; yy = full_height; break;
+				case 2: xx = 0; yy = ff * full_height; break;
+				default: xx = full_width; yy = ff * full_height; break;
+			}
+			pixelToLatLon(xx, yy, &la, &lo);
+			if (la < *lat_min) *lat_min = la;
+			if (la > *lat_max) *lat_max = la;
+			if (lo < *lon_min) *lon_min = lo;
+			if (lo > *lon_max) *lon_max = lo;
+		}
+	}
+}
+
+
+double
+QCT::getDegreesPerPixel() const
+{
+	if (width<1 || height<1)
+		return 0;
+	int y = height/2;
+	int w = (width * QCT_TILE_SIZE / scalefactor);
+	double lat0,lon0, lat1,lon1;
+	// Find the longitude of the left edge and right edge
+	// mid-way up the image and divide long range by width in pixels
+	xy_to_latlon(0, y, &lat0, &lon0);
+	xy_to_latlon(w-1, y, &lat1, &lon1);
+	double dpp = (double)fabs(lon1 - lon0) / (double)(w);
+	return (fabs(lon1 - lon0) / (w));
+}
+
+
+/* -------------------------------------------------------------------------
+ * Encode a paletted image as PNG into a memory buffer.
+ * If transparent is true then QCT_TRANSPARENT_INDEX is made transparent.
+ */
+#ifdef USE_PNG
+struct PNGBuffer
+{
+	unsigned char *data;
+	size_t len, size;
+};
+
+static void
+pngWriteBuffer(png_structp png_ptr, png_bytep data, png_size_t len)
+{
+	PNGBuffer *buf = (PNGBuffer*)png_get_io_ptr(png_ptr);
+
+	if (buf->len + len > buf->size)
+	{
+		size_t size = (buf->size ? buf->size * 2 : 16384);
+		unsigned char *data;
+		while (size < buf->len + len)
+			size *= 2;
+		data = (unsigned char*)realloc(buf->data, size);
+		if (data == NULL)
+			png_error(png_ptr, "out of memory");
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+pngFlushBuffer(png_structp)
+{
+}
+
+static bool
+encodePNG(const unsigned char *pixels, int w, int h, const int *palette, bool transparent, PNGBuffer *buf)
+{
+	png_color pal[256];
+	png_byte trans[256];
+	int ii;
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+	if (!png_ptr)
+		return false;
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+	{
+		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+		return false;
+	}
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return false;
+	}
+
+	buf->len = 0;
+	png_set_write_fn(png_ptr, buf, pngWriteBuffer, pngFlushBuffer);
+	png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_PALETTE,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	for (ii=0; ii<256; ii++)
+	{
+		pal[ii].red   = PAL_RED(palette[ii]);
+		pal[ii].green = PAL_GREEN(palette[ii]);
+		pal[ii].blue  = PAL_BLUE(palette[ii]);
+		trans[ii] = (ii == QCT_TRANSPARENT_INDEX) ? 0 : 255;
+	}
+	png_set_PLTE(png_ptr, info_ptr, pal, 256);
+	if (transparent)
+		png_set_tRNS(png_ptr, info_ptr, trans, QCT_TRANSPARENT_INDEX+1, NULL);
+	png_write_info(png_ptr, info_ptr);
+	for (ii=0; ii<h; ii++)
+		png_write_row(png_ptr, (png_bytep)(pixels + ii * w));
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	return true;
+}
+#endif
+
+
+/* -------------------------------------------------------------------------
+ * Web Mercator (EPSG:3857) tile pyramid export.
+ * Writes directory/z/x/y.png, 256x256 pixel paletted PNG tiles in the
+ * usual "slippy map" numbering, for each zoom level from min_zoom to
+ * max_zoom.  Each output tile is reprojected with warpMercator from the
+ * nearest chart pixels, only the QCT tiles needed are decoded (see getTile),
+ * and the output tiles are rendered in parallel.  Pixels outside the chart
+ * are transparent and tiles with no chart pixels at all are not written.
+ */
+#define XYZ_TILE_SIZE  256
+#define MERCATOR_MAX_LAT  85.0511287798
+
+static int
+mercatorLonToTile(double lon, int zoom)
+{
+	int tt = (int)floor((lon + 180.0) / 360.0 * (1 << zoom));
+	return (tt < 0) ? 0 : (tt >= (1 << zoom)) ? (1 << zoom) - 1 : tt;
+}
+
+static int
+mercatorLatToTile(double lat, int zoom)
+{
+	double rad;
+	int tt;
+	if (lat > MERCATOR_MAX_LAT) lat = MERCATOR_MAX_LAT;
+	if (lat < -MERCATOR_MAX_LAT) lat = -MERCATOR_MAX_LAT;
+	rad = lat * M_PI / 180.0;
+	tt = (int)floor((1.0 - log(tan(rad) + 1.0 / cos(rad)) / M_PI) / 2.0 * (1 << zoom));
+	return (tt < 0) ? 0 : (tt >= (1 << zoom)) ? (1 << zoom) - 1 : tt;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Reprojection of the chart into Web Mercator (EPSG:3857).
+ * Evaluating the georeferencing polynomial for every output pixel is slow
+ * so it is only evaluated exactly on a grid (every WARP_GRID pixels) and
+ * bilinearly interpolated in between.  Before a grid cell is interpolated
+ * the exact transform is also evaluated at the middle of the cell and of
+ * each of its edges; if any differs from the interpolated position by more
+ * than max_error source pixels the cell is split into four and each part
+ * checked again.  Output is processed in parallel blocks.
+ * Pixels are sampled from the nearest source pixel or, if interpolate is
+ * true, blended with neighbouring pixels using the palette interpolation
+ * matrix (useful when reducing).  Pixels outside the chart (or outside
+ * its outline if the outline mask is enabled) are set to
+ * QCT_TRANSPARENT_INDEX.
+ */
+#define MERCATOR_RADIUS  6378137.0
+#define MERCATOR_EXTENT  (M_PI * MERCATOR_RADIUS)
+#define WARP_GRID        16
+#define WARP_BLOCK       64
+
+// Output window and results shared by the warp threads
+struct WarpJob
+{
+	const QCT *qct;
+	bool latlon;               // window in degrees rather than mercator
+	double x_min, y_max;       // top left corner, mercator metres or lon,lat
+	double x_res, y_res;       // metres (or degrees) per output pixel
+	int out_width, out_height;
+	unsigned char *out;
+	bool interpolate;
+	double max_error;
+	int blocks_across;
+	int *counts;               // chart pixels in each block
+	int level;                 // view level, -1 for full resolution tiles
+	double deadline;           // see renderView
+};
+
+// A grid point: output pixel and the source pixel it maps to
+struct WarpPoint
+{
+	double sx, sy;
+};
+
+// The last tile used, so getTile isn't called for every pixel
+struct WarpSampler
+{
+	int tile_xx, tile_yy;
+	const unsigned char *tile;
+	int tile_level;            // resolution of tile, 1/2^tile_level
+	int level;                 // as in WarpJob
+	double deadline;
+};
+
+
+/*
+ * Exact transform from the centre of output pixel (ii,jj) to source pixel.
+ */
+void
+QCT::warpTransform(const WarpJob *job, double ii, double jj, double *sx, double *sy) const
+{
+	double mx = job->x_min + (ii + 0.5) * job->x_res;
+	double my = job->y_max - (jj + 0.5) * job->y_res;
+	if (job->latlon)
+	{
+		latlonToPixel(my, mx, sx, sy);
+		return;
+	}
+	double lon = mx / MERCATOR_RADIUS * 180.0 / M_PI;
+	double lat = atan(sinh(my / MERCATOR_RADIUS)) * 180.0 / M_PI;
+	latlonToPixel(lat, lon, sx, sy);
+}
+
+
+/*
+ * Pixel at full resolution source position, or QCT_TRANSPARENT_INDEX.
+ */
+int
+QCT::warpPixel(WarpSampler *sampler, int px, int py)
+{
+	int tile_xx, tile_yy;
+
+	if (px < 0 || py < 0 || px >= width * QCT_TILE_SIZE || py >= height * QCT_TILE_SIZE)
+		return QCT_TRANSPARENT_INDEX;
+	tile_xx = px / QCT_TILE_SIZE;
+	tile_yy = py / QCT_TILE_SIZE;
+	if (outline_mask && outline_tiles)
+	{
+		int cls = outline_tiles[tile_yy*width+tile_xx];
+		if (cls == OUTLINE_TILE_OUTSIDE || (cls == OUTLINE_TILE_CROSSING && !insideOutline(px, py)))
+			return QCT_TRANSPARENT_INDEX;
+	}
+	if (sampler->tile == NULL || tile_xx != sampler->tile_xx || tile_yy != sampler->tile_yy)
+	{
+		if (sampler->level < 0)
+		{
+			sampler->tile = getTile(tile_xx, tile_yy);
+			sampler->tile_level = 0;
+		}
+		else
+			sampler->tile = getViewTile(sampler, tile_xx, tile_yy);
+		sampler->tile_xx = tile_xx;
+		sampler->tile_yy = tile_yy;
+		if (sampler->tile == NULL)
+			return QCT_TRANSPARENT_INDEX;
+	}
+	return sampler->tile[((py % QCT_TILE_SIZE) >> sampler->tile_level) * (QCT_TILE_SIZE >> sampler->tile_level) +
+		((px % QCT_TILE_SIZE) >> sampler->tile_level)];
+}
+
+
+/*
+ * Sample the source at (sx,sy).  When interpolating, a neighbouring pixel
+ * in each direction is blended in if the position is near the boundary
+ * between them, otherwise the nearest pixel is used.
+ */
+int
+QCT::warpSample(WarpSampler *sampler, double sx, double sy, bool interpolate)
+{
+	int px = (int)floor(sx), py = (int)floor(sy);
+	int pix, other;
+	double fx, fy;
+
+	int step = (sampler->level > 0) ? 1 << sampler->level : 1;
+
+	pix = warpPixel(sampler, px, py);
+	if (!interpolate || pix >= 128)
+		return pix;
+
+	// Neighbours are one pixel away at the level being sampled
+	fx = sx / step - px / step;
+	fy = sy / step - py / step;
+	if (fx < 0.25 || fx > 0.75)
+	{
+		other = warpPixel(sampler, fx < 0.25 ? px-step : px+step, py);
+		if (other < 128)
+			pix = out_interp[pix][other];
+	}
+	if (fy < 0.25 || fy > 0.75)
+	{
+		other = warpPixel(sampler, px, fy < 0.25 ? py-step : py+step);
+		if (other < 128)
+			pix = out_interp[pix][other];
+	}
+	return pix;
+}
+
+
+/*
+ * Fill output pixels i0..i1-1, j0..j1-1 given the source positions of the
+ * grid points at the corners (i0,j0) (i1,j0) (i0,j1) (i1,j1), splitting
+ * the cell if interpolation isn't accurate enough.
+ * Returns the number of pixels which came from the chart.
+ */
+int
+QCT::warpCell(const WarpJob *job, WarpSampler *sampler, int i0, int j0, int i1, int j1, const WarpPoint *corner)
+{
+	static const double check[5][2] = { {0.5,0.5}, {0.5,0}, {0.5,1}, {0,0.5}, {1,0.5} };
+	double sx, sy, ex, ey, tx, ty;
+	double lx, ly, rx, ry;
+	int ii, jj, kk, pix, count = 0;
+	unsigned char *out;
+
+	// Check the interpolation at the middle of the cell and its edges
+	if (i1 - i0 > 1 || j1 - j0 > 1)
+	{
+		for (kk=0; kk<5; kk++)
+		{
+			tx = check[kk][0];
+			ty = check[kk][1];
+			ex = (1-ty) * ((1-tx) * corner[0].sx + tx * corner[1].sx) + ty * ((1-tx) * corner[2].sx + tx * corner[3].sx);
+			ey = (1-ty) * ((1-tx) * corner[0].sy + tx * corner[1].sy) + ty * ((1-tx) * corner[2].sy + tx * corner[3].sy);
+			warpTransform(job, i0 + tx * (i1-i0), j0 + ty * (j1-j0), &sx, &sy);
+			if (fabs(sx - ex) > job->max_error || fabs(sy - ey) > job->max_error)
+				break;
+		}
+		if (kk < 5)
+		{
+			// Split into four (or two if one pixel wide or high)
+			int im = (i1 - i0 > 1) ? (i0 + i1) / 2 : i1;
+			int jm = (j1 - j0 > 1) ? (j0 + j1) / 2 : j1;
+			int is[3] = { i0, im, i1 }, js[3] = { j0, jm, j1 };
+			WarpPoint grid[3][3];
+			int gi, gj;
+			for (gj=0; gj<3; gj++)
+				for (gi=0; gi<3; gi++)
+				{
+					if ((gi == 1 && im == i1) || (gj == 1 && jm == j1))
+						continue;
+					if (gi != 1 && gj != 1)
+						grid[gj][gi] = corner[(gj ? 2 : 0) + (gi ? 1 : 0)];
+					else
+						warpTransform(job, is[gi], js[gj], &grid[gj][gi].sx, &grid[gj][gi].sy);
+				}
+			for (gj=0; gj<2; gj++)
+			{
+				if (js[gj] == js[gj+1]) continue;
+				for (gi=0; gi<2; gi++)
+				{
+					WarpPoint sub[4];
+					int ga = gi, gb = (im == i1) ? 2 : gi+1;
+					int ha = gj, hb = (jm == j1) ? 2 : gj+1;
+					if (is[gi] == is[gi+1]) continue;
+					sub[0] = grid[ha][ga];
+					sub[1] = grid[ha][gb];
+					sub[2] = grid[hb][ga];
+					sub[3] = grid[hb][gb];
+					count += warpCell(job, sampler, is[gi], js[gj], is[gi+1], js[gj+1], sub);
+				}
+			}
+			return count;
+		}
+	}
+
+	// Interpolate down the left and right edges then along each row
+	for (jj=j0; jj<j1 && jj<job->out_height; jj++)
+	{
+		ty = (double)(jj - j0) / (j1 - j0);
+		lx = corner[0].sx + ty * (corner[2].sx - corner[0].sx);
+		ly = corner[0].sy + ty * (corner[2].sy - corner[0].sy);
+		rx = corner[1].sx + ty * (corner[3].sx - corner[1].sx);
+		ry = corner[1].sy + ty * (corner[3].sy - corner[1].sy);
+		out = job->out + (size_t)jj * job->out_width + i0;
+		for (ii=i0; ii<i1 && ii<job->out_width; ii++)
+		{
+			tx = (double)(ii - i0) / (i1 - i0);
+			pix = warpSample(sampler, lx + tx * (rx - lx), ly + tx * (ry - ly), job->interpolate);
+			*out++ = pix;
+			if (pix != QCT_TRANSPARENT_INDEX)
+				count++;
+		}
+	}
+	return count;
+}
+
+
+/*
+ * Warp one WARP_BLOCK square of the output, starting with a WARP_GRID grid.
+ */
+void
+QCT::warpJob(void *arg, int block)
+{
+	WarpJob *job = (WarpJob*)arg;
+	QCT *qct = (QCT*)job->qct;
+	int bi = (block % job->blocks_across) * WARP_BLOCK;
+	int bj = (block / job->blocks_across) * WARP_BLOCK;
+	int i0, j0, i1, j1;
+	WarpSampler sampler = { -1, -1, NULL, 0, job->level, job->deadline };
+	WarpPoint corner[4];
+
+	job->counts[block] = 0;
+	for (j0=bj; j0<bj+WARP_BLOCK && j0<job->out_height; j0+=WARP_GRID)
+	{
+		j1 = j0 + WARP_GRID;
+		for (i0=bi; i0<bi+WARP_BLOCK && i0<job->out_width; i0+=WARP_GRID)
+		{
+			i1 = i0 + WARP_GRID;
+			qct->warpTransform(job, i0, j0, &corner[0].sx, &corner[0].sy);
+			qct->warpTransform(job, i1, j0, &corner[1].sx, &corner[1].sy);
+			qct->warpTransform(job, i0, j1, &corner[2].sx, &corner[2].sy);
+			qct->warpTransform(job, i1, j1, &corner[3].sx, &corner[3].sy);
+			job->counts[block] += qct->warpCell(job, &sampler, i0, j0, i1, j1, corner);
+		}
+	}
+}
+
+
+/*
+ * Reproject the chart into out (out_width x out_height palette indexes)
+ * covering the given Web Mercator (EPSG:3857) rectangle in metres.
+ * max_error is the largest allowed difference, in source pixels, between
+ * the interpolated and exact transform.
+ * Returns the number of output pixels which came from the chart.
+ */
+int
+QCT::warpMercator(double x_min, double y_min, double x_max, double y_max,
+	int out_width, int out_height, unsigned char *out, bool interpolate, double max_error)
+{
+	return warp(x_min, y_min, x_max, y_max, out_width, out_height, out, interpolate, max_error, nthreads);
+}
+
+
+int
+QCT::warp(double x_min, double y_min, double x_max, double y_max,
+	int out_width, int out_height, unsigned char *out, bool interpolate, double max_error, int threads,
+	bool latlon, int level, double deadline)
+{
+	WarpJob job;
+	int ii, num_blocks, count = 0;
+
+	if (out_width < 1 || out_height < 1 || qctfp == NULL)
+		return 0;
+
+	job.qct = this;
+	job.latlon = latlon;
+	job.level = level;
+	job.deadline = deadline;
+	job.x_min = x_min;
+	job.y_max = y_max;
+	job.x_res = (x_max - x_min) / out_width;
+	job.y_res = (y_max - y_min) / out_height;
+	job.out_width = out_width;
+	job.out_height = out_height;
+	job.out = out;
+	job.interpolate = interpolate;
+	job.max_error = (max_error > 0) ? max_error : 0.125;
+	job.blocks_across = (out_width + WARP_BLOCK - 1) / WARP_BLOCK;
+	num_blocks = job.blocks_across * ((out_height + WARP_BLOCK - 1) / WARP_BLOCK);
+	job.counts = (int*)calloc(num_blocks, sizeof(int));
+	if (job.counts == NULL)
+		return 0;
+
+	parallelFor(num_blocks, threads, warpJob, &job);
+
+	for (ii=0; ii<num_blocks; ii++)
+		count += job.counts[ii];
+	free(job.counts);
+	return count;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Viewport rendering.
+ * For an interactive viewer every frame is a warp of a latitude,longitude
+ * rectangle from tiles held at the coarsest resolution that is still at
+ * least as fine as the output (1/2^level, chosen with getDegreesPerPixel).
+ * A tile is always decoded at full resolution, which costs the same as a
+ * reduced one, and reduced for its level and every coarser level still
+ * missing it, so zooming out never needs decoding again.  Decoding stops
+ * at the frame's deadline; tiles not ready are drawn from a coarser level
+ * if there is one (or left transparent) and counted so the caller can
+ * render again next frame.  Tiles not used in the latest frame are freed
+ * when the cache grows past its size, except at the coarsest level.
+ */
+
+// Milliseconds on a clock which never goes backwards
+static double
+viewClock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/*
+ * Reduce a full resolution tile by 2^level as readTile does for a scale:
+ * every 2^level-th row, blending the pixels along it.  The view is in
+ * output palette indexes so the blend table is out_interp, as the warp
+ * and the TIFF levels use, rather than the chart's pal_interp.
+ */
+static void
+reduceTile(const unsigned char interp[128][128], const unsigned char *tile, int level, unsigned char *out)
+{
+	int factor = 1 << level, size = QCT_TILE_SIZE >> level;
+	int xx, yy, nn;
+	const unsigned char *src;
+	unsigned char pix;
+
+	for (yy=0; yy<size; yy++)
+	{
+		src = tile + yy * factor * QCT_TILE_SIZE;
+		for (xx=0; xx<size; xx++)
+		{
+			pix = *src++;
+			for (nn=1; nn<factor; nn++, src++)
+				pix = (pix < 128 && *src < 128) ? interp[pix][*src] : pix;
+			*out++ = pix;
+		}
+	}
+}
+
+
+/*
+ * The tile for the sampler's level, decoding it if there is time, or else
+ * the same tile at a coarser level.  Sets sampler->tile_level.
+ * The tile is decoded and reduced without tile_mutex, its slot at the
+ * sampler's level claimed meanwhile; the overlay is drawn at each level
+ * as the tiles are stored.
+ */
+const unsigned char *
+QCT::getViewTile(WarpSampler *sampler, int tile_xx, int tile_yy)
+{
+	unsigned char full[QCT_TILE_PIXELS];
+	unsigned char *made[QCT_VIEW_LEVELS];
+	const unsigned char *tile;
+	int tile_num = tile_yy * width + tile_xx;
+	int lv, level = sampler->level;
+
+	if (qctfp == NULL || metadata.image_index == NULL)
+		return NULL;
+
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+	for (lv=level; lv<QCT_VIEW_LEVELS; lv++)
+	{
+		if (view_tiles[lv] == NULL)
+		{
+			view_tiles[lv] = (unsigned char**)calloc(width * height, sizeof(unsigned char*));
+			view_used[lv] = (unsigned int*)calloc(width * height, sizeof(unsigned int));
+		}
+	}
+	if (view_tiles[level])
+		waitForTile(&view_tiles[level][tile_num]);
+	tile = view_tiles[level] ? view_tiles[level][tile_num] : NULL;
+	sampler->tile_level = level;
+
+	if (tile == NULL && view_tiles[level] && (sampler->deadline <= 0 || viewClock() < sampler->deadline))
+	{
+		// Every level still missing it is made at once
+		for (lv=level; lv<QCT_VIEW_LEVELS; lv++)
+			made[lv] = (view_tiles[lv] && view_tiles[lv][tile_num] == NULL) ? full : NULL;
+		view_tiles[level][tile_num] = TILE_LOADING;
+#ifdef USE_PTHREADS
+		if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+		decodeTile(tile_xx, tile_yy, full);
+		for (lv=level; lv<QCT_VIEW_LEVELS; lv++)
+		{
+			if (made[lv] == NULL)
+				continue;
+			made[lv] = (unsigned char*)malloc(QCT_TILE_PIXELS >> (2 * lv));
+			if (made[lv] == NULL)
+				continue;
+			// Blended as the warp blends, to match the output palette
+			if (lv == 0)
+				memcpy(made[lv], full, QCT_TILE_PIXELS);
+			else
+				reduceTile(out_interp, full, lv, made[lv]);
+		}
+#ifdef USE_PTHREADS
+		if (tile_mutex) pthread_mutex_lock((pthread_mutex_t*)tile_mutex);
+#endif
+		for (lv=level; lv<QCT_VIEW_LEVELS; lv++)
+		{
+			if (made[lv] == NULL)
+				continue;
+			// Another thread may have made a coarser level meanwhile
+			if (lv > level && view_tiles[lv][tile_num])
+			{
+				free(made[lv]);
+				continue;
+			}
+			drawOverlay(made[lv], QCT_TILE_SIZE >> lv, tile_xx, tile_yy, 1 << lv);
+			view_tiles[lv][tile_num] = made[lv];
+			view_bytes += QCT_TILE_PIXELS >> (2 * lv);
+		}
+		if (view_tiles[level][tile_num] == TILE_LOADING)
+			view_tiles[level][tile_num] = NULL;
+#ifdef USE_PTHREADS
+		if (tile_cond) pthread_cond_broadcast((pthread_cond_t*)tile_cond);
+#endif
+		tile = view_tiles[level][tile_num];
+	}
+	else if (tile == NULL)
+	{
+		// Out of time, count it once and use the next coarsest there is
+		if (view_used[level] && view_used[level][tile_num] != view_frame)
+			view_missing++;
+		for (lv=level+1; lv<QCT_VIEW_LEVELS && tile == NULL; lv++)
+		{
+			if (view_tiles[lv] && view_tiles[lv][tile_num] && view_tiles[lv][tile_num] != TILE_LOADING)
+			{
+				tile = view_tiles[lv][tile_num];
+				sampler->tile_level = lv;
+			}
+		}
+	}
+	if (view_used[level])
+		view_used[level][tile_num] = view_frame;
+	if (view_used[sampler->tile_level])
+		view_used[sampler->tile_level][tile_num] = view_frame;
+#ifdef USE_PTHREADS
+	if (tile_mutex) pthread_mutex_unlock((pthread_mutex_t*)tile_mutex);
+#endif
+	return tile;
+}
+
+
+/*
+ * Render the rectangle from lat_min,lon_min to lat_max,lon_max (degrees
+ * WGS84, north up, equal steps of latitude and longitude) into out,
+ * out_width x out_height palette indexes (see getOutputPalette) with
+ * QCT_TRANSPARENT_INDEX off the chart.  With a budget_ms of 0 every tile
+ * needed is decoded.  Returns the number of tiles that were not ready.
+ */
+int
+QCT::renderView(double lat_min, double lon_min, double lat_max, double lon_max,
+	int out_width, int out_height, unsigned char *out, double budget_ms)
+{
+	double chart_dpp, out_dpp, deadline = 0;
+	int ii, lv, level = 0, coarsest = QCT_VIEW_LEVELS - 1;
+
+	if (qctfp == NULL || out_width < 1 || out_height < 1 || !(lon_min < lon_max && lat_min < lat_max))
+		return -1;
+	if (budget_ms > 0)
+		deadline = viewClock() + budget_ms;
+
+	// Coarsest level with pixels no bigger than the output pixels
+	chart_dpp = getDegreesPerPixel() / scalefactor;
+	out_dpp = (lon_max - lon_min) / out_width;
+	while (level < coarsest && chart_dpp * (2 << level) <= out_dpp)
+		level++;
+
+	view_frame++;
+	view_missing = 0;
+	warp(lon_min, lat_min, lon_max, lat_max, out_width, out_height, out,
+		false, 0.125 * (1 << level), nthreads, true, level, deadline);
+	debugmsg("View level %d, %d tiles not ready, %u bytes cached", level, view_missing, (unsigned int)view_bytes);
+
+	// Free what is off screen if the cache is too big
+	if (view_bytes > view_limit)
+	{
+		for (lv=0; lv<coarsest; lv++)
+		{
+			if (view_tiles[lv] == NULL)
+				continue;
+			for (ii=0; ii<width*height; ii++)
+			{
+				if (view_tiles[lv][ii] && view_used[lv][ii] != view_frame)
+				{
+					FREE_POINTER(view_tiles[lv][ii]);
+					view_bytes -= QCT_TILE_PIXELS >> (2 * lv);
+				}
+			}
+		}
+	}
+	return view_missing;
+}
+
+
+/*
+ * Render one output tile into pixels (XYZ_TILE_SIZE square).
+ * Returns the number of pixels which came from the chart.
+ * The tiles are already being rendered in parallel so each is warped
+ * in a single thread.
+ */
+int
+QCT::renderMercatorTile(int zoom, int tile_xx, int tile_yy, unsigned char *pixels)
+{
+	double tile_size = 2.0 * MERCATOR_EXTENT / (double)(1 << zoom);
+	double x_min = -MERCATOR_EXTENT + tile_xx * tile_size;
+	double y_max = MERCATOR_EXTENT - tile_yy * tile_size;
+
+	return warp(x_min, y_max - tile_size, x_min + tile_size, y_max,
+		XYZ_TILE_SIZE, XYZ_TILE_SIZE, pixels, false, 0.125, 1);
+}
+
+
+/*
+ * Return true if a tile already exported has the given pixels, so tiles
+ * are never taken to be the same by hash alone.  Its pixels are compared
+ * from kept if it isn't NULL, otherwise it is rendered again into scratch.
+ */
+bool
+QCT::sameMercatorTile(int zoom, int tile_xx, int tile_yy, const unsigned char *kept, const unsigned char *pixels, unsigned char *scratch)
+{
+	if (kept == NULL)
+	{
+		renderMercatorTile(zoom, tile_xx, tile_yy, scratch);
+		kept = scratch;
+	}
+	return (memcmp(kept, pixels, XYZ_TILE_SIZE * XYZ_TILE_SIZE) == 0);
+}
+
+
+/*
+ * Output tiles which are identical (open sea, land, outside the chart) are
+ * only encoded and stored once.  Each rendered tile is looked up by a
+ * 128-bit hash of its pixels (two independent 64-bit hashes).  A later
+ * tile with the same hash is compared with the first one and if they
+ * match it reuses the first one's PNG: a hard link to its file, or its
+ * offset in an archive.  The first one is rendered again for the first
+ * match and its pixels kept after that, so only repeated tiles are held.
+ */
+struct ExportedTile
+{
+	unsigned long long hash1, hash2;  // both 0 if slot is unused
+	int zoom, x, y;                   // where the tile was first written
+	OFF_T offset;                     // and, in an archive, its data
+	unsigned int length;
+	unsigned char *pixels;            // once a later tile has matched
+};
+
+static void
+hashPixels(const unsigned char *pixels, int len, unsigned long long *hash1, unsigned long long *hash2)
+{
+	unsigned long long h1 = 0x9e3779b97f4a7c15ULL, h2 = 0xc2b2ae3d27d4eb4fULL, word;
+	int ii;
 
-	// Range check - clip to image limits, or allow extrapolation?
-	if (x<0) x=0;
-	if (y<0) y=0;
-	if (x>=width*QCT_TILE_SIZE) x=width*QCT_TILE_SIZE-1;
-	if (y>=height*QCT_TILE_SIZE) y=height*QCT_TILE_SIZE;
+	for (ii=0; ii+8<=len; ii+=8)
+	{
+		memcpy(&word, pixels+ii, 8);
+		h1 = (h1 ^ word) * 0x100000001b3ULL;
+		h1 ^= h1 >> 29;
+		h2 = (h2 + word * 0xff51afd7ed558ccdULL);
+		h2 = ((h2 << 31) | (h2 >> 33)) * 0x87c37b91114253d5ULL;
+	}
+	for (; ii<len; ii++)
+	{
+		h1 = (h1 ^ pixels[ii]) * 0x100000001b3ULL;
+		h2 = (h2 + pixels[ii]) * 0x87c37b91114253d5ULL;
+	}
+	// Final mix so every input bit affects every output bit
+	h1 ^= h1 >> 33; h1 *= 0xff51afd7ed558ccdULL; h1 ^= h1 >> 33;
+	h2 ^= h2 >> 33; h2 *= 0xc4ceb9fe1a85ec53ULL; h2 ^= h2 >> 33;
+	// Keep 0,0 to mean an unused slot
+	if (h1 == 0 && h2 == 0)
+		h2 = 1;
+	*hash1 = h1;
+	*hash2 = h2;
+}
 
-	x2 = x * x;
-	x3 = x2 * x;
-	y2 = y * y;
-	y3 = y2 * y;
-	xy = x * y;
 
-	// Python:
-	// coeffs in order are: c, cy, cx, cy2, cxy, cx2, cy3, cy2x, cyx2, cx3
-	// There are coefficients for x and for y
-	// each coordinate is calculated as
-	// c + cy*y + cx*x + cy2*y^2 + cxy*x*y + cx2*x^2 + cy3*y^3 + cy2x*(y^2)*x + cyx2*y*x^2 + cx3*x^3
-	// c0 + c1*y + c2*x + c3*y^2 + c4*x*y + c5*x^2 + c6*y^3 + c7*(y^2)*x + c8*y*x^2 + c9*x^3
+// One zoom level of the export, shared by the threads
+struct MercatorExport
+{
+	QCT *qct;
+	const char *directory;      // where to write z/x/y.png files, or
+	FILE *archive;              // where to append tiles to an archive
+	OFF_T archive_pos;
+	unsigned char *entries;     // archive directory being built
+	int num_entries;
+	ExportedTile *exported;     // hash table of unique tiles so far
+	int exported_size, num_exported, num_duplicates;
+#ifdef USE_PTHREADS
+	pthread_mutex_t mutex;      // protects all of the above
+#endif
+	int zoom;
+	int x_min, y_min, x_count;
+	bool failed;
+};
 
-	// Touratech:
-	// Substitute into a and b as follows:
-	// 	x and y to latitude or longitude: x and y
-	// 	lat and lon to x or y: lat and lon
 
-	// x = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
-	// y = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
-	// lat = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
-	// lon = c0 + c1*x + c2*y + c3*x2 + c4*x*y + c5*y2 + c6*x3 + c7*x2*y + c8*x*y2 + c9*y3
+static void
+lockExport(MercatorExport *job)
+{
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&job->mutex);
+#endif
+}
 
-	// New equations (1.01) :
-	// eas, easY, easX, easYY, easXY, easXX, easYYY, easYYX, easYXX, easXXX;
-	// nor, norY, norX, norYY, norXY, norXX, norYYY, norYYX, norYXX, norXXX;
-	// lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY;
-	// lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY;
-	*longitude = lon + lonX * x + lonY * y + lonXX * x2 + lonXY * x * y +
-		lonYY * y2 + lonXXX * x3 + lonXXY * x2 * y + lonXYY * x * y2 + lonYYY * y3;
-	*latitude = lat + latX * x + latY * y + latXX * x2 + latXY * x * y +
-		latYY * y2 + latXXX * x3 + latXXY * x2 * y + latXYY * x * y2 + latYYY * y3;
-	// Mistyped in doc:
-#if 0
-	*longitude = lonXXX * x3 + lonXX * x2 + lonX * x +
-		lonYYY * y3 + lonYY * y2 + lonY * y +
-		lonXXY * x2 * y + lonYYX * y2 * x + lonXY * xy +
-		lon;
-	*latitude = latXXX * x3 + latXX * x2 + latX * x +
-		latYYY * y3 + latYY * y2 + latY * y +
-		latXXY * x2 * y + latYYX * y2 * x + latXY * xy +
-		lat;
+static void
+unlockExport(MercatorExport *job)
+{
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&job->mutex);
 #endif
+}
 
-	// Old equations (1.00) :
-#if 0
-	x2 = x * x;
-	y2 = y * y;
-	R = lonX2 * x2 + lonY2 * y2 + lonX * x + lonY * y + lonXY * x * y + lon;
-	S = latX2 * x2 + latY2 * y2 + latX * x + latY * y + latXY * x * y + lat;
-	R2 = R * R;
-	S2 = S * S;
-	T = easX2 * R2 + easY2 * S2 + easX * R + easY * S + easXY * R * S + eas + 2 * x;
-	U = norX2 * R2 + norY2 * S2 + norX * R + norY * S + norXY * R * S + nor + 2 * y;
-	T2 = T * T;
-	U2 = U * U;
-	*longitude = lonX2 * T2 + lonY2 * U2 + lonX * T + lonY * U + lonXY * T * U + lon;
-	*latitude  = latX2 * T2 + latY2 * U2 + latX * T + latY * U + latXY * T * U + lat;
+
+/*
+ * Return the slot for the given hash, either the one holding a tile with
+ * that hash or the empty one where it should go.  Must hold the lock.
+ */
+static ExportedTile *
+findExportedTile(MercatorExport *job, unsigned long long hash1, unsigned long long hash2)
+{
+	int ii = (int)(hash1 & (job->exported_size - 1));
+
+	while (job->exported[ii].hash1 || job->exported[ii].hash2)
+	{
+		if (job->exported[ii].hash1 == hash1 && job->exported[ii].hash2 == hash2)
+			return &job->exported[ii];
+		ii = (ii + 1) & (job->exported_size - 1);
+	}
+	return &job->exported[ii];
+}
+
+
+/*
+ * Remember a unique tile, doubling the table when it gets half full.
+ * Must hold the lock.
+ */
+static bool
+addExportedTile(MercatorExport *job, const ExportedTile *tile)
+{
+	ExportedTile *slot;
+	int ii;
+
+	if ((job->num_exported + 1) * 2 > job->exported_size)
+	{
+		ExportedTile *old = job->exported;
+		int old_size = job->exported_size;
+		job->exported = (ExportedTile*)calloc(old_size * 2, sizeof(ExportedTile));
+		if (job->exported == NULL)
+		{
+			job->exported = old;
+			return false;
+		}
+		job->exported_size = old_size * 2;
+		for (ii=0; ii<old_size; ii++)
+		{
+			if (old[ii].hash1 || old[ii].hash2)
+				*findExportedTile(job, old[ii].hash1, old[ii].hash2) = old[ii];
+		}
+		free(old);
+	}
+	// The first tile with a hash is kept, so its pixels never change
+	slot = findExportedTile(job, tile->hash1, tile->hash2);
+	if (slot->hash1 == 0 && slot->hash2 == 0)
+	{
+		job->num_exported++;
+		*slot = *tile;
+	}
+	return true;
+}
+
+
+/*
+ * Keep a copy of the pixels of the tile with the given hash, once they
+ * have been rendered again to check a match.  Must hold the lock.
+ */
+static void
+keepExportedPixels(MercatorExport *job, const ExportedTile *tile, const unsigned char *pixels, int len)
+{
+	ExportedTile *slot = findExportedTile(job, tile->hash1, tile->hash2);
+
+	if ((slot->hash1 || slot->hash2) && slot->pixels == NULL)
+	{
+		slot->pixels = (unsigned char*)malloc(len);
+		if (slot->pixels)
+			memcpy(slot->pixels, pixels, len);
+	}
+}
+
+
+/*
+ * Add a directory entry for a tile whose data is at offset in the archive.
+ * Must hold the lock.
+ */
+static void
+addArchiveEntry(MercatorExport *job, int tile_xx, int tile_yy, OFF_T offset, unsigned int len)
+{
+	unsigned char *entry;
+
+	entry = job->entries + (size_t)job->num_entries++ * QCT_TILES_ENTRY_SIZE;
+	putLong(entry,    job->zoom);
+	putLong(entry+4,  tile_xx);
+	putLong(entry+8,  tile_yy);
+	putLong(entry+12, len);
+	putLong(entry+16, (unsigned int)((unsigned long long)offset & 0xffffffffUL));
+	putLong(entry+20, (unsigned int)((unsigned long long)offset >> 32));
+}
+
+
+static int
+compareArchiveEntries(const void *aa, const void *bb)
+{
+	const unsigned char *ea = (const unsigned char*)aa, *eb = (const unsigned char*)bb;
+	int kk;
+
+	// Compare zoom, then x, then y
+	for (kk=0; kk<12; kk+=4)
+	{
+		unsigned int va = ea[kk] | (ea[kk+1]<<8) | (ea[kk+2]<<16) | ((unsigned int)ea[kk+3]<<24);
+		unsigned int vb = eb[kk] | (eb[kk+1]<<8) | (eb[kk+2]<<16) | ((unsigned int)eb[kk+3]<<24);
+		if (va != vb)
+			return (va < vb) ? -1 : 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Copy the tile already written with the same hash as tile into earlier,
+ * returns false (and an empty earlier) if there isn't one.
+ */
+static bool
+findEarlierTile(MercatorExport *job, const ExportedTile *tile, ExportedTile *earlier)
+{
+	lockExport(job);
+	*earlier = *findExportedTile(job, tile->hash1, tile->hash2);
+	unlockExport(job);
+	return (earlier->hash1 || earlier->hash2);
+}
+
+
+/*
+ * Reuse an earlier tile with the same pixels (archive entry or hard link)
+ * for this one, returns false if it couldn't.
+ */
+static bool
+reuseExportedTile(MercatorExport *job, int tile_xx, int tile_yy, const ExportedTile *earlier)
+{
+	char from[1024], to[1024];
+
+	lockExport(job);
+	job->num_duplicates++;
+	if (job->archive)
+	{
+		addArchiveEntry(job, tile_xx, tile_yy, earlier->offset, earlier->length);
+		unlockExport(job);
+		return true;
+	}
+	unlockExport(job);
+
+	snprintf(from, sizeof(from), "%s/%d/%d/%d.png", job->directory, earlier->zoom, earlier->x, earlier->y);
+	snprintf(to, sizeof(to), "%s/%d/%d", job->directory, job->zoom, tile_xx);
+	mkdir(to, 0777);
+	snprintf(to, sizeof(to), "%s/%d/%d/%d.png", job->directory, job->zoom, tile_xx, tile_yy);
+	unlink(to);
+	// If the filesystem can't link then it will have to be encoded again
+	return (link(from, to) == 0);
+}
+
+
+void
+QCT::exportTileJob(void *arg, int ii)
+{
+	MercatorExport *job = (MercatorExport*)arg;
+	QCT *qct = job->qct;
+	int tile_xx = job->x_min + ii % job->x_count;
+	int tile_yy = job->y_min + ii / job->x_count;
+	int tile_pixels = XYZ_TILE_SIZE * XYZ_TILE_SIZE;
+	unsigned char *pixels;
+	ExportedTile tile, earlier;
+	char path[1024];
+	FILE *fp;
+
+	if (job->failed)
+		return;
+	// The second half is for rendering the tiles they may duplicate
+	pixels = (unsigned char*)malloc(2 * tile_pixels);
+	if (pixels == NULL)
+	{
+		job->failed = true;
+		return;
+	}
+	// Skip tiles which don't include any of the chart
+	if (qct->renderMercatorTile(job->zoom, tile_xx, tile_yy, pixels) == 0)
+	{
+		free(pixels);
+		return;
+	}
+
+	// Skip encoding if the same pixels have already been written
+	hashPixels(pixels, tile_pixels, &tile.hash1, &tile.hash2);
+	if (findEarlierTile(job, &tile, &earlier)
+	 && qct->sameMercatorTile(earlier.zoom, earlier.x, earlier.y, earlier.pixels, pixels, pixels + tile_pixels))
+	{
+		if (earlier.pixels == NULL)
+		{
+			lockExport(job);
+			keepExportedPixels(job, &earlier, pixels, tile_pixels);
+			unlockExport(job);
+		}
+		if (reuseExportedTile(job, tile_xx, tile_yy, &earlier))
+		{
+			free(pixels);
+			return;
+		}
+	}
+	tile.zoom = job->zoom;
+	tile.x = tile_xx;
+	tile.y = tile_yy;
+	tile.pixels = NULL;
+
+#ifdef USE_PNG
+	PNGBuffer buf = { NULL, 0, 0 };
+	if (!encodePNG(pixels, XYZ_TILE_SIZE, XYZ_TILE_SIZE, qct->out_palette, true, &buf))
+		job->failed = true;
+	else if (job->archive)
+	{
+		ExportedTile found;
+		lockExport(job);
+		// Another thread may have appended the same pixels meanwhile (an
+		// archive offset is never 0, so a new one differs from earlier's)
+		found = *findExportedTile(job, tile.hash1, tile.hash2);
+		if ((found.hash1 || found.hash2) && found.offset != earlier.offset
+		 && qct->sameMercatorTile(found.zoom, found.x, found.y, found.pixels, pixels, pixels + tile_pixels))
+		{
+			if (found.pixels == NULL)
+				keepExportedPixels(job, &found, pixels, tile_pixels);
+			job->num_duplicates++;
+			addArchiveEntry(job, tile_xx, tile_yy, found.offset, found.length);
+		}
+		else
+		{
+			tile.offset = job->archive_pos;
+			tile.length = (unsigned int)buf.len;
+			addArchiveEntry(job, tile_xx, tile_yy, tile.offset, tile.length);
+			if (fwrite(buf.data, 1, buf.len, job->archive) != buf.len)
+				job->failed = true;
+			job->archive_pos += buf.len;
+			if (!addExportedTile(job, &tile))
+				job->failed = true;
+		}
+		unlockExport(job);
+	}
+	else
+	{
+		// Threads may race to make the same directory so ignore EEXIST
+		snprintf(path, sizeof(path), "%s/%d/%d", job->directory, job->zoom, tile_xx);
+		mkdir(path, 0777);
+		snprintf(path, sizeof(path), "%s/%d/%d/%d.png", job->directory, job->zoom, tile_xx, tile_yy);
+		fp = fopen(path, "wb");
+		if (fp == NULL)
+		{
+			qct->throwError("cannot open %s (%s)", path, strerror(errno));
+			job->failed = true;
+		}
+		else
+		{
+			if (fwrite(buf.data, 1, buf.len, fp) != buf.len)
+				job->failed = true;
+			if (fclose(fp))
+			{
+				qct->throwError("cannot write %s (%s)", path, strerror(errno));
+				job->failed = true;
+			}
+			// Only once it is complete can other tiles link to it
+			tile.offset = 0;
+			tile.length = (unsigned int)buf.len;
+			lockExport(job);
+			if (!job->failed && !addExportedTile(job, &tile))
+				job->failed = true;
+			unlockExport(job);
+		}
+	}
+	if (buf.data) free(buf.data);
+#else
+	job->failed = true;
 #endif
+	free(pixels);
+}
 
-	// Add the datum shift
-	*longitude += datum_shift_east;
-	*latitude  += datum_shift_north;
 
-	return(0);
+/*
+ * Find the range of tiles at zoom which cover the chart extent
+ */
+static void
+mercatorTileRange(int zoom, double lat_min, double lon_min, double lat_max, double lon_max,
+	int *x_min, int *y_min, int *x_max, int *y_max)
+{
+	*x_min = mercatorLonToTile(lon_min, zoom);
+	*x_max = mercatorLonToTile(lon_max, zoom);
+	// Tile numbers increase southwards
+	*y_min = mercatorLatToTile(lat_max, zoom);
+	*y_max = mercatorLatToTile(lat_min, zoom);
 }
 
 
-int
-QCT::latlon_to_xy(double latitude, double longitude, int *pixel_x, int *pixel_y) const
+/*
+ * Common part of exportTiles and exportTileArchive.
+ */
+bool
+QCT::exportMercator(const char *directory, FILE *archive, int min_zoom, int max_zoom)
 {
-	double longitude2, latitude2, longitude3, latitude3, longitudelatitude;
+	double lat_min, lon_min, lat_max, lon_max;
+	MercatorExport job;
+	char path[1024];
+	int ii, zoom, x_max, y_max, max_entries = 0;
 
-	// Range check - clip to image limits, or allow extrapolation?
-	if (latitude<-90)   latitude=-90;
-	if (latitude>90)    latitude=90;
-	if (longitude<-360) longitude=0;
-	if (longitude>360)  longitude=0;
+#ifndef USE_PNG
+	throwError("cannot export tiles (PNG not supported)");
+	return false;
+#endif
+	if (qctfp == NULL || min_zoom < 0 || max_zoom > 30 || min_zoom > max_zoom)
+		return false;
 
-	longitude2 = longitude * longitude;
-	longitude3 = longitude2 * longitude;
-	latitude2 = latitude * latitude;
-	latitude3 = latitude2 * latitude;
-	longitudelatitude = longitude * latitude;
+	getLatLonExtent(&lat_min, &lon_min, &lat_max, &lon_max);
+
+	job.qct = this;
+	job.directory = directory;
+	job.archive = archive;
+	job.archive_pos = 0;
+	job.entries = NULL;
+	job.num_entries = 0;
+	job.exported_size = 1024;
+	job.num_exported = job.num_duplicates = 0;
+	job.exported = (ExportedTile*)calloc(job.exported_size, sizeof(ExportedTile));
+	job.failed = false;
+	if (job.exported == NULL)
+		return false;
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&job.mutex, NULL);
+#endif
 
-	// Remove the datum shift
-	longitude -= datum_shift_east;
-	latitude  -= datum_shift_north;
+	if (archive)
+	{
+		// Leave room for a directory entry for every tile which might be
+		// written, then the tiles can be appended as soon as they are made
+		for (zoom=min_zoom; zoom<=max_zoom; zoom++)
+		{
+			mercatorTileRange(zoom, lat_min, lon_min, lat_max, lon_max, &job.x_min, &job.y_min, &x_max, &y_max);
+			max_entries += (x_max - job.x_min + 1) * (y_max - job.y_min + 1);
+		}
+		job.entries = (unsigned char*)calloc(max_entries, QCT_TILES_ENTRY_SIZE);
+		job.archive_pos = QCT_TILES_HEADER_SIZE + (OFF_T)max_entries * QCT_TILES_ENTRY_SIZE;
+		if (job.entries == NULL)
+			job.failed = true;
+		else if (FSEEKO(archive, job.archive_pos, SEEK_SET) != 0)
+		{
+			throwError("cannot write tile archive (output must be seekable)");
+			job.failed = true;
+		}
+	}
+	else
+		mkdir(directory, 0777);
 
-	*pixel_x = NINT(eas + easX * longitude + easY * latitude + easXX * longitude2 + easXY * longitude * latitude +
-		easYY * latitude2 + easXXX * longitude3 + easXXY * longitude2 * latitude + easXYY * longitude * latitude2 + easYYY * latitude3);
-	*pixel_y = NINT(nor + norX * longitude + norY * latitude + norXX * longitude2 + norXY * longitude * latitude +
-		norYY * latitude2 + norXXX * longitude3 + norXXY * longitude2 * latitude + norXYY * longitude * latitude2 + norYYY * latitude3);
+	for (zoom=min_zoom; zoom<=max_zoom && !job.failed; zoom++)
+	{
+		job.zoom = zoom;
+		mercatorTileRange(zoom, lat_min, lon_min, lat_max, lon_max, &job.x_min, &job.y_min, &x_max, &y_max);
+		job.x_count = x_max - job.x_min + 1;
+		message("Zoom %d: tiles %d..%d, %d..%d", zoom, job.x_min, x_max, job.y_min, y_max);
+		if (!archive)
+		{
+			snprintf(path, sizeof(path), "%s/%d", directory, zoom);
+			mkdir(path, 0777);
+		}
+		parallelFor(job.x_count * (y_max - job.y_min + 1), nthreads, exportTileJob, &job);
+	}
 
-	*pixel_x /= scalefactor;
-	*pixel_y /= scalefactor;
+	if (archive)
+	{
+		unsigned char header[QCT_TILES_HEADER_SIZE];
+		size_t dir_size = (size_t)max_entries * QCT_TILES_ENTRY_SIZE;
+
+		// Directory sorted for binary search, unused entries left zero
+		qsort(job.entries, job.num_entries, QCT_TILES_ENTRY_SIZE, compareArchiveEntries);
+		memcpy(header, QCT_TILES_MAGIC, 8);
+		putLong(header+8, QCT_TILES_VERSION);
+		putLong(header+12, job.num_entries);
+		if (!job.failed && (FSEEKO(archive, 0, SEEK_SET) != 0 ||
+			fwrite(header, 1, QCT_TILES_HEADER_SIZE, archive) != QCT_TILES_HEADER_SIZE ||
+			fwrite(job.entries, 1, dir_size, archive) != dir_size))
+			job.failed = true;
+		FSEEKO(archive, 0, SEEK_END);
+		message("Archive has %d tiles", job.num_entries);
+		if (job.entries) free(job.entries);
+	}
+	message("Exported %d unique tiles, %d duplicates", job.num_exported, job.num_duplicates);
+#ifdef USE_PTHREADS
+	pthread_mutex_destroy(&job.mutex);
+#endif
+	for (ii=0; ii<job.exported_size; ii++)
+		if (job.exported[ii].pixels) free(job.exported[ii].pixels);
+	free(job.exported);
 
-	return(-1);
+	if (job.failed)
+		throwError("cannot export tiles to %s", directory);
+	return !job.failed;
 }
 
 
-double
-QCT::getDegreesPerPixel() const
+bool
+QCT::exportTiles(const char *directory, int min_zoom, int max_zoom)
 {
-	if (width<1 || height<1)
-		return 0;
-	int y = height/2;
-	int w = (width * QCT_TILE_SIZE / scalefactor);
-	double lat0,lon0, lat1,lon1;
-	// Find the longitude of the left edge and right edge
-	// mid-way up the image and divide long range by width in pixels
-	xy_to_latlon(0, y, &lat0, &lon0);
-	xy_to_latlon(w-1, y, &lat1, &lon1);
-	double dpp = (double)fabs(lon1 - lon0) / (double)(w);
-	return (fabs(lon1 - lon0) / (w));
+	return exportMercator(directory, NULL, min_zoom, max_zoom);
 }
 
 
-/* -------------------------------------------------------------------------
+/*
+ * As exportTiles but all the tiles are put into one file,
+ * see qcttiles.h for the format and a class to read it.
  */
+bool
+QCT::exportTileArchive(const char *filename, int min_zoom, int max_zoom)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		throwError("cannot open %s (%s)", filename, strerror(errno));
+		return false;
+	}
+	truth = exportMercator(filename, fp, min_zoom, max_zoom);
+	if (fclose(fp))
+	{
+		throwError("cannot write %s (%s)", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
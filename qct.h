@@ -13,6 +13,49 @@
 #define PAL_RED(c)   ((c>>16)&255)
 #define PAL_GREEN(c) ((c>>8)&255)
 #define PAL_BLUE(c)  ((c)&255)
+// QCT colours are all below 128, this index is used for "no data"
+#define QCT_TRANSPARENT_INDEX 255
+// Overlay colours are given the palette indexes from this one up
+#define QCT_OVERLAY_INDEX       128
+#define QCT_MAX_OVERLAY_COLOURS 16
+// Raw image written by writeRawFile, all values little-endian:
+//   "QCTRAW\0\0", version, header size, width, height, scale (4 bytes each)
+//   then 4 zero bytes, georeferencing coefficients eas..easXXX, nor..norXXX,
+//   lat..latYYY, lon..lonYYY, datum shift north, east (IEEE doubles) and
+//   the palette as R,G,B,0 for each of 256 entries.  The header is padded
+//   with zeros to its size and is followed by width*height palette indexes.
+//   For a cropped image the coefficients are from its own top left corner.
+// Coordinate grid saved by writeGeoGridFile, all values little-endian:
+//   "QCTGRID\0", version, scale, spacing, columns, rows (4 bytes each),
+//   4 zero bytes, worst error, then the georeferencing as in the raw image
+//   header (IEEE doubles), padded with zeros to the header size, followed
+//   by latitude,longitude (doubles) for each node, row by row.
+#define QCT_GRID_MAGIC       "QCTGRID\0"
+#define QCT_GRID_VERSION     1
+#define QCT_GRID_HEADER_SIZE 512
+// True colour formats for expandPixels (bytes in memory order)
+#define QCT_PIXEL_RGB24  0
+#define QCT_PIXEL_RGBA32 1
+#define QCT_PIXEL_BGRA32 2
+// Colour transform for a palette variant, RGB packed as in the palette
+typedef int (*QCTColourTransform)(int rgb, void *arg);
+#define QCT_MAX_PALETTES 16
+// Tile position relative to the outline
+#define OUTLINE_TILE_OUTSIDE  0
+#define OUTLINE_TILE_INSIDE   1
+#define OUTLINE_TILE_CROSSING 2
+// Resolutions kept for renderView, 1/1 to 1/32 (2x2 pixels per tile)
+#define QCT_VIEW_LEVELS 6
+#define QCT_VIEW_CACHE  (128 << 20) // default bytes of view tiles kept
+#define QCT_RAW_MAGIC       "QCTRAW\0\0"
+#define QCT_RAW_VERSION     1
+#define QCT_RAW_HEADER_SIZE 4096
+#define QCT_RAW_COEFFS      42
+
+
+// Call fn(arg, ii) for ii = 0 to count-1 using up to nthreads threads
+// (0 means one per processor), in any order
+void parallelFor(int count, int nthreads, void (*fn)(void *arg, int ii), void *arg);
 
 
 /* -------------------------------------------------------------------------
@@ -23,6 +66,8 @@
  * if requested read the image data too.
  * If image data not read at this stage then later call loadImage.
  * To reload the image at a new scale call unloadImage then loadImage.
+ * The write methods do not need the image to be loaded, if it isn't
+ * they decode it one strip (row of tiles) at a time as they write it.
  * Call closeFilename when you've completely finished.
  */
 class QCT
@@ -42,36 +87,111 @@ public:
 	bool loadImage(int scale);
 	void unloadImage();
 	void closeFilename();
+	// Streaming (one row of tiles at a time, image need not be loaded):
+	int  getNumStrips() const   { return height; }
+	int  getStripHeight() const { return QCT_TILE_SIZE / scalefactor; }
+	bool readStrip(int tile_y, unsigned char *strip);
+	// Random access to full resolution tiles, decoded once when first used:
+	const unsigned char *getTile(int tile_x, int tile_y);
+	void unloadTiles();
+	// Colours at many positions, decoding only the tiles they fall in
+	int  samplePoints(int count, const double *lat, const double *lon,
+	         unsigned char *index, int *rgb = NULL, bool *inside = NULL);
 
 	// Information:
 	void setDebug(int d)     { debug = d; }
 	void setVerbose(int v)   { verbose = v; }
+	void setThreads(int n)   { nthreads = n; } // 0 means one per processor
+	// Make everything outside the outline transparent in the output
+	void setOutlineMask(bool m) { outline_mask = m; }
+	bool getOutlineMask() const { return outline_mask; }
+	void maskOutline(int first_row, int rows, unsigned char *pixels, unsigned char *alpha = NULL);
+	bool imageMasked() const    { return image_masked; } // loaded with the mask
+	// Palette variants ("day", "dusk", "night", "grey" built in) applied
+	// when writing, without decoding again.  NULL is the chart's palette.
+	bool addPaletteTransform(const char *name, QCTColourTransform fn, void *arg = NULL);
+	bool setPalette(const char *name);
+	int  getNumPalettes() const { return num_palettes; }
+	const char *getPaletteName(int index) const;
+	const int *getOutputPalette() const { return out_palette; }
 	void printMetadata(FILE *fp);
 
 	// Writing methods:
+	// Only the part of the image in the crop rectangle, if one is set, is
+	// written and only the tiles it overlaps are decoded
+	bool setCrop(int x, int y, int w, int h); // full resolution pixels
+	bool setCropLatLon(double lat_min, double lon_min, double lat_max, double lon_max);
+	void clearCrop()          { crop_w = crop_h = 0; }
+	bool getCrop(int *x, int *y, int *w, int *h) const; // at the current scale
+	int  getOutputWidth() const  { int x, y, w, h; getCrop(&x, &y, &w, &h); return w; }
+	int  getOutputHeight() const { int x, y, w, h; getCrop(&x, &y, &w, &h); return h; }
 	bool writePPMFile(FILE *);
 	bool writePPMFilename(const char *filename);
+	bool writePGMFile(FILE *, bool pam = false);
+	bool writePGMFilename(const char *filename, bool pam = false);
 	bool writeGIFFile(FILE *);
 	bool writeGIFFilename(const char *filename);
 	bool writePNGFile(FILE *);
 	bool writePNGFilename(const char *filename);
-	bool writeTIFFFile(FILE *);
-	bool writeTIFFFilename(const char *filename);
+	bool writeRawFile(FILE *);
+	bool writeRawFilename(const char *filename);
+	// overviews is the number of reduced resolution levels, -1 for all
+	bool writeTIFFFile(FILE *, bool deflate = true, int overviews = 0);
+	bool writeTIFFFilename(const char *filename, bool deflate = true, int overviews = 0);
+	// Reproject into a Web Mercator (EPSG:3857) rectangle given in metres
+	int  warpMercator(double x_min, double y_min, double x_max, double y_max,
+	                  int out_width, int out_height, unsigned char *out,
+	                  bool interpolate = false, double max_error = 0.125);
+	// Render a latitude,longitude rectangle (degrees, linear in both) for
+	// display, from tiles cached at reduced resolutions, spending at most
+	// budget_ms (0 for no limit) decoding tiles.  Returns the number of
+	// tiles not ready (shown from a coarser level) so render again, or -1.
+	int  renderView(double lat_min, double lon_min, double lat_max, double lon_max,
+	                int out_width, int out_height, unsigned char *out, double budget_ms = 0);
+	void setViewCacheSize(size_t bytes) { view_limit = bytes; }
+	void unloadViewCache();
+	// Tracks, routes and waypoints (degrees WGS84) drawn in colour rgb
+	// into each tile as it is decoded, and into the image if loaded.
+	// Widths are in pixels at the scale the tiles are decoded at.
+	bool addOverlayLine(int count, const double *lat, const double *lon, int rgb, int line_width = 1);
+	bool addOverlayMarker(double lat, double lon, int rgb, int size = 5);
+	void clearOverlay(); // tiles decoded after this are left clean
+	// Web Mercator z/x/y.png tiles for a range of zoom levels
+	bool exportTiles(const char *directory, int min_zoom, int max_zoom);
+	// The same tiles all in one file (see qcttiles.h)
+	bool exportTileArchive(const char *filename, int min_zoom, int max_zoom);
 
 	// Query methods:
-	int getImageWidth()       { return width * QCT_TILE_SIZE / scalefactor; }
-	int getImageHeight()      { return height * QCT_TILE_SIZE / scalefactor; }
+	int getImageWidth() const { return width * QCT_TILE_SIZE / scalefactor; }
+	int getImageHeight() const{ return height * QCT_TILE_SIZE / scalefactor; }
 	unsigned char *getImage() { return image_data; }
+	// Loaded image (part) expanded to true colour, format is QCT_PIXEL_...
+	bool expandPixels(int x, int y, int w, int h, int format, unsigned char *out, int stride, bool parallel = true);
 	bool getColour(int index, int *R, int *G, int *B)
-	                          { if (index<0||index>127) return false;
-	                          *R = PAL_RED(palette[index]);
-	                          *G = PAL_GREEN(palette[index]);
-	                          *B = PAL_BLUE(palette[index]);
+	                          { if (index<0||index>255) return false;
+	                          *R = PAL_RED(out_palette[index]);
+	                          *G = PAL_GREEN(out_palette[index]);
+	                          *B = PAL_BLUE(out_palette[index]);
 	                          return true; }
 							 
 	// Query geolocation methods:
 	int xy_to_latlon(int pixel_x, int pixel_y, double *lat, double *lon) const;
 	int latlon_to_xy(double lat, double lon, int *pixel_x, int *pixel_y) const;
+	// Arrays of count points, pixels as doubles (not rounded or clipped)
+	void pixelsToLatLon(int count, const double *x, const double *y, double *lat, double *lon) const;
+	void latLonToPixels(int count, const double *lat, const double *lon, double *x, double *y) const;
+	// Refined with Newton's method until pixelsToLatLon agrees
+	int  latLonToPixelsRefined(int count, const double *lat, const double *lon, double *x, double *y,
+	         bool *converged = NULL, double tolerance = 0.001, int max_iterations = 6) const;
+	// Interpolated from a grid of precomputed points, which can be saved
+	bool buildGeoGrid(int spacing, double *max_error = NULL);
+	void gridToLatLon(double x, double y, double *lat, double *lon) const;
+	double getGeoGridError() const { return grid_error; }
+	bool writeGeoGridFile(FILE *);
+	bool writeGeoGridFilename(const char *filename);
+	bool readGeoGridFile(FILE *);
+	bool readGeoGridFilename(const char *filename);
+	void unloadGeoGrid();
 	double getDegreesPerPixel() const;
 
 	// Query metadata methods:
@@ -79,28 +199,99 @@ public:
 	char *getName()           { return metadata.name; }
 	char *getIdentifier()     { return metadata.ident; }
 	char *getProjection()     { return metadata.projection; }
+	char *getScale()          { return metadata.scale; }
+	char *getDatum()          { return metadata.datum; }
 	bool coordInsideMap(double lat, double lon);
+	int  coordsInsideMap(int count, const double *lat, const double *lon, bool *inside);
 	// Query map boundary:
 	int  getOutlineSize() const { return metadata.num_outline; }
 	void getOutlinePoint(int i, double *lat, double *lon) const
 		{ if (i>=0 && i<metadata.num_outline) { *lat=metadata.outline_lat[i]; *lon=metadata.outline_lon[i]; } }
 	void getOutlinePoints(double *lat, double *lon) const
 		{ for (int i=0; i<metadata.num_outline; i++) { lat[i]=metadata.outline_lat[i]; lon[i]=metadata.outline_lon[i]; } }
+	// Full resolution pixel inside the outline (exact, unlike coordInsideMap
+	// which rounds to 0.001 degrees), true everywhere if there is no outline
+	bool insideOutline(int px, int py) const;
 
 private:
+	friend class QCTStripReader;
 	bool readFile(FILE *, bool headeronly, int scale);
-	void readTile(FILE *, int tile_x, int tile_y, int scale);
+	bool readStripTiles(int tile_y, unsigned char *strip, int first_tile, int last_tile);
+	void readTile(FILE *, unsigned char *dest, int bytes_per_row, int tile_x, int tile_y, int scale);
+	void unpackTile(const unsigned char *data, int length, unsigned char *dest, int bytes_per_row, int tile_x, int tile_y, int scale);
+	void decodeTile(int tile_x, int tile_y, unsigned char *dest);
+	bool findTileLengths();
+	void waitForTile(unsigned char **slot);
 	bool loadMetadata(FILE *fp);
 	void unload();
 	void unloadMetadata();
+	void buildOutlineSpans();
+	void buildOutlineIndex();
+	bool outlineContains(unsigned int xt, unsigned int yt) const;
+	static void outlineBatchJob(void *arg, int chunk);
+	void applyPalette();
+	void applyOverlayColours();
+	bool addOverlaySegment(double x1, double y1, double x2, double y2, int colour, int line_width);
+	void drawOverlay(unsigned char *dest, int bytes_per_row, int tile_x, int tile_y, int scale) const;
+	void gridHeader(unsigned char *header) const;
+	void maskSpans(int first_row, int rows, int col0, int col1, unsigned char *pixels, unsigned char *alpha, int stride);
+	void pixelToLatLon(double x, double y, double *lat, double *lon) const;
+	void latlonToPixel(double lat, double lon, double *x, double *y) const;
+	void getLatLonExtent(double *lat_min, double *lon_min, double *lat_max, double *lon_max) const;
+	int  renderMercatorTile(int zoom, int tile_x, int tile_y, unsigned char *pixels);
+	bool sameMercatorTile(int zoom, int tile_x, int tile_y, const unsigned char *kept, const unsigned char *pixels, unsigned char *scratch);
+	int  warp(double x_min, double y_min, double x_max, double y_max,
+	          int out_width, int out_height, unsigned char *out,
+	          bool interpolate, double max_error, int threads,
+	          bool latlon = false, int level = -1, double deadline = 0);
+	void warpTransform(const struct WarpJob *job, double i, double j, double *sx, double *sy) const;
+	int  warpPixel(struct WarpSampler *sampler, int px, int py);
+	const unsigned char *getViewTile(struct WarpSampler *sampler, int tile_x, int tile_y);
+	int  warpSample(struct WarpSampler *sampler, double sx, double sy, bool interpolate);
+	int  warpCell(const struct WarpJob *job, struct WarpSampler *sampler, int i0, int j0, int i1, int j1, const struct WarpPoint *corner);
+	static void warpJob(void *arg, int block);
+	static void exportTileJob(void *arg, int ii);
+	bool exportMercator(const char *directory, FILE *archive, int min_zoom, int max_zoom);
 
 private:
 	FILE *qctfp;
 	int width, height;         // size in tiles (of 64x64 each)
 	int palette[256];          // combined RGB in each int
 	unsigned char pal_interp[128][128];
+	int out_palette[256];      // palette transformed for output
+	unsigned char out_interp[128][128]; // pal_interp to match out_palette
+	char *palette_names[QCT_MAX_PALETTES];
+	QCTColourTransform palette_fns[QCT_MAX_PALETTES];
+	void *palette_args[QCT_MAX_PALETTES];
+	int num_palettes, current_palette; // current is -1 for chart palette
 	unsigned char *image_data; // one pixel per byte
 	int scalefactor;           // reduction factor
+	unsigned char **tile_cache;// decoded full resolution tiles (or NULL)
+	int *tile_length;          // bytes of each tile in the file, at most
+	void *tile_mutex;          // protects tile_cache, tile_length and view_tiles
+	void *tile_cond;           // signalled when a tile being decoded is ready
+	unsigned char **view_tiles[QCT_VIEW_LEVELS]; // tiles for renderView
+	unsigned int *view_used[QCT_VIEW_LEVELS];    // frame each was last used
+	unsigned int view_frame;
+	size_t view_bytes, view_limit;
+	int view_missing;          // tiles not ready in this frame
+	bool outline_mask;         // mask output outside the outline
+	int *outline_row_start;    // index into outline_spans for each row
+	int *outline_spans;        // start,end pixel pairs inside the outline
+	unsigned char *outline_tiles; // OUTLINE_TILE_ class of each tile
+	bool image_masked;         // image_data was loaded with the mask
+	int crop_x, crop_y, crop_w, crop_h; // output rectangle, full resolution
+	struct OutlineEdge *outline_edges; // outline edges bucketed by longitude
+	int *outline_bucket_start; // index into outline_edges for each bucket
+	int outline_buckets;
+	unsigned int outline_box[4]; // integer outline extent, x,y min then max
+	struct OverlaySegment *overlay_segs; // full resolution pixels
+	int num_overlay_segs, max_overlay_segs;
+	struct OverlayRef *overlay_refs; // segments crossing each tile, in order
+	int num_overlay_refs, max_overlay_refs;
+	int *overlay_head, *overlay_tail; // first and last ref of each tile or -1
+	int overlay_colours[QCT_MAX_OVERLAY_COLOURS];
+	int num_overlay_colours;
 	// Metadata
 	struct
 	{
@@ -131,8 +322,13 @@ private:
 	double lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY;
 	double lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY;
 	double datum_shift_north, datum_shift_east;
+	// Coordinate grid, latitude,longitude of each node
+	double *grid_latlon;
+	int grid_spacing, grid_nx, grid_ny, grid_scale;
+	double grid_error, grid_inv_spacing;
 	// Program options
 	int verbose, debug, debug_kml_outline, debug_kml_boundary;
+	int nthreads;
 	FILE *dfp; // debug output goes here
 };
 
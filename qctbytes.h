@@ -0,0 +1,71 @@
+/* > qctbytes.h
+ */
+
+
+#ifndef QCTBYTES_H
+#define QCTBYTES_H
+
+
+#include <string.h>  // for memcpy
+
+
+/* -------------------------------------------------------------------------
+ * Little-endian values to and from memory for the files written,
+ * whatever the host byte order.
+ */
+static inline void
+putShort(unsigned char *pp, int vv)
+{
+	pp[0] = vv & 255;
+	pp[1] = (vv >> 8) & 255;
+}
+
+static inline void
+putLong(unsigned char *pp, unsigned int vv)
+{
+	pp[0] = vv & 255;
+	pp[1] = (vv >> 8) & 255;
+	pp[2] = (vv >> 16) & 255;
+	pp[3] = (vv >> 24) & 255;
+}
+
+static inline void
+putLongLong(unsigned char *pp, unsigned long long vv)
+{
+	putLong(pp, (unsigned int)(vv & 0xffffffff));
+	putLong(pp+4, (unsigned int)(vv >> 32));
+}
+
+static inline void
+putDouble(unsigned char *pp, double vv)
+{
+	unsigned long long bits;
+
+	memcpy(&bits, &vv, 8);
+	putLongLong(pp, bits);
+}
+
+static inline unsigned int
+getLong(const unsigned char *pp)
+{
+	return pp[0] | (pp[1] << 8) | (pp[2] << 16) | ((unsigned int)pp[3] << 24);
+}
+
+static inline unsigned long long
+getLongLong(const unsigned char *pp)
+{
+	return getLong(pp) | ((unsigned long long)getLong(pp+4) << 32);
+}
+
+static inline double
+getDouble(const unsigned char *pp)
+{
+	unsigned long long bits = getLongLong(pp);
+	double vv;
+
+	memcpy(&vv, &bits, 8);
+	return vv;
+}
+
+
+#endif // !QCTBYTES_H
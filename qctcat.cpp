@@ -0,0 +1,155 @@
+/* > qctcat.cpp
+ */
+
+static const char SCCSid[] = "@(#)qctcat.cpp    1.00 (C) 2026 Catalogue a library of QCT maps";
+
+/*
+ * Get command-line options
+ */
+#ifndef GETOPT
+#include <getopt.h>
+#define GETOPT(c, options) c = optind = 1; while (c && ((c=getopt(argc,argv,options))!=-1)) switch(c)
+#endif /*GETOPT*/
+#ifndef GETOPT_LOOP_REST
+#define GETOPT_LOOP_REST(argp) \
+	while((optind < argc)? (argp = argv[optind++]): (argp = NULL))
+#endif
+
+
+/*
+ * Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "qct.h"
+#include "qctcatalog.h"
+#include "qctindex.h"
+
+
+/* -------------------------------------------------------------------------
+ * Print the charts found by a query, most detailed first.
+ */
+static void
+printCharts(const QCTIndex &index, int num, const int *ids)
+{
+	int ii;
+
+	for (ii=0; ii<num; ii++)
+		printf("%s\t%s\t%g\n", index.getPath(ids[ii]), index.getScale(ids[ii]), index.getDegreesPerPixel(ids[ii]));
+}
+
+
+/* -------------------------------------------------------------------------
+ * Scan directories of charts into a catalogue, reading only new and
+ * changed files if the catalogue already exists.
+ */
+int
+main(int argc, char *argv[])
+{
+	char *prog;
+	const char *options = "vlb:c:p:t:";
+	const char *usage = "usage: %s [-v] [-l] [-p lat,lon] [-b lat,lon,lat,lon] [-t threads] -c catalogue [directory...]\n"
+		"-v\tverbose\n"
+		"-l\tlist the catalogue: path, identifier, scale, degrees per pixel,\n"
+		"\tlatitude and longitude extent, title\n"
+		"-p\tlist the charts covering a position (degrees), most detailed first\n"
+		"-b\tlist the charts overlapping the box between two corners\n"
+		"-t\tnumber of threads (default one per processor)\n"
+		"-c\tcatalogue filename, created if it does not exist\n";
+	int verbose = 0;
+	int list = 0;
+	int threads = 0;
+	char *catalogfile = NULL;
+	char *directory;
+	double point[2], box[4];
+	int num_point = 0, num_box = 0;
+	int c, ii, num_read = 0;
+	bool changed = false;
+	FILE *fp;
+
+	prog = argv[0];
+	GETOPT(c, options)
+	{
+		case 'v': verbose++; break;
+		case 'l': list++; break;
+		case 'p': num_point = sscanf(optarg, "%lf,%lf", &point[0], &point[1]); break;
+		case 'b': num_box = sscanf(optarg, "%lf,%lf,%lf,%lf", &box[0], &box[1], &box[2], &box[3]); break;
+		case 'c': catalogfile = optarg; break;
+		case 't': threads = atoi(optarg); break;
+		default: fprintf(stderr, usage, prog); exit(1);
+	}
+
+	if (catalogfile == NULL)
+	{
+		fprintf(stderr, "%s: missing catalogue file\n", prog);
+		fprintf(stderr, usage, prog);
+		exit(1);
+	}
+	if ((num_point != 0 && num_point != 2) || (num_box != 0 && num_box != 4))
+	{
+		fprintf(stderr, "%s: -p needs lat,lon and -b needs lat,lon,lat,lon\n", prog);
+		exit(1);
+	}
+
+	QCTCatalog catalog;
+	catalog.setVerbose(verbose);
+	// A missing catalogue is just empty, a bad one is an error
+	fp = fopen(catalogfile, "rb");
+	if (fp)
+	{
+		fclose(fp);
+		if (!catalog.readFilename(catalogfile))
+			exit(1);
+	}
+
+	GETOPT_LOOP_REST(directory)
+	{
+		int nn = catalog.scan(directory, threads);
+		if (nn < 0)
+			exit(1);
+		num_read += nn;
+		changed = true;
+	}
+	if (verbose)
+		printf("%d charts, %d read\n", catalog.getNumEntries(), num_read);
+	// Written whenever there was a scan, files may have gone
+	if (changed && !catalog.writeFilename(catalogfile))
+		exit(1);
+
+	for (ii=0; list && ii<catalog.getNumEntries(); ii++)
+	{
+		const QCTCatalogEntry *entry = catalog.getEntry(ii);
+		if (entry->flags & QCT_CATALOG_INVALID)
+			continue;
+		printf("%s\t%s\t%s\t%g\t%f\t%f\t%f\t%f\t%s\n", entry->path, entry->ident, entry->scale,
+			entry->degrees_per_pixel, entry->lat_min, entry->lon_min, entry->lat_max, entry->lon_max, entry->title);
+	}
+
+	if (num_point || num_box)
+	{
+		QCTIndex index;
+		int num, *ids;
+		index.addCatalog(&catalog);
+		index.setSort(QCT_INDEX_SORT_DPP);
+		ids = (int*)malloc((index.getNumCharts() + 1) * sizeof(int));
+		if (ids == NULL || !index.build())
+			exit(1);
+		if (num_point)
+		{
+			num = index.findPoint(point[0], point[1], ids, index.getNumCharts());
+			printCharts(index, num, ids);
+		}
+		if (num_box)
+		{
+			// Either pair of opposite corners will do
+			num = index.findBox(box[0] < box[2] ? box[0] : box[2], box[1] < box[3] ? box[1] : box[3],
+				box[0] > box[2] ? box[0] : box[2], box[1] > box[3] ? box[1] : box[3], ids, index.getNumCharts());
+			printCharts(index, num, ids);
+		}
+		free(ids);
+	}
+
+	return(0);
+}
@@ -0,0 +1,703 @@
+/* > qctcatalog.cpp
+ */
+
+/*
+ * The QCTCatalog class keeps the metadata of many QCT files so a chart
+ * server can start without opening them all, see qctcatalog.h for the
+ * file format.
+ */
+
+/*
+ * Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>  // for strerror
+#include <strings.h> // for strcasecmp
+#include <errno.h>   // for errno
+#include <dirent.h>  // for opendir
+#include <sys/stat.h>
+#include "qct.h"
+#include "qctcatalog.h"
+#include "qctbytes.h"
+
+
+/* -------------------------------------------------------------------------
+ * Entries
+ */
+#define CATALOG_STRINGS 6          // path, title, name, ident, scale, datum
+#define CATALOG_FIXED_SIZE (8+8 + 4*4 + 8*(1+8+4)) // before outline and strings
+
+static void
+entryStrings(QCTCatalogEntry *entry, char **strings[CATALOG_STRINGS])
+{
+	strings[0] = &entry->path;
+	strings[1] = &entry->title;
+	strings[2] = &entry->name;
+	strings[3] = &entry->ident;
+	strings[4] = &entry->scale;
+	strings[5] = &entry->datum;
+}
+
+
+static void
+freeEntry(QCTCatalogEntry *entry)
+{
+	char **strings[CATALOG_STRINGS];
+	int ii;
+
+	entryStrings(entry, strings);
+	for (ii=0; ii<CATALOG_STRINGS; ii++)
+		free(*strings[ii]);
+	free(entry->outline_lat);
+	free(entry->outline_lon);
+	memset(entry, 0, sizeof(QCTCatalogEntry));
+}
+
+
+// Every string and the outline arrays allocated
+static bool
+entryComplete(QCTCatalogEntry *entry)
+{
+	char **strings[CATALOG_STRINGS];
+	int ii;
+
+	entryStrings(entry, strings);
+	for (ii=0; ii<CATALOG_STRINGS; ii++)
+		if (*strings[ii] == NULL)
+			return false;
+	return entry->outline_lat != NULL && entry->outline_lon != NULL;
+}
+
+
+static int
+compareEntries(const void *aa, const void *bb)
+{
+	return strcmp(((const QCTCatalogEntry*)aa)->path, ((const QCTCatalogEntry*)bb)->path);
+}
+
+
+// Growable array of entries
+struct EntryList
+{
+	QCTCatalogEntry *entries;
+	int num, max;
+};
+
+// Room for at least num entries so adding up to that many cannot fail
+static bool
+reserveEntries(EntryList *list, int num)
+{
+	QCTCatalogEntry *entries;
+	int max;
+
+	if (num > list->max)
+	{
+		max = list->max ? list->max : 1024;
+		while (max < num)
+			max *= 2;
+		entries = (QCTCatalogEntry*)realloc(list->entries, max * sizeof(QCTCatalogEntry));
+		if (entries == NULL)
+			return false;
+		list->entries = entries;
+		list->max = max;
+	}
+	return true;
+}
+
+static QCTCatalogEntry *
+addEntry(EntryList *list)
+{
+	if (list->num == list->max && !reserveEntries(list, list->num + 1))
+		return NULL;
+	memset(&list->entries[list->num], 0, sizeof(QCTCatalogEntry));
+	return &list->entries[list->num++];
+}
+
+
+/* -------------------------------------------------------------------------
+ */
+QCTCatalog::QCTCatalog()
+{
+	entries = NULL;
+	num_entries = max_entries = 0;
+	verbose = 0;
+}
+
+
+QCTCatalog::~QCTCatalog()
+{
+	clear();
+}
+
+
+void
+QCTCatalog::clear()
+{
+	int ii;
+
+	for (ii=0; ii<num_entries; ii++)
+		freeEntry(&entries[ii]);
+	free(entries);
+	entries = NULL;
+	num_entries = max_entries = 0;
+}
+
+
+/*
+ * The entry for a file, by its absolute path, or NULL.
+ */
+const QCTCatalogEntry *
+QCTCatalog::findEntry(const char *path) const
+{
+	QCTCatalogEntry key;
+
+	if (num_entries == 0)
+		return NULL;
+	key.path = (char*)path;
+	return (const QCTCatalogEntry*)bsearch(&key, entries, num_entries, sizeof(QCTCatalogEntry), compareEntries);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Read a catalogue file, replacing the current entries.
+ */
+bool
+QCTCatalog::readFilename(const char *filename)
+{
+	FILE *fp;
+	unsigned char *data, *pp, *end;
+	long len;
+	int ii, jj, kk, count;
+	EntryList list = { NULL, 0, 0 };
+	bool ok = true;
+
+	clear();
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "cannot open %s (%s)\n", filename, strerror(errno));
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = (unsigned char*)malloc(len > 0 ? len : 1);
+	if (data == NULL || len < QCT_CATALOG_HEADER_SIZE || fread(data, len, 1, fp) != 1)
+	{
+		fprintf(stderr, "cannot read %s (not a catalogue)\n", filename);
+		free(data);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	count = (int)getLong(data + 12);
+	if (memcmp(data, QCT_CATALOG_MAGIC, 8) != 0 || getLong(data + 8) != QCT_CATALOG_VERSION || count < 0)
+		ok = false;
+
+	pp = data + QCT_CATALOG_HEADER_SIZE;
+	end = data + len;
+	for (ii=0; ii<count && ok; ii++)
+	{
+		QCTCatalogEntry *entry;
+		char **strings[CATALOG_STRINGS];
+		unsigned char *next;
+		unsigned int entry_len;
+
+		if (end - pp < 4 + CATALOG_FIXED_SIZE)
+		{
+			ok = false;
+			break;
+		}
+		entry_len = getLong(pp);
+		next = pp + 4 + entry_len;
+		if (entry_len > (unsigned int)(end - pp - 4) || entry_len < CATALOG_FIXED_SIZE || (entry = addEntry(&list)) == NULL)
+		{
+			ok = false;
+			break;
+		}
+		pp += 4;
+		entry->size  = (long long)getLongLong(pp);
+		entry->mtime = (long long)getLongLong(pp+8);
+		entry->flags = getLong(pp+16);
+		entry->width = getLong(pp+20);
+		entry->height = getLong(pp+24);
+		entry->num_outline = getLong(pp+28);
+		pp += 32;
+		entry->degrees_per_pixel = getDouble(pp);
+		pp += 8;
+		for (kk=0; kk<4; kk++, pp+=16)
+		{
+			entry->corner_lat[kk] = getDouble(pp);
+			entry->corner_lon[kk] = getDouble(pp+8);
+		}
+		entry->lat_min = getDouble(pp);
+		entry->lon_min = getDouble(pp+8);
+		entry->lat_max = getDouble(pp+16);
+		entry->lon_max = getDouble(pp+24);
+		pp += 32;
+
+		if (entry->num_outline < 0 || entry->num_outline > (next - pp) / 16)
+		{
+			ok = false;
+			break;
+		}
+		entry->outline_lat = (double*)malloc((entry->num_outline + 1) * sizeof(double));
+		entry->outline_lon = (double*)malloc((entry->num_outline + 1) * sizeof(double));
+		if (entry->outline_lat == NULL || entry->outline_lon == NULL)
+		{
+			ok = false;
+			break;
+		}
+		for (kk=0; kk<entry->num_outline; kk++, pp+=16)
+		{
+			entry->outline_lat[kk] = getDouble(pp);
+			entry->outline_lon[kk] = getDouble(pp+8);
+		}
+
+		entryStrings(entry, strings);
+		for (jj=0; jj<CATALOG_STRINGS && ok; jj++)
+		{
+			int slen = (next - pp >= 2) ? pp[0] | (pp[1] << 8) : -1;
+			if (slen < 0 || slen > next - pp - 2 || (*strings[jj] = (char*)malloc(slen + 1)) == NULL)
+			{
+				ok = false;
+				break;
+			}
+			memcpy(*strings[jj], pp + 2, slen);
+			(*strings[jj])[slen] = '\0';
+			pp += 2 + slen;
+		}
+		pp = next;
+	}
+	free(data);
+
+	if (!ok)
+	{
+		fprintf(stderr, "cannot read %s (not a catalogue)\n", filename);
+		for (ii=0; ii<list.num; ii++)
+			freeEntry(&list.entries[ii]);
+		free(list.entries);
+		return false;
+	}
+	// Written in order, but cheap to make sure
+	qsort(list.entries, list.num, sizeof(QCTCatalogEntry), compareEntries);
+	entries = list.entries;
+	num_entries = list.num;
+	max_entries = list.max;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Write the catalogue to a temporary file which then replaces filename,
+ * so a server starting at the same time never sees half a catalogue.
+ */
+bool
+QCTCatalog::writeFilename(const char *filename)
+{
+	FILE *fp;
+	unsigned char header[QCT_CATALOG_HEADER_SIZE];
+	unsigned char *buf = NULL, *pp;
+	size_t buf_size = 0, entry_len;
+	char *tmpname;
+	int ii, jj, kk;
+	bool ok = true;
+
+	tmpname = (char*)malloc(strlen(filename) + 5);
+	if (tmpname == NULL)
+		return false;
+	sprintf(tmpname, "%s.tmp", filename);
+	fp = fopen(tmpname, "wb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "cannot create %s (%s)\n", tmpname, strerror(errno));
+		free(tmpname);
+		return false;
+	}
+
+	memcpy(header, QCT_CATALOG_MAGIC, 8);
+	putLong(header+8, QCT_CATALOG_VERSION);
+	putLong(header+12, num_entries);
+	fwrite(header, sizeof(header), 1, fp);
+
+	for (ii=0; ii<num_entries && ok; ii++)
+	{
+		QCTCatalogEntry *entry = &entries[ii];
+		char **strings[CATALOG_STRINGS];
+		size_t slen[CATALOG_STRINGS];
+
+		entryStrings(entry, strings);
+		entry_len = CATALOG_FIXED_SIZE + (size_t)entry->num_outline * 16;
+		for (jj=0; jj<CATALOG_STRINGS; jj++)
+		{
+			slen[jj] = strlen(*strings[jj]);
+			if (slen[jj] > 65535)
+				slen[jj] = 65535;
+			entry_len += 2 + slen[jj];
+		}
+		if (4 + entry_len > buf_size)
+		{
+			free(buf);
+			buf_size = 4 + entry_len;
+			buf = (unsigned char*)malloc(buf_size);
+			if (buf == NULL)
+			{
+				ok = false;
+				break;
+			}
+		}
+
+		pp = buf;
+		putLong(pp, (unsigned int)entry_len);
+		putLongLong(pp+4, entry->size);
+		putLongLong(pp+12, entry->mtime);
+		putLong(pp+20, entry->flags);
+		putLong(pp+24, entry->width);
+		putLong(pp+28, entry->height);
+		putLong(pp+32, entry->num_outline);
+		pp += 36;
+		putDouble(pp, entry->degrees_per_pixel);
+		pp += 8;
+		for (kk=0; kk<4; kk++, pp+=16)
+		{
+			putDouble(pp, entry->corner_lat[kk]);
+			putDouble(pp+8, entry->corner_lon[kk]);
+		}
+		putDouble(pp, entry->lat_min);
+		putDouble(pp+8, entry->lon_min);
+		putDouble(pp+16, entry->lat_max);
+		putDouble(pp+24, entry->lon_max);
+		pp += 32;
+		for (kk=0; kk<entry->num_outline; kk++, pp+=16)
+		{
+			putDouble(pp, entry->outline_lat[kk]);
+			putDouble(pp+8, entry->outline_lon[kk]);
+		}
+		for (jj=0; jj<CATALOG_STRINGS; jj++)
+		{
+			pp[0] = slen[jj] & 255;
+			pp[1] = slen[jj] >> 8;
+			memcpy(pp + 2, *strings[jj], slen[jj]);
+			pp += 2 + slen[jj];
+		}
+		if (fwrite(buf, 4 + entry_len, 1, fp) != 1)
+			ok = false;
+	}
+	free(buf);
+
+	if (fclose(fp) != 0 || !ok)
+	{
+		fprintf(stderr, "cannot write %s (%s)\n", tmpname, strerror(errno));
+		remove(tmpname);
+		free(tmpname);
+		return false;
+	}
+	if (rename(tmpname, filename) != 0)
+	{
+		fprintf(stderr, "cannot rename %s to %s (%s)\n", tmpname, filename, strerror(errno));
+		remove(tmpname);
+		ok = false;
+	}
+	free(tmpname);
+	return ok;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Add every .qct file below directory to list, with its size and time.
+ * Symbolic links are followed, but each directory (by device and inode)
+ * is only read once so a link back up the tree is not a loop.
+ */
+struct DirId
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+struct DirList
+{
+	DirId *dirs;
+	int num, max;
+};
+
+// 1 the first time a directory is seen, 0 after that, -1 if out of memory
+static int
+visitDirectory(DirList *visited, const struct stat *st)
+{
+	int ii;
+
+	for (ii=0; ii<visited->num; ii++)
+	{
+		if (visited->dirs[ii].dev == st->st_dev && visited->dirs[ii].ino == st->st_ino)
+			return 0;
+	}
+	if (visited->num == visited->max)
+	{
+		int max = visited->max ? visited->max * 2 : 64;
+		DirId *dirs = (DirId*)realloc(visited->dirs, max * sizeof(DirId));
+		if (dirs == NULL)
+			return -1;
+		visited->dirs = dirs;
+		visited->max = max;
+	}
+	visited->dirs[visited->num].dev = st->st_dev;
+	visited->dirs[visited->num].ino = st->st_ino;
+	visited->num++;
+	return 1;
+}
+
+static bool
+findFiles(const char *directory, EntryList *list, DirList *visited)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	size_t dlen = strlen(directory), flen;
+	bool ok = true;
+
+	// Already read by another name
+	if (stat(directory, &st) == 0)
+	{
+		int seen = visitDirectory(visited, &st);
+		if (seen <= 0)
+			return (seen == 0);
+	}
+
+	dir = opendir(directory);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "cannot open directory %s (%s)\n", directory, strerror(errno));
+		return false;
+	}
+	while (ok && (de = readdir(dir)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		flen = strlen(de->d_name);
+		path = (char*)malloc(dlen + flen + 2);
+		if (path == NULL)
+		{
+			ok = false;
+			break;
+		}
+		sprintf(path, "%s%s%s", directory, (directory[dlen-1] == '/') ? "" : "/", de->d_name);
+		if (stat(path, &st) != 0)
+		{
+			free(path);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+		{
+			// A directory which can't be read is not fatal
+			findFiles(path, list, visited);
+			free(path);
+		}
+		else if (S_ISREG(st.st_mode) && flen > 4 && strcasecmp(de->d_name + flen - 4, ".qct") == 0)
+		{
+			QCTCatalogEntry *entry = addEntry(list);
+			if (entry == NULL)
+			{
+				free(path);
+				ok = false;
+				break;
+			}
+			entry->path = path;
+			entry->size = st.st_size;
+			entry->mtime = st.st_mtime;
+		}
+		else
+			free(path);
+	}
+	closedir(dir);
+	return ok;
+}
+
+
+/*
+ * Open the file of an entry, reading only its header, and fill in the
+ * rest of the entry.  Runs in several threads at once, each with its own
+ * QCT object.
+ */
+struct ReadEntryJob
+{
+	QCTCatalogEntry *entries;
+	int *todo;                 // indexes of the entries to read
+};
+
+static char *
+copyString(const char *str)
+{
+	return strdup(str ? str : "");
+}
+
+static void
+readEntryJob(void *arg, int ii)
+{
+	ReadEntryJob *job = (ReadEntryJob*)arg;
+	QCTCatalogEntry *entry = &job->entries[job->todo[ii]];
+	QCT qct;
+	int kk, full_width, full_height;
+
+	entry->flags = 0;
+	if (!qct.openFilename(entry->path, true))
+	{
+		entry->flags |= QCT_CATALOG_INVALID;
+		entry->title = copyString(NULL);
+		entry->name = copyString(NULL);
+		entry->ident = copyString(NULL);
+		entry->scale = copyString(NULL);
+		entry->datum = copyString(NULL);
+		entry->outline_lat = (double*)malloc(sizeof(double));
+		entry->outline_lon = (double*)malloc(sizeof(double));
+		return;
+	}
+	entry->title = copyString(qct.getTitle());
+	entry->name = copyString(qct.getName());
+	entry->ident = copyString(qct.getIdentifier());
+	entry->scale = copyString(qct.getScale());
+	entry->datum = copyString(qct.getDatum());
+	full_width = qct.getImageWidth();
+	full_height = qct.getImageHeight();
+	entry->width = full_width / QCT_TILE_SIZE;
+	entry->height = full_height / QCT_TILE_SIZE;
+	entry->degrees_per_pixel = qct.getDegreesPerPixel();
+	qct.xy_to_latlon(0, 0, &entry->corner_lat[0], &entry->corner_lon[0]);
+	qct.xy_to_latlon(full_width-1, 0, &entry->corner_lat[1], &entry->corner_lon[1]);
+	qct.xy_to_latlon(0, full_height-1, &entry->corner_lat[2], &entry->corner_lon[2]);
+	qct.xy_to_latlon(full_width-1, full_height-1, &entry->corner_lat[3], &entry->corner_lon[3]);
+
+	entry->num_outline = qct.getOutlineSize();
+	entry->outline_lat = (double*)malloc((entry->num_outline + 1) * sizeof(double));
+	entry->outline_lon = (double*)malloc((entry->num_outline + 1) * sizeof(double));
+	if (entry->outline_lat == NULL || entry->outline_lon == NULL)
+	{
+		entry->num_outline = 0;
+		return;
+	}
+	qct.getOutlinePoints(entry->outline_lat, entry->outline_lon);
+	entry->lat_min = entry->lon_min = 999;
+	entry->lat_max = entry->lon_max = -999;
+	for (kk=0; kk<entry->num_outline; kk++)
+	{
+		if (entry->outline_lat[kk] < entry->lat_min) entry->lat_min = entry->outline_lat[kk];
+		if (entry->outline_lat[kk] > entry->lat_max) entry->lat_max = entry->outline_lat[kk];
+		if (entry->outline_lon[kk] < entry->lon_min) entry->lon_min = entry->outline_lon[kk];
+		if (entry->outline_lon[kk] > entry->lon_max) entry->lon_max = entry->outline_lon[kk];
+	}
+	// Without an outline the corners give the extent
+	for (kk=0; kk<4 && entry->num_outline==0; kk++)
+	{
+		if (entry->corner_lat[kk] < entry->lat_min) entry->lat_min = entry->corner_lat[kk];
+		if (entry->corner_lat[kk] > entry->lat_max) entry->lat_max = entry->corner_lat[kk];
+		if (entry->corner_lon[kk] < entry->lon_min) entry->lon_min = entry->corner_lon[kk];
+		if (entry->corner_lon[kk] > entry->lon_max) entry->lon_max = entry->corner_lon[kk];
+	}
+}
+
+
+/* -------------------------------------------------------------------------
+ * Bring the entries for the files below directory up to date, reading
+ * the headers of new and changed files in up to nthreads threads (0 for
+ * one per processor).  Entries for other directories are kept.  Paths
+ * are absolute, with symbolic links in directory resolved, so a library
+ * is found by the same paths whichever way it is named.
+ */
+int
+QCTCatalog::scan(const char *directory, int nthreads)
+{
+	EntryList list = { NULL, 0, 0 };
+	DirList visited = { NULL, 0, 0 };
+	ReadEntryJob job;
+	char *dir;
+	size_t dlen;
+	int ii, jj, num_found, num_todo = 0;
+	bool ok, *taken;
+
+	// The same file is always found by the same path
+	dir = realpath(directory, NULL);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "cannot open directory %s (%s)\n", directory, strerror(errno));
+		return -1;
+	}
+	dlen = strlen(dir);
+
+	ok = findFiles(dir, &list, &visited);
+	free(visited.dirs);
+	num_found = list.num;
+	job.todo = (int*)malloc((list.num + 1) * sizeof(int));
+	taken = (bool*)calloc(num_entries + 1, sizeof(bool));
+	// The entries kept from elsewhere are added below, which must not fail
+	if (!ok || job.todo == NULL || taken == NULL || !reserveEntries(&list, list.num + num_entries))
+	{
+		if (ok)
+			fprintf(stderr, "cannot scan %s (out of memory)\n", dir);
+		for (ii=0; ii<list.num; ii++)
+			freeEntry(&list.entries[ii]);
+		free(list.entries);
+		free(job.todo);
+		free(taken);
+		free(dir);
+		return -1;
+	}
+
+	// Unchanged files keep their entries
+	for (ii=0; ii<list.num; ii++)
+	{
+		const QCTCatalogEntry *old = findEntry(list.entries[ii].path);
+		if (old && old->size == list.entries[ii].size && old->mtime == list.entries[ii].mtime)
+		{
+			free(list.entries[ii].path);
+			list.entries[ii] = *old;
+			taken[old - entries] = true;
+		}
+		else
+			job.todo[num_todo++] = ii;
+	}
+
+	// Entries from elsewhere are kept, the rest are gone or replaced
+	for (ii=0; ii<num_entries; ii++)
+	{
+		QCTCatalogEntry *entry = &entries[ii];
+		if (taken[ii])
+			continue;
+		if (!(strncmp(entry->path, dir, dlen) == 0 && (entry->path[dlen] == '/' || dir[dlen-1] == '/')))
+		{
+			*addEntry(&list) = *entry;
+			continue;
+		}
+		freeEntry(entry);
+	}
+	free(entries);
+	free(taken);
+
+	if (verbose)
+		printf("%d charts in %s, %d to read\n", num_found, dir, num_todo);
+	job.entries = list.entries;
+	parallelFor(num_todo, nthreads, readEntryJob, &job);
+
+	// Entries that could not be completed are dropped, to be read next time
+	for (ii=jj=0; ii<list.num; ii++)
+	{
+		if (!entryComplete(&list.entries[ii]))
+		{
+			fprintf(stderr, "cannot read %s (out of memory)\n", list.entries[ii].path);
+			freeEntry(&list.entries[ii]);
+			continue;
+		}
+		list.entries[jj++] = list.entries[ii];
+	}
+	list.num = jj;
+
+	qsort(list.entries, list.num, sizeof(QCTCatalogEntry), compareEntries);
+	entries = list.entries;
+	num_entries = list.num;
+	max_entries = list.max;
+	free(job.todo);
+	free(dir);
+	return num_todo;
+}
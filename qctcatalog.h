@@ -0,0 +1,84 @@
+/* > qctcatalog.h
+ */
+
+
+#ifndef QCTCATALOG_H
+#define QCTCATALOG_H
+
+
+/* -------------------------------------------------------------------------
+ * Catalogue file as written by QCTCatalog::writeFilename.
+ * All values are little-endian.
+ *   Header: "QCTCATLG", version (4 bytes), number of entries (4 bytes)
+ *   Entries, sorted by path, each:
+ *     length of the rest of the entry (4 bytes)
+ *     file size, modification time (8 bytes each)
+ *     flags, width, height (tiles), outline points (4 bytes each)
+ *     degrees per pixel, corner latitude,longitude for top left, top
+ *     right, bottom left, bottom right, outline extent latitude min,
+ *     longitude min, latitude max, longitude max, then latitude,longitude
+ *     of each outline point (IEEE doubles)
+ *     path, title, name, identifier, scale, datum each as a length
+ *     (2 bytes) followed by that many bytes
+ */
+#define QCT_CATALOG_MAGIC       "QCTCATLG"
+#define QCT_CATALOG_VERSION     1
+#define QCT_CATALOG_HEADER_SIZE 16
+// Entry flags
+#define QCT_CATALOG_INVALID 1   // the file could not be read as a QCT map
+
+
+/* -------------------------------------------------------------------------
+ * Metadata of one chart.  Strings are never NULL.
+ */
+struct QCTCatalogEntry
+{
+	char *path;                // absolute
+	long long size, mtime;     // of the file when it was read
+	int  flags;                // QCT_CATALOG_ flags
+	char *title, *name, *ident, *scale, *datum;
+	int  width, height;        // size in tiles
+	double degrees_per_pixel;  // as QCT::getDegreesPerPixel at full size
+	double corner_lat[4], corner_lon[4]; // top left, top right, bottom left, bottom right
+	double lat_min, lon_min, lat_max, lon_max; // outline extent
+	int  num_outline;
+	double *outline_lat, *outline_lon;
+};
+
+
+/* -------------------------------------------------------------------------
+ * Class to keep the metadata of a library of charts.
+ *
+ * Call readFilename to load a catalogue saved before (if there is one),
+ * scan each directory of charts and writeFilename to save it again.
+ * Only files which are new, or whose size or modification time have
+ * changed, are opened by scan, with only their headers read, several at
+ * a time; files no longer there are dropped.
+ */
+class QCTCatalog
+{
+public:
+	QCTCatalog();
+	~QCTCatalog();
+
+public:
+	bool readFilename(const char *filename);
+	bool writeFilename(const char *filename);
+	// Returns the number of files read, or -1
+	int  scan(const char *directory, int nthreads = 0);
+	void clear();
+	void setVerbose(int v) { verbose = v; }
+
+	int  getNumEntries() const { return num_entries; }
+	const QCTCatalogEntry *getEntry(int index) const
+		{ return (index >= 0 && index < num_entries) ? &entries[index] : NULL; }
+	const QCTCatalogEntry *findEntry(const char *path) const;
+
+private:
+	QCTCatalogEntry *entries;  // sorted by path
+	int num_entries, max_entries;
+	int verbose;
+};
+
+
+#endif // !QCTCATALOG_H
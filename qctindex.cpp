@@ -0,0 +1,547 @@
+/* > qctindex.cpp
+ */
+
+/*
+ * The QCTIndex class finds the charts covering a position or area
+ * among many, see qctindex.h.
+ */
+
+/*
+ * Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>    // for sqrt
+#include "qct.h"
+#include "qctcatalog.h"
+#include "qctindex.h"
+
+
+/* -------------------------------------------------------------------------
+ * Charts, tree nodes and query results.  Boxes are latitude min,
+ * longitude min, latitude max, longitude max.
+ */
+struct IndexChart
+{
+	char *path, *scale;
+	double degrees_per_pixel;
+	double scale_number;       // n of 1:n, or 0 if not known
+	double box[4];
+	int num_outline;
+	double *lat, *lon;
+};
+
+struct IndexNode
+{
+	double box[4];
+	int first, count;          // in children
+	bool leaf;                 // children are charts not nodes
+};
+
+struct IndexHit
+{
+	double key;
+	int id;
+};
+
+
+static bool
+boxesOverlap(const double *aa, const double *bb)
+{
+	return aa[0] <= bb[2] && bb[0] <= aa[2] && aa[1] <= bb[3] && bb[1] <= aa[3];
+}
+
+
+// Even-odd rule, as inpoly but in floating point
+static bool
+insideOutline(const IndexChart *chart, double lat, double lon)
+{
+	const double *la = chart->lat, *lo = chart->lon;
+	int ii, jj, nn = chart->num_outline;
+	bool inside = false;
+
+	for (ii=0, jj=nn-1; ii<nn; jj=ii++)
+	{
+		if ((la[ii] > lat) != (la[jj] > lat) &&
+			lon < lo[ii] + (lo[jj] - lo[ii]) * (lat - la[ii]) / (la[jj] - la[ii]))
+			inside = !inside;
+	}
+	return inside;
+}
+
+
+/*
+ * True if the outline and the box share any point: a corner of the box is
+ * inside the outline or an edge of the outline passes through the box
+ * (which includes an outline wholly inside it).  Edges are clipped to the
+ * box by Liang-Barsky.
+ */
+static bool
+outlineOverlapsBox(const IndexChart *chart, const double *box)
+{
+	const double *la = chart->lat, *lo = chart->lon;
+	int ii, jj, kk, nn = chart->num_outline;
+
+	if (insideOutline(chart, box[0], box[1]) || insideOutline(chart, box[0], box[3]) ||
+		insideOutline(chart, box[2], box[1]) || insideOutline(chart, box[2], box[3]))
+		return true;
+
+	for (ii=0, jj=nn-1; ii<nn; jj=ii++)
+	{
+		double d_lat = la[ii] - la[jj], d_lon = lo[ii] - lo[jj];
+		double pp[4] = { -d_lat, -d_lon, d_lat, d_lon };
+		double qq[4] = { la[jj] - box[0], lo[jj] - box[1], box[2] - la[jj], box[3] - lo[jj] };
+		double t0 = 0, t1 = 1, tt;
+
+		for (kk=0; kk<4; kk++)
+		{
+			if (pp[kk] == 0)
+			{
+				if (qq[kk] < 0)
+					break;
+				continue;
+			}
+			tt = qq[kk] / pp[kk];
+			if (pp[kk] < 0 && tt > t0) t0 = tt;
+			if (pp[kk] > 0 && tt < t1) t1 = tt;
+			if (t0 > t1)
+				break;
+		}
+		if (kk == 4)
+			return true;
+	}
+	return false;
+}
+
+
+// The n of a scale written 1:n (with or without separators in n)
+static double
+scaleNumber(const char *scale)
+{
+	const char *pp = scale ? strchr(scale, ':') : NULL;
+	double nn = 0;
+
+	if (pp == NULL)
+		return 0;
+	for (pp++; *pp; pp++)
+	{
+		if (*pp >= '0' && *pp <= '9')
+			nn = nn * 10 + (*pp - '0');
+		else if (*pp != ',' && *pp != ' ' && *pp != '.')
+			break;
+	}
+	return nn;
+}
+
+
+static int
+compareHits(const void *aa, const void *bb)
+{
+	const IndexHit *ha = (const IndexHit*)aa, *hb = (const IndexHit*)bb;
+
+	if (ha->key != hb->key)
+		return (ha->key < hb->key) ? -1 : 1;
+	return ha->id - hb->id;
+}
+
+
+/* -------------------------------------------------------------------------
+ */
+QCTIndex::QCTIndex()
+{
+	charts = NULL;
+	num_charts = max_charts = 0;
+	nodes = NULL;
+	children = NULL;
+	num_nodes = 0;
+	built = false;
+	sort_order = QCT_INDEX_SORT_NONE;
+}
+
+
+QCTIndex::~QCTIndex()
+{
+	clear();
+}
+
+
+void
+QCTIndex::clear()
+{
+	int ii;
+
+	for (ii=0; ii<num_charts; ii++)
+	{
+		free(charts[ii].path);
+		free(charts[ii].scale);
+		free(charts[ii].lat);
+		free(charts[ii].lon);
+	}
+	free(charts);
+	charts = NULL;
+	num_charts = max_charts = 0;
+	free(nodes);
+	free(children);
+	nodes = NULL;
+	children = NULL;
+	num_nodes = 0;
+	built = false;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Add a chart given its outline of num_outline points (at least three).
+ */
+int
+QCTIndex::addChart(const char *path, const char *scale, double degrees_per_pixel,
+	int num_outline, const double *lat, const double *lon)
+{
+	IndexChart *chart;
+	int ii;
+
+	if (num_outline < 3)
+		return -1;
+	if (num_charts == max_charts)
+	{
+		int max = max_charts ? max_charts * 2 : 256;
+		chart = (IndexChart*)realloc(charts, max * sizeof(IndexChart));
+		if (chart == NULL)
+			return -1;
+		charts = chart;
+		max_charts = max;
+	}
+	chart = &charts[num_charts];
+	chart->path = strdup(path ? path : "");
+	chart->scale = strdup(scale ? scale : "");
+	chart->lat = (double*)malloc(num_outline * sizeof(double));
+	chart->lon = (double*)malloc(num_outline * sizeof(double));
+	if (chart->path == NULL || chart->scale == NULL || chart->lat == NULL || chart->lon == NULL)
+	{
+		free(chart->path);
+		free(chart->scale);
+		free(chart->lat);
+		free(chart->lon);
+		return -1;
+	}
+	chart->degrees_per_pixel = degrees_per_pixel;
+	chart->scale_number = scaleNumber(scale);
+	chart->num_outline = num_outline;
+	memcpy(chart->lat, lat, num_outline * sizeof(double));
+	memcpy(chart->lon, lon, num_outline * sizeof(double));
+	chart->box[0] = chart->box[2] = lat[0];
+	chart->box[1] = chart->box[3] = lon[0];
+	for (ii=1; ii<num_outline; ii++)
+	{
+		if (lat[ii] < chart->box[0]) chart->box[0] = lat[ii];
+		if (lon[ii] < chart->box[1]) chart->box[1] = lon[ii];
+		if (lat[ii] > chart->box[2]) chart->box[2] = lat[ii];
+		if (lon[ii] > chart->box[3]) chart->box[3] = lon[ii];
+	}
+	built = false;
+	return num_charts++;
+}
+
+
+/*
+ * Add a chart which has been opened (only the header is needed), using
+ * the corners of the image if it has no outline.
+ */
+int
+QCTIndex::addQCT(QCT *qct, const char *path)
+{
+	double *lat, *lon, corner_lat[4], corner_lon[4];
+	int id, num = qct->getOutlineSize();
+
+	if (num < 3)
+	{
+		int ww = qct->getImageWidth() - 1, hh = qct->getImageHeight() - 1;
+		qct->xy_to_latlon(0, 0, &corner_lat[0], &corner_lon[0]);
+		qct->xy_to_latlon(ww, 0, &corner_lat[1], &corner_lon[1]);
+		qct->xy_to_latlon(ww, hh, &corner_lat[2], &corner_lon[2]);
+		qct->xy_to_latlon(0, hh, &corner_lat[3], &corner_lon[3]);
+		return addChart(path, qct->getScale(), qct->getDegreesPerPixel(), 4, corner_lat, corner_lon);
+	}
+	lat = (double*)malloc(num * 2 * sizeof(double));
+	if (lat == NULL)
+		return -1;
+	lon = lat + num;
+	qct->getOutlinePoints(lat, lon);
+	id = addChart(path, qct->getScale(), qct->getDegreesPerPixel(), num, lat, lon);
+	free(lat);
+	return id;
+}
+
+
+int
+QCTIndex::addCatalog(const QCTCatalog *catalog)
+{
+	int ii, num_added = 0;
+
+	for (ii=0; ii<catalog->getNumEntries(); ii++)
+	{
+		const QCTCatalogEntry *entry = catalog->getEntry(ii);
+		int id;
+		if (entry->flags & QCT_CATALOG_INVALID)
+			continue;
+		if (entry->num_outline >= 3)
+			id = addChart(entry->path, entry->scale, entry->degrees_per_pixel,
+				entry->num_outline, entry->outline_lat, entry->outline_lon);
+		else
+		{
+			// Corners in order round the image
+			double lat[4] = { entry->corner_lat[0], entry->corner_lat[1], entry->corner_lat[3], entry->corner_lat[2] };
+			double lon[4] = { entry->corner_lon[0], entry->corner_lon[1], entry->corner_lon[3], entry->corner_lon[2] };
+			id = addChart(entry->path, entry->scale, entry->degrees_per_pixel, 4, lat, lon);
+		}
+		if (id >= 0)
+			num_added++;
+	}
+	return num_added;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Pack the tree one level at a time from the charts up.  Sort-tile-
+ * recursive: the boxes are sorted by longitude and cut into vertical
+ * slices of about sqrt(nodes) nodes each, then each slice is sorted by
+ * latitude and cut into nodes.
+ */
+struct SortItem
+{
+	double x, y;               // centre of the box
+	int item;
+};
+
+static int
+compareX(const void *aa, const void *bb)
+{
+	double xa = ((const SortItem*)aa)->x, xb = ((const SortItem*)bb)->x;
+	return (xa < xb) ? -1 : (xa > xb) ? 1 : 0;
+}
+
+static int
+compareY(const void *aa, const void *bb)
+{
+	double ya = ((const SortItem*)aa)->y, yb = ((const SortItem*)bb)->y;
+	return (ya < yb) ? -1 : (ya > yb) ? 1 : 0;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Pack the charts added so far into the tree which queries search.
+ */
+bool
+QCTIndex::build()
+{
+	SortItem *items;
+	int ii, jj, kk, count, max_nodes, num_children = 0, level_first;
+	bool leaf = true;
+
+	free(nodes);
+	free(children);
+	nodes = NULL;
+	children = NULL;
+	num_nodes = 0;
+	if (num_charts == 0)
+	{
+		built = true;
+		return true;
+	}
+
+	// Every node but the last of each level is full
+	max_nodes = 0;
+	for (count=num_charts; count>1; count=(count+QCT_INDEX_NODE_SIZE-1)/QCT_INDEX_NODE_SIZE)
+		max_nodes += (count + QCT_INDEX_NODE_SIZE - 1) / QCT_INDEX_NODE_SIZE;
+	if (max_nodes == 0)
+		max_nodes = 1;
+	nodes = (IndexNode*)malloc(max_nodes * sizeof(IndexNode));
+	children = (int*)malloc((num_charts + max_nodes) * sizeof(int));
+	items = (SortItem*)malloc(num_charts * sizeof(SortItem));
+	if (nodes == NULL || children == NULL || items == NULL)
+	{
+		free(items);
+		free(nodes);
+		free(children);
+		nodes = NULL;
+		children = NULL;
+		return false;
+	}
+
+	for (ii=0; ii<num_charts; ii++)
+		items[ii].item = ii;
+	count = num_charts;
+	do
+	{
+		int num_groups = (count + QCT_INDEX_NODE_SIZE - 1) / QCT_INDEX_NODE_SIZE;
+		int slice = (int)ceil(sqrt((double)num_groups)) * QCT_INDEX_NODE_SIZE;
+
+		for (ii=0; ii<count; ii++)
+		{
+			const double *box = leaf ? charts[items[ii].item].box : nodes[items[ii].item].box;
+			items[ii].x = (box[1] + box[3]) / 2;
+			items[ii].y = (box[0] + box[2]) / 2;
+		}
+		qsort(items, count, sizeof(SortItem), compareX);
+		for (ii=0; ii<count; ii+=slice)
+			qsort(items + ii, (count - ii < slice) ? count - ii : slice, sizeof(SortItem), compareY);
+
+		level_first = num_nodes;
+		for (ii=0; ii<count; ii+=slice)
+		{
+			int slice_end = (count - ii < slice) ? count : ii + slice;
+			for (jj=ii; jj<slice_end; jj+=QCT_INDEX_NODE_SIZE)
+			{
+				IndexNode *node = &nodes[num_nodes++];
+				node->first = num_children;
+				node->count = (slice_end - jj < QCT_INDEX_NODE_SIZE) ? slice_end - jj : QCT_INDEX_NODE_SIZE;
+				node->leaf = leaf;
+				for (kk=0; kk<node->count; kk++)
+				{
+					int child = items[jj+kk].item;
+					const double *box = leaf ? charts[child].box : nodes[child].box;
+					children[num_children++] = child;
+					if (kk == 0)
+						memcpy(node->box, box, sizeof(node->box));
+					else
+					{
+						if (box[0] < node->box[0]) node->box[0] = box[0];
+						if (box[1] < node->box[1]) node->box[1] = box[1];
+						if (box[2] > node->box[2]) node->box[2] = box[2];
+						if (box[3] > node->box[3]) node->box[3] = box[3];
+					}
+				}
+			}
+		}
+
+		// The nodes just made are the items of the next level
+		count = num_nodes - level_first;
+		for (ii=0; ii<count; ii++)
+			items[ii].item = level_first + ii;
+		leaf = false;
+	} while (count > 1);
+
+	free(items);
+	built = true;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Charts overlapping the box, or containing the point if there is one,
+ * sorted, with the number found returned.
+ */
+int
+QCTIndex::search(const double *box, const double *point, int *ids, int max_ids) const
+{
+	int stack[64 * QCT_INDEX_NODE_SIZE];
+	IndexHit *hits = NULL;
+	int ii, num_hits = 0, max_hits = 0, depth = 0;
+
+	if (!built)
+		return -1;
+	if (num_nodes == 0)
+		return 0;
+
+	// Root is the last node made
+	stack[depth++] = num_nodes - 1;
+	while (depth > 0)
+	{
+		IndexNode *node = &nodes[stack[--depth]];
+		if (!boxesOverlap(node->box, box))
+			continue;
+		for (ii=0; ii<node->count; ii++)
+		{
+			int child = children[node->first + ii];
+			if (!node->leaf)
+			{
+				stack[depth++] = child;
+				continue;
+			}
+			IndexChart *chart = &charts[child];
+			if (!boxesOverlap(chart->box, box))
+				continue;
+			if (point ? !insideOutline(chart, point[0], point[1]) : !outlineOverlapsBox(chart, box))
+				continue;
+			if (num_hits == max_hits)
+			{
+				int max = max_hits ? max_hits * 2 : 64;
+				IndexHit *more = (IndexHit*)realloc(hits, max * sizeof(IndexHit));
+				if (more == NULL)
+				{
+					free(hits);
+					return -1;
+				}
+				hits = more;
+				max_hits = max;
+			}
+			hits[num_hits].id = child;
+			hits[num_hits].key = (sort_order == QCT_INDEX_SORT_DPP) ? chart->degrees_per_pixel :
+				(sort_order == QCT_INDEX_SORT_SCALE) ? (chart->scale_number > 0 ? chart->scale_number : HUGE_VAL) : 0;
+			num_hits++;
+		}
+	}
+
+	if (num_hits > 1)
+		qsort(hits, num_hits, sizeof(IndexHit), compareHits);
+	for (ii=0; ii<num_hits && ii<max_ids; ii++)
+		ids[ii] = hits[ii].id;
+	free(hits);
+	return num_hits;
+}
+
+
+int
+QCTIndex::findPoint(double lat, double lon, int *ids, int max_ids) const
+{
+	double point[2] = { lat, lon };
+	double box[4] = { lat, lon, lat, lon };
+
+	return search(box, point, ids, max_ids);
+}
+
+
+int
+QCTIndex::findBox(double lat_min, double lon_min, double lat_max, double lon_max, int *ids, int max_ids) const
+{
+	double box[4] = { lat_min, lon_min, lat_max, lon_max };
+
+	return search(box, NULL, ids, max_ids);
+}
+
+
+/* -------------------------------------------------------------------------
+ */
+const char *
+QCTIndex::getPath(int id) const
+{
+	return (id >= 0 && id < num_charts) ? charts[id].path : NULL;
+}
+
+
+const char *
+QCTIndex::getScale(int id) const
+{
+	return (id >= 0 && id < num_charts) ? charts[id].scale : NULL;
+}
+
+
+double
+QCTIndex::getDegreesPerPixel(int id) const
+{
+	return (id >= 0 && id < num_charts) ? charts[id].degrees_per_pixel : 0;
+}
+
+
+bool
+QCTIndex::getExtent(int id, double *lat_min, double *lon_min, double *lat_max, double *lon_max) const
+{
+	if (id < 0 || id >= num_charts)
+		return false;
+	*lat_min = charts[id].box[0];
+	*lon_min = charts[id].box[1];
+	*lat_max = charts[id].box[2];
+	*lon_max = charts[id].box[3];
+	return true;
+}
@@ -0,0 +1,78 @@
+/* > qctindex.h
+ */
+
+
+#ifndef QCTINDEX_H
+#define QCTINDEX_H
+
+
+class QCT;
+class QCTCatalog;
+
+// Order of the charts found by QCTIndex queries
+#define QCT_INDEX_SORT_NONE   0 // as added
+#define QCT_INDEX_SORT_DPP    1 // fewest degrees per pixel (most detail) first
+#define QCT_INDEX_SORT_SCALE  2 // largest scale (1:n with the smallest n) first
+#define QCT_INDEX_NODE_SIZE   16 // children of each tree node
+
+
+/* -------------------------------------------------------------------------
+ * Class to find which of many charts cover a position or area.
+ *
+ * Add charts from a catalogue (without opening the files), from QCT
+ * objects, or by giving their outlines, then call build() to pack the
+ * outline extents into an R-tree (sort-tile-recursive, so every node is
+ * full) which is searched in logarithmic time; the outlines of the
+ * charts found are then checked exactly.  Adding another chart or
+ * clearing the index means it must be built again before the next query,
+ * which fails until it is.  Queries only read the tree so can be made
+ * from several threads at once, but not while the index is changed.
+ * Latitude and longitude are in degrees WGS84, and outlines must not
+ * cross the 180 degree meridian.
+ */
+class QCTIndex
+{
+public:
+	QCTIndex();
+	~QCTIndex();
+
+public:
+	// Each returns the id of the chart (ids count up from 0) or -1
+	int  addChart(const char *path, const char *scale, double degrees_per_pixel,
+	              int num_outline, const double *lat, const double *lon);
+	int  addQCT(QCT *qct, const char *path);
+	// The readable charts in the catalogue, returns how many were added
+	int  addCatalog(const QCTCatalog *catalog);
+	void clear();
+	void setSort(int order) { sort_order = order; }
+	// After adding the charts, before any query
+	bool build();
+	bool isBuilt() const { return built; }
+
+	// Fill ids (up to max_ids) with the charts whose outline contains the
+	// point, or overlaps the box, and return how many there are in all,
+	// or -1 if the index has not been built
+	int  findPoint(double lat, double lon, int *ids, int max_ids) const;
+	int  findBox(double lat_min, double lon_min, double lat_max, double lon_max, int *ids, int max_ids) const;
+
+	int  getNumCharts() const { return num_charts; }
+	const char *getPath(int id) const;
+	const char *getScale(int id) const;
+	double getDegreesPerPixel(int id) const;
+	bool getExtent(int id, double *lat_min, double *lon_min, double *lat_max, double *lon_max) const;
+
+private:
+	int  search(const double *box, const double *point, int *ids, int max_ids) const;
+
+private:
+	struct IndexChart *charts;
+	int num_charts, max_charts;
+	struct IndexNode *nodes;   // leaves first, root last
+	int *children;             // chart ids for leaves, else node indexes
+	int num_nodes;
+	bool built;
+	int sort_order;
+};
+
+
+#endif // !QCTINDEX_H
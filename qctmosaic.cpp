@@ -0,0 +1,548 @@
+/* > qctmosaic.cpp
+ */
+
+/*
+ * The QCTMosaic class renders one image from several adjacent or
+ * overlapping charts, see qctmosaic.h.
+ */
+
+/*
+ * Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>  // for strerror
+#include <errno.h>   // for errno
+#include <math.h>    // for cos
+#include "qct.h"
+#include "qctmosaic.h"
+
+#ifdef USE_PNG
+#include <png.h>
+#endif
+
+
+/* -------------------------------------------------------------------------
+ */
+QCTMosaic::QCTMosaic()
+{
+	charts = NULL;
+	num_charts = max_charts = 0;
+	lat_min = lon_min = lat_max = lon_max = 0;
+	lat_step = lon_step = 0;
+	width = height = 0;
+	nthreads = 0;
+	verbose = 0;
+	background = 0xffffff;
+	force_rgb = false;
+	merged = paletted = false;
+	num_colours = 0;
+	colour_map = NULL;
+	index.setSort(QCT_INDEX_SORT_DPP);
+}
+
+
+QCTMosaic::~QCTMosaic()
+{
+	clear();
+}
+
+
+void
+QCTMosaic::clear()
+{
+	int ii;
+
+	for (ii=0; ii<num_charts; ii++)
+		delete charts[ii];
+	free(charts);
+	charts = NULL;
+	num_charts = max_charts = 0;
+	free(colour_map);
+	colour_map = NULL;
+	index.clear();
+	merged = paletted = false;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Open a chart, reading only its header; tiles are decoded as the output
+ * needs them.
+ */
+bool
+QCTMosaic::addFilename(const char *filename)
+{
+	QCT *qct;
+
+	if (num_charts == max_charts)
+	{
+		int max = max_charts ? max_charts * 2 : 16;
+		QCT **more = (QCT**)realloc(charts, max * sizeof(QCT*));
+		if (more == NULL)
+			return false;
+		charts = more;
+		max_charts = max;
+	}
+
+	qct = new QCT;
+	qct->setVerbose(verbose);
+	// Blocks are rendered in parallel so each chart works in one thread
+	qct->setThreads(1);
+	if (!qct->openFilename(filename, true))
+	{
+		delete qct;
+		return false;
+	}
+	if (index.addQCT(qct, filename) != num_charts)
+	{
+		fprintf(stderr, "cannot add %s to the mosaic\n", filename);
+		delete qct;
+		return false;
+	}
+	charts[num_charts++] = qct;
+	merged = false;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Output area and size.
+ */
+bool
+QCTMosaic::setArea(double latmin, double lonmin, double latmax, double lonmax, int out_width, int out_height)
+{
+	if (!(latmin < latmax && lonmin < lonmax) || out_width < 1 || out_height < 0)
+	{
+		fprintf(stderr, "bad mosaic area %f,%f to %f,%f (%dx%d)\n", latmin, lonmin, latmax, lonmax, out_width, out_height);
+		return false;
+	}
+	if (out_height == 0)
+	{
+		double mid = (latmin + latmax) / 2 * M_PI / 180.0;
+		out_height = (int)(out_width * (latmax - latmin) / ((lonmax - lonmin) * cos(mid)) + 0.5);
+		if (out_height < 1)
+			out_height = 1;
+	}
+	lat_min = latmin;
+	lon_min = lonmin;
+	lat_max = latmax;
+	lon_max = lonmax;
+	width = out_width;
+	height = out_height;
+	lat_step = (lat_max - lat_min) / height;
+	lon_step = (lon_max - lon_min) / width;
+	merged = false;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * One output palette from those of the charts in the area, with the
+ * background colour first.  If there are too many colours the output is
+ * R,G,B instead.
+ */
+bool
+QCTMosaic::mergePalettes()
+{
+	int ii, jj, kk, num, *ids;
+
+	if (width < 1 || height < 1)
+	{
+		fprintf(stderr, "mosaic area not set\n");
+		return false;
+	}
+	free(colour_map);
+	colour_map = (unsigned char*)calloc(num_charts * 256 + 1, 1);
+	ids = (int*)malloc((num_charts + 1) * sizeof(int));
+	if (colour_map == NULL || ids == NULL)
+	{
+		free(ids);
+		return false;
+	}
+
+	// The blocks search the index in parallel so it is built here first
+	if (!index.isBuilt() && !index.build())
+	{
+		free(ids);
+		return false;
+	}
+	num = index.findBox(lat_min, lon_min, lat_max, lon_max, ids, num_charts);
+	if (verbose)
+		printf("mosaic of %d charts, %dx%d pixels\n", num, width, height);
+
+	palette[0] = background;
+	num_colours = 1;
+	paletted = !force_rgb;
+	for (ii=0; paletted && ii<num; ii++)
+	{
+		const int *pal = charts[ids[ii]]->getOutputPalette();
+		unsigned char *map = colour_map + ids[ii] * 256;
+		for (jj=0; paletted && jj<256; jj++)
+		{
+			// Never sampled, the outline is checked instead
+			if (jj == QCT_TRANSPARENT_INDEX)
+				continue;
+			for (kk=0; kk<num_colours && palette[kk] != pal[jj]; kk++)
+				;
+			if (kk == num_colours)
+			{
+				if (num_colours == 256)
+				{
+					paletted = false;
+					break;
+				}
+				palette[num_colours++] = pal[jj];
+			}
+			map[jj] = kk;
+		}
+	}
+	if (verbose && paletted)
+		printf("mosaic palette of %d colours\n", num_colours);
+
+	free(ids);
+	merged = true;
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Rendering.
+ * Each block of the strip asks the index for the charts overlapping it,
+ * most detailed first, and converts its pixels' positions to pixels on
+ * the first chart.  Those inside its outline and image take that
+ * chart's colour, the rest try the next chart, and any left over are the
+ * background.  Most blocks lie inside one chart so only need one pass.
+ */
+struct MosaicStrip
+{
+	QCTMosaic *mosaic;
+	int first_row, rows;     // of the output
+	int blocks_across;
+	unsigned char *out;
+	bool failed;
+};
+
+
+void
+QCTMosaic::blockJob(void *arg, int block)
+{
+	MosaicStrip *ms = (MosaicStrip*)arg;
+	QCTMosaic *mo = ms->mosaic;
+	int x0 = (block % ms->blocks_across) * QCT_MOSAIC_BLOCK;
+	int y0 = (block / ms->blocks_across) * QCT_MOSAIC_BLOCK; // within the strip
+	int ww = mo->width - x0, hh = ms->rows - y0;
+	int ii, jj, nn, num_ids, num_todo;
+	int *ids = NULL, *todo = NULL;
+	double *lat = NULL, *lon = NULL, *px = NULL, *py = NULL;
+
+	if (ww > QCT_MOSAIC_BLOCK) ww = QCT_MOSAIC_BLOCK;
+	if (hh > QCT_MOSAIC_BLOCK) hh = QCT_MOSAIC_BLOCK;
+	nn = ww * hh;
+
+	ids = (int*)malloc((mo->num_charts + 1) * sizeof(int));
+	todo = (int*)malloc(nn * sizeof(int));
+	lat = (double*)malloc(nn * 4 * sizeof(double));
+	if (ids == NULL || todo == NULL || lat == NULL)
+	{
+		ms->failed = true;
+		goto done;
+	}
+	lon = lat + nn;
+	px = lon + nn;
+	py = px + nn;
+
+	// Positions of the pixel centres, todo holds their offsets in the block
+	for (ii=0; ii<nn; ii++)
+	{
+		todo[ii] = ii;
+		lat[ii] = mo->lat_max - (ms->first_row + y0 + ii / ww + 0.5) * mo->lat_step;
+		lon[ii] = mo->lon_min + (x0 + ii % ww + 0.5) * mo->lon_step;
+	}
+	num_todo = nn;
+
+	num_ids = mo->index.findBox(mo->lat_max - (ms->first_row + y0 + hh) * mo->lat_step,
+		mo->lon_min + x0 * mo->lon_step,
+		mo->lat_max - (ms->first_row + y0) * mo->lat_step,
+		mo->lon_min + (x0 + ww) * mo->lon_step, ids, mo->num_charts);
+
+	for (jj=0; jj<num_ids && num_todo>0; jj++)
+	{
+		QCT *qct = mo->charts[ids[jj]];
+		const int *pal = qct->getOutputPalette();
+		const unsigned char *map = mo->colour_map + ids[jj] * 256;
+		const unsigned char *tile = NULL;
+		int full_width = qct->getImageWidth(), full_height = qct->getImageHeight();
+		int tile_num = -1, num_left = 0;
+
+		qct->latLonToPixels(num_todo, lat, lon, px, py);
+		for (ii=0; ii<num_todo; ii++)
+		{
+			if (px[ii] >= 0 && px[ii] < full_width && py[ii] >= 0 && py[ii] < full_height
+				&& qct->insideOutline((int)px[ii], (int)py[ii]))
+			{
+				int xx = (int)px[ii], yy = (int)py[ii];
+				int tn = (yy / QCT_TILE_SIZE) * (full_width / QCT_TILE_SIZE) + xx / QCT_TILE_SIZE;
+				if (tn != tile_num)
+				{
+					tile_num = tn;
+					tile = qct->getTile(xx / QCT_TILE_SIZE, yy / QCT_TILE_SIZE);
+					if (tile == NULL)
+						ms->failed = true;
+				}
+				if (tile)
+				{
+					unsigned char value = tile[(yy % QCT_TILE_SIZE) * QCT_TILE_SIZE + xx % QCT_TILE_SIZE];
+					size_t offset = (size_t)(y0 + todo[ii] / ww) * mo->width + x0 + todo[ii] % ww;
+					if (mo->paletted)
+					{
+						ms->out[offset] = map[value];
+					}
+					else
+					{
+						ms->out[offset*3]   = PAL_RED(pal[value]);
+						ms->out[offset*3+1] = PAL_GREEN(pal[value]);
+						ms->out[offset*3+2] = PAL_BLUE(pal[value]);
+					}
+					continue;
+				}
+			}
+			// Not on this chart, keep it for the next
+			todo[num_left] = todo[ii];
+			lat[num_left] = lat[ii];
+			lon[num_left] = lon[ii];
+			num_left++;
+		}
+		num_todo = num_left;
+	}
+
+	for (ii=0; ii<num_todo; ii++)
+	{
+		size_t offset = (size_t)(y0 + todo[ii] / ww) * mo->width + x0 + todo[ii] % ww;
+		if (mo->paletted)
+		{
+			ms->out[offset] = 0;
+		}
+		else
+		{
+			ms->out[offset*3]   = PAL_RED(mo->background);
+			ms->out[offset*3+1] = PAL_GREEN(mo->background);
+			ms->out[offset*3+2] = PAL_BLUE(mo->background);
+		}
+	}
+
+done:
+	free(ids);
+	free(todo);
+	free(lat);
+}
+
+
+/*
+ * Render getStripHeight() rows (fewer for the last strip) starting at row
+ * strip*getStripHeight() into out, one byte per pixel (an index into
+ * getPalette()) or three (R,G,B) if getPalette() is NULL.
+ */
+bool
+QCTMosaic::readStrip(int strip, unsigned char *out)
+{
+	MosaicStrip ms;
+	int ii, blocks_down;
+
+	if (!merged && !mergePalettes())
+		return false;
+	if (strip < 0 || strip >= getNumStrips())
+		return false;
+
+	ms.mosaic = this;
+	ms.first_row = strip * QCT_MOSAIC_ROWS;
+	ms.rows = height - ms.first_row;
+	if (ms.rows > QCT_MOSAIC_ROWS)
+		ms.rows = QCT_MOSAIC_ROWS;
+	ms.blocks_across = (width + QCT_MOSAIC_BLOCK - 1) / QCT_MOSAIC_BLOCK;
+	ms.out = out;
+	ms.failed = false;
+	blocks_down = (ms.rows + QCT_MOSAIC_BLOCK - 1) / QCT_MOSAIC_BLOCK;
+	parallelFor(ms.blocks_across * blocks_down, nthreads, blockJob, &ms);
+
+	// Keep memory bounded, the tiles at the edge of the strip are decoded
+	// again for the next one
+	for (ii=0; ii<num_charts; ii++)
+		charts[ii]->unloadTiles();
+
+	if (ms.failed)
+		fprintf(stderr, "cannot render mosaic (out of memory)\n");
+	return !ms.failed;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Output files, written one strip at a time.
+ */
+bool
+QCTMosaic::writePPMFile(FILE *fp)
+{
+	unsigned char *strip, *rgb;
+	int ii, jj, rows;
+
+	if (!merged && !mergePalettes())
+		return false;
+	strip = (unsigned char*)malloc((size_t)QCT_MOSAIC_ROWS * width * (paletted ? 4 : 3));
+	if (strip == NULL)
+		return false;
+	rgb = paletted ? strip + (size_t)QCT_MOSAIC_ROWS * width : strip;
+
+	// PPM file header (for raw data not ASCII)
+	fprintf(fp, "P6 %d %d 255\n", width, height);
+
+	for (ii=0; ii<getNumStrips(); ii++)
+	{
+		if (!readStrip(ii, strip))
+			break;
+		rows = height - ii * QCT_MOSAIC_ROWS;
+		if (rows > QCT_MOSAIC_ROWS)
+			rows = QCT_MOSAIC_ROWS;
+		if (paletted)
+		{
+			for (jj=0; jj<rows*width; jj++)
+			{
+				rgb[jj*3]   = PAL_RED(palette[strip[jj]]);
+				rgb[jj*3+1] = PAL_GREEN(palette[strip[jj]]);
+				rgb[jj*3+2] = PAL_BLUE(palette[strip[jj]]);
+			}
+		}
+		if (fwrite(rgb, 3, rows*width, fp) != (size_t)(rows*width))
+			break;
+	}
+	free(strip);
+
+	return (ii == getNumStrips() && !ferror(fp));
+}
+
+
+bool
+QCTMosaic::writePPMFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "cannot open %s (%s)\n", filename, strerror(errno));
+		return false;
+	}
+	truth = writePPMFile(fp);
+	if (fclose(fp))
+	{
+		fprintf(stderr, "cannot write %s (%s)\n", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
+
+
+bool
+QCTMosaic::writePNGFile(FILE *fp)
+{
+#ifdef USE_PNG
+	unsigned char *strip;
+	int ii, jj, rows, bytes_per_pixel;
+
+	if (!merged && !mergePalettes())
+		return false;
+	bytes_per_pixel = paletted ? 1 : 3;
+	strip = (unsigned char*)malloc((size_t)QCT_MOSAIC_ROWS * width * bytes_per_pixel);
+	if (strip == NULL)
+		return false;
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+	if (!png_ptr)
+	{
+		free(strip);
+		return(false);
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+	{
+		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+		free(strip);
+		return (false);
+	}
+
+	// Any errors inside png_ functions will return here
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		fprintf(stderr, "PNG file write error\n");
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		free(strip);
+		return false;
+	}
+
+	png_init_io(png_ptr, fp);
+
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+		8, paletted ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	if (paletted)
+	{
+		png_color pal[256];
+		for (ii=0; ii<num_colours; ii++)
+		{
+			pal[ii].red   = PAL_RED(palette[ii]);
+			pal[ii].green = PAL_GREEN(palette[ii]);
+			pal[ii].blue  = PAL_BLUE(palette[ii]);
+		}
+		png_set_PLTE(png_ptr, info_ptr, pal, num_colours);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	for (ii=0; ii<getNumStrips(); ii++)
+	{
+		if (!readStrip(ii, strip))
+		{
+			png_destroy_write_struct(&png_ptr, &info_ptr);
+			free(strip);
+			return false;
+		}
+		rows = height - ii * QCT_MOSAIC_ROWS;
+		if (rows > QCT_MOSAIC_ROWS)
+			rows = QCT_MOSAIC_ROWS;
+		for (jj=0; jj<rows; jj++)
+			png_write_row(png_ptr, strip + (size_t)jj * width * bytes_per_pixel);
+	}
+
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free(strip);
+
+	return true;
+#else
+	fprintf(stderr, "cannot write file (PNG not supported)\n");
+	return false;
+#endif
+}
+
+
+bool
+QCTMosaic::writePNGFilename(const char *filename)
+{
+	FILE *fp;
+	bool truth;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "cannot open %s (%s)\n", filename, strerror(errno));
+		return false;
+	}
+	truth = writePNGFile(fp);
+	if (fclose(fp))
+	{
+		fprintf(stderr, "cannot write %s (%s)\n", filename, strerror(errno));
+		truth = false;
+	}
+	return(truth);
+}
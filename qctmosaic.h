@@ -0,0 +1,90 @@
+/* > qctmosaic.h
+ */
+
+
+#ifndef QCTMOSAIC_H
+#define QCTMOSAIC_H
+
+
+#include "qctindex.h"
+
+class QCT;
+
+#define QCT_MOSAIC_BLOCK 64    // output pixels square given the same charts
+#define QCT_MOSAIC_ROWS  512   // output rows rendered at a time
+
+
+/* -------------------------------------------------------------------------
+ * Class to stitch several charts into one image of a latitude,longitude
+ * rectangle (degrees WGS84, linear in both).
+ *
+ * Add the chart files (only their headers are read), set the area and
+ * size of the output, then write it or read it a strip at a time.
+ * Each output pixel is taken from the most detailed chart (fewest
+ * degrees per pixel) whose outline contains it, so where charts overlap
+ * the best scale wins and the margins outside a chart's outline show the
+ * chart underneath.  The charts overlapping each block of the output are
+ * found with a QCTIndex and only the tiles the block falls in are decoded.
+ * Blocks are rendered in several threads, which decode different tiles of
+ * the same chart at once (see QCT::getTile); a thread wanting a tile
+ * another is decoding waits for it.  Tiles are dropped after each strip so
+ * memory use depends on the width of the output, not its height.
+ * If the charts' palettes together have no more than 256 colours the
+ * output is paletted (one byte per pixel) otherwise R,G,B.
+ */
+class QCTMosaic
+{
+public:
+	QCTMosaic();
+	~QCTMosaic();
+
+public:
+	bool addFilename(const char *filename);
+	void clear();
+	int  getNumCharts() const { return num_charts; }
+	// To set its palette or draw overlays, before the output is read
+	QCT *getChart(int ii) { return (ii >= 0 && ii < num_charts) ? charts[ii] : NULL; }
+	void setVerbose(int v)     { verbose = v; }
+	void setThreads(int n)     { nthreads = n; } // 0 means one per processor
+	void setBackground(int rgb) { background = rgb; merged = false; } // where no chart
+	void setRGB(bool force)    { force_rgb = force; merged = false; } // never paletted
+
+	// A height of 0 keeps ground distances in proportion at the middle latitude
+	bool setArea(double lat_min, double lon_min, double lat_max, double lon_max, int out_width, int out_height = 0);
+	int  getWidth() const       { return width; }
+	int  getHeight() const      { return height; }
+	int  getNumStrips() const   { return (height + QCT_MOSAIC_ROWS - 1) / QCT_MOSAIC_ROWS; }
+	int  getStripHeight() const { return QCT_MOSAIC_ROWS; } // the last may be shorter
+	// Merge the palettes of the charts in the area.  Called by readStrip
+	// and the write methods when needed, call it again after changing a
+	// chart's palette.  getPalette is NULL when the output is R,G,B.
+	bool mergePalettes();
+	const int *getPalette() const { return paletted ? palette : NULL; }
+	int  getNumColours() const    { return paletted ? num_colours : 0; }
+	bool readStrip(int strip, unsigned char *out);
+
+	bool writePPMFile(FILE *);
+	bool writePPMFilename(const char *filename);
+	bool writePNGFile(FILE *);
+	bool writePNGFilename(const char *filename);
+
+private:
+	static void blockJob(void *arg, int block);
+
+private:
+	QCT **charts;
+	int num_charts, max_charts;
+	QCTIndex index;            // ids are positions in charts
+	double lat_min, lon_min, lat_max, lon_max;
+	double lat_step, lon_step; // degrees per output pixel
+	int width, height;
+	int nthreads, verbose;
+	int background;
+	bool force_rgb;
+	bool merged, paletted;
+	int palette[256], num_colours;
+	unsigned char *colour_map; // 256 per chart: chart palette index to output index
+};
+
+
+#endif // !QCTMOSAIC_H
@@ -0,0 +1,151 @@
+/* > qcttiles.cpp
+ */
+
+/*
+ * The QCTTileArchive class reads the single file tile archives written
+ * by QCT::exportTileArchive, see qcttiles.h for the format.
+ */
+
+/*
+ * Includes
+ */
+#include <stdio.h>
+#include <string.h>  // for strerror
+#include <errno.h>   // for errno
+#include <fcntl.h>   // for open
+#include <unistd.h>  // for close
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "qcttiles.h"
+#include "qctbytes.h"
+
+
+/* -------------------------------------------------------------------------
+ */
+QCTTileArchive::QCTTileArchive()
+{
+	map = NULL;
+	map_size = 0;
+	num_tiles = 0;
+}
+
+
+QCTTileArchive::~QCTTileArchive()
+{
+	closeFilename();
+}
+
+
+bool
+QCTTileArchive::openFilename(const char *filename)
+{
+	struct stat st;
+	int fd;
+
+	closeFilename();
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "cannot open %s (%s)\n", filename, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < QCT_TILES_HEADER_SIZE)
+	{
+		fprintf(stderr, "cannot read %s (not a tile archive)\n", filename);
+		close(fd);
+		return false;
+	}
+	map_size = st.st_size;
+	map = (unsigned char*)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == (unsigned char*)MAP_FAILED)
+	{
+		fprintf(stderr, "cannot map %s (%s)\n", filename, strerror(errno));
+		map = NULL;
+		return false;
+	}
+
+	num_tiles = (int)getLong(map + 12);
+	if (memcmp(map, QCT_TILES_MAGIC, 8) != 0 ||
+		getLong(map + 8) != QCT_TILES_VERSION ||
+		num_tiles < 0 ||
+		QCT_TILES_HEADER_SIZE + (size_t)num_tiles * QCT_TILES_ENTRY_SIZE > map_size)
+	{
+		fprintf(stderr, "cannot read %s (not a tile archive)\n", filename);
+		closeFilename();
+		return false;
+	}
+	return true;
+}
+
+
+void
+QCTTileArchive::closeFilename()
+{
+	if (map)
+		munmap(map, map_size);
+	map = NULL;
+	map_size = 0;
+	num_tiles = 0;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Return the zoom,x,y of the index'th tile (in directory order).
+ */
+bool
+QCTTileArchive::getEntry(int index, int *zoom, int *x, int *y) const
+{
+	const unsigned char *entry;
+
+	if (index < 0 || index >= num_tiles)
+		return false;
+	entry = map + QCT_TILES_HEADER_SIZE + (size_t)index * QCT_TILES_ENTRY_SIZE;
+	*zoom = getLong(entry);
+	*x = getLong(entry+4);
+	*y = getLong(entry+8);
+	return true;
+}
+
+
+/* -------------------------------------------------------------------------
+ * Return a pointer to the tile data and its length,
+ * or NULL if the tile is not in the archive.
+ */
+const unsigned char *
+QCTTileArchive::getTile(int zoom, int x, int y, unsigned int *length) const
+{
+	const unsigned char *entry;
+	unsigned int key[3], val[3];
+	unsigned long long offset;
+	int lo = 0, hi = num_tiles - 1, mid, kk, cmp;
+
+	key[0] = zoom;
+	key[1] = x;
+	key[2] = y;
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		entry = map + QCT_TILES_HEADER_SIZE + (size_t)mid * QCT_TILES_ENTRY_SIZE;
+		cmp = 0;
+		for (kk=0; kk<3 && cmp==0; kk++)
+		{
+			val[kk] = getLong(entry + kk*4);
+			cmp = (key[kk] < val[kk]) ? -1 : (key[kk] > val[kk]) ? 1 : 0;
+		}
+		if (cmp < 0)
+			hi = mid - 1;
+		else if (cmp > 0)
+			lo = mid + 1;
+		else
+		{
+			*length = getLong(entry + 12);
+			offset = getLongLong(entry + 16);
+			if (offset + *length > map_size)
+				return NULL;
+			return map + offset;
+		}
+	}
+	return NULL;
+}
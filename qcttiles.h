@@ -0,0 +1,52 @@
+/* > qcttiles.h
+ */
+
+
+#ifndef QCTTILES_H
+#define QCTTILES_H
+
+
+/* -------------------------------------------------------------------------
+ * Single file tile archive as written by QCT::exportTileArchive.
+ * All values are little-endian.
+ *   Header:    "QCTTILES", version (4 bytes), number of tiles (4 bytes)
+ *   Directory: one entry per tile, sorted by zoom then x then y, each
+ *              zoom, x, y, length (4 bytes each), file offset (8 bytes)
+ *   Data:      the tiles (PNG files) at the offsets given in the directory
+ * There may be unused space between the directory and the data.
+ */
+#define QCT_TILES_MAGIC       "QCTTILES"
+#define QCT_TILES_VERSION     1
+#define QCT_TILES_HEADER_SIZE 16
+#define QCT_TILES_ENTRY_SIZE  24
+
+
+/* -------------------------------------------------------------------------
+ * Class to read a tile archive.
+ *
+ * The whole file is mapped into memory by openFilename and getTile then
+ * finds a tile with a binary search of the directory, returning a pointer
+ * straight into the mapped file, so no system calls are needed per tile.
+ */
+class QCTTileArchive
+{
+public:
+	QCTTileArchive();
+	~QCTTileArchive();
+
+public:
+	bool openFilename(const char *filename);
+	void closeFilename();
+
+	int  getNumTiles() const { return num_tiles; }
+	bool getEntry(int index, int *zoom, int *x, int *y) const;
+	const unsigned char *getTile(int zoom, int x, int y, unsigned int *length) const;
+
+private:
+	unsigned char *map;
+	size_t map_size;
+	int num_tiles;
+};
+
+
+#endif // !QCTTILES_H